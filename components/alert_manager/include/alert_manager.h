@@ -0,0 +1,41 @@
+#pragma once
+#include "esp_err.h"
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief 加载重启前的告警集合 (在 app_storage_init 与默认事件循环创建之后调用)
+ * 未上报的触发/清除在 MQTT 连上后补发；恢复的触发告警若来源在 10 分钟内未重新触发，按清除上报
+ */
+esp_err_t alert_manager_init(void);
+
+/**
+ * @brief 告警发生 (alert_code_t)
+ * 首次发生时等待 3 秒确认，期间未清除才记入上报批次并投递 APP_EVENT_ALERT_RAISED；
+ * 已处于触发状态时只累加次数与最近时间
+ */
+void alert_manager_raise(int code);
+
+/**
+ * @brief 告警条件消失
+ * 持续保持一段时间后才上报清除，期间再次发生视为同一次告警 (抖动过滤)；
+ * 同一告警码 1 小时内触发达到 3 次后，清除推迟到该小时结束
+ */
+void alert_manager_clear(int code);
+
+/**
+ * @brief 告警当前是否处于触发状态
+ */
+bool alert_manager_is_active(int code);
+
+/**
+ * @brief 处理到期的清除并合并上报本周期的变化 (每秒调用一次)
+ */
+void alert_manager_tick(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,338 @@
+// alert_manager.c 告警管理
+// 维护当前告警集合 (首次/最近发生时间与次数)，同一告警未清除前只上报一次触发；
+// 条件持续一段时间才上报触发，条件消失后保持一段时间才上报清除，频繁反复的告警延长保持时间；
+// 每秒把本周期内的触发/清除合并为一条消息上报，离线期间保留，重启后恢复
+#include "alert_manager.h"
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_event.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "app_storage.h"
+#include "app_events.h"
+#include "protocol.h"
+#include "mqtt_manager.h"
+
+static const char *TAG = "ALERT";
+
+#define TIME_VALID_THRESHOLD  1700000000 // 早于该时间说明尚未对时
+#define ALERT_RAISE_HOLD_SEC  3          // 条件持续该时长才上报触发，期间清除视为抖动
+#define ALERT_CLEAR_HOLD_SEC  30         // 条件消失后保持该时长才上报清除
+#define ALERT_FLAP_WINDOW_SEC 3600       // 频繁触发统计窗口
+#define ALERT_FLAP_MAX        3          // 窗口内触发达到该次数后，清除推迟到窗口结束
+#define ALERT_FLAP_CODES      16         // 同时统计频繁触发的告警码数量
+#define ALERT_PENDING_MAX     8          // 同时等待确认的触发数量，满时直接触发
+#define ALERT_FLUSH_MIN_SEC   5          // 两次上报的最小间隔 (突发变化合并为一条)
+#define ALERT_SAVE_INTERVAL_SEC (10 * 60) // 仅次数/最近时间变化时的落盘间隔
+#define ALERT_RESTORE_HOLD_SEC  (10 * 60) // 重启前的触发告警等待来源重新确认的时长，超时按清除处理
+
+// 运行期状态 (不持久化，与 s_store.slots 一一对应)
+typedef struct {
+    uint32_t clear_at;   // 计划清除的开机秒数，0 = 未计划
+    bool restored;       // 从重启前恢复、尚未被来源重新确认
+} alert_rt_t;
+
+// 频繁触发统计 (按告警码记录：清除上报后位置会被回收，窗口不能跟着位置走)
+typedef struct {
+    uint8_t code;
+    uint8_t trigs;       // 窗口内触发次数，0 = 空闲
+    uint32_t win_start;  // 窗口起点 (开机秒数)
+} alert_flap_t;
+
+// 等待确认的触发 (尚未进入告警集合)
+typedef struct {
+    bool used;
+    uint8_t code;
+    uint32_t raise_at;   // 计划上报触发的开机秒数
+    uint32_t first_ts;   // 条件出现时的 UTC 秒数
+} alert_pending_t;
+
+static SemaphoreHandle_t s_lock = NULL;
+static alert_store_t s_store;
+static alert_rt_t s_rt[ALERT_SLOTS];
+static alert_flap_t s_flap[ALERT_FLAP_CODES];
+static alert_pending_t s_pending[ALERT_PENDING_MAX];
+static bool s_online = false;
+static bool s_counts_dirty = false;   // 次数/最近时间有未落盘的变化
+static uint32_t s_last_save = 0;
+static uint32_t s_last_flush = 0;
+
+static uint32_t uptime_sec(void) {
+    return (uint32_t)(esp_timer_get_time() / 1000000);
+}
+
+static uint32_t wall_now(void) {
+    time_t now = time(NULL);
+    return (now >= TIME_VALID_THRESHOLD) ? (uint32_t)now : 0;
+}
+
+static int find_slot(int code) {
+    for (int i = 0; i < ALERT_SLOTS; i++) {
+        if ((s_store.slots[i].flags & ALERT_SLOT_USED) && s_store.slots[i].code == code) return i;
+    }
+    return -1;
+}
+
+// 空位优先，其次复用已清除但尚未上报的记录 (保留触发中的告警)
+static int alloc_slot(void) {
+    int victim = -1;
+    for (int i = 0; i < ALERT_SLOTS; i++) {
+        uint8_t f = s_store.slots[i].flags;
+        if (!(f & ALERT_SLOT_USED)) return i;
+        if (victim < 0 && !(f & ALERT_SLOT_ACTIVE)) victim = i;
+    }
+    return victim;
+}
+
+// 查找告警码的统计窗口，窗口已过期的视为空闲 (持锁调用)
+static alert_flap_t *flap_find(int code, uint32_t now) {
+    for (int i = 0; i < ALERT_FLAP_CODES; i++) {
+        alert_flap_t *f = &s_flap[i];
+        if (f->trigs && now - f->win_start >= ALERT_FLAP_WINDOW_SEC) f->trigs = 0;
+        if (f->trigs && f->code == code) return f;
+    }
+    return NULL;
+}
+
+// 记录一次触发 (持锁调用)
+static void flap_count(int code, uint32_t now) {
+    alert_flap_t *f = flap_find(code, now);
+    if (!f) {
+        // 空闲项优先，表满时替换窗口最早开始的告警码
+        f = &s_flap[0];
+        for (int i = 0; i < ALERT_FLAP_CODES; i++) {
+            if (!s_flap[i].trigs) {
+                f = &s_flap[i];
+                break;
+            }
+            if (s_flap[i].win_start < f->win_start) f = &s_flap[i];
+        }
+        *f = (alert_flap_t){ .code = (uint8_t)code, .trigs = 0, .win_start = now };
+    }
+    if (f->trigs < UINT8_MAX) f->trigs++;
+}
+
+static alert_pending_t *pending_find(int code) {
+    for (int i = 0; i < ALERT_PENDING_MAX; i++) {
+        if (s_pending[i].used && s_pending[i].code == code) return &s_pending[i];
+    }
+    return NULL;
+}
+
+static alert_pending_t *pending_alloc(void) {
+    for (int i = 0; i < ALERT_PENDING_MAX; i++) {
+        if (!s_pending[i].used) return &s_pending[i];
+    }
+    return NULL;
+}
+
+// 持锁调用
+static void save_locked(void) {
+    app_storage_save_alerts(&s_store);
+    s_counts_dirty = false;
+    s_last_save = uptime_sec();
+}
+
+static void on_mqtt_event(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+    s_online = (event_id == APP_EVENT_MQTT_CONNECTED);
+}
+
+esp_err_t alert_manager_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    if (!s_lock) return ESP_ERR_NO_MEM;
+
+    if (app_storage_load_alerts(&s_store) != ESP_OK) {
+        memset(&s_store, 0, sizeof(s_store));
+    }
+    // 告警来源 (规则引擎/状态机) 的运行状态不持久化，重启后条件仍成立会重新触发；
+    // 恢复的触发告警先计划清除，来源重新确认时撤销，否则到期按正常流程上报清除
+    int active = 0;
+    uint32_t clear_at = uptime_sec() + ALERT_RESTORE_HOLD_SEC;
+    for (int i = 0; i < ALERT_SLOTS; i++) {
+        if (s_store.slots[i].flags & ALERT_SLOT_ACTIVE) {
+            s_rt[i].clear_at = clear_at;
+            s_rt[i].restored = true;
+            active++;
+        }
+    }
+    ESP_LOGI(TAG, "Alert set loaded, %d active", active);
+
+    esp_event_handler_register(APP_EVENTS, APP_EVENT_MQTT_CONNECTED, on_mqtt_event, NULL);
+    return esp_event_handler_register(APP_EVENTS, APP_EVENT_MQTT_DISCONNECTED, on_mqtt_event, NULL);
+}
+
+// 告警进入触发状态并记入上报批次，返回 false 表示告警集合已满 (持锁调用)
+static bool trigger_locked(int code, uint32_t ts, uint32_t now) {
+    int i = find_slot(code);
+    if (i < 0) i = alloc_slot();
+    if (i < 0) {
+        ESP_LOGW(TAG, "Alert table full, code %d dropped", code);
+        return false;
+    }
+    s_store.slots[i] = (alert_slot_t){
+        .code = (uint8_t)code,
+        .flags = ALERT_SLOT_USED | ALERT_SLOT_ACTIVE | ALERT_SLOT_REPORT,
+        .count = 1,
+        .first_ts = ts,
+        .last_ts = ts,
+    };
+    s_rt[i].clear_at = 0;
+    s_rt[i].restored = false;
+    flap_count(code, now);
+    save_locked();
+    return true;
+}
+
+void alert_manager_raise(int code) {
+    if (!s_lock) return;
+    uint32_t now = uptime_sec();
+    uint32_t ts = wall_now();
+    bool triggered = false;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    int i = find_slot(code);
+    if (i >= 0 && (s_store.slots[i].flags & ALERT_SLOT_ACTIVE)) {
+        // 仍在触发中：只累加，待清除的计划作废 (重启后的重新确认不计为新的一次)
+        alert_slot_t *s = &s_store.slots[i];
+        if (s_rt[i].restored) {
+            s_rt[i].restored = false;
+        } else {
+            if (s->count < UINT16_MAX) s->count++;
+            s->last_ts = ts;
+            s_counts_dirty = true;
+        }
+        s_rt[i].clear_at = 0;
+    } else if (!pending_find(code)) {
+        // 新的触发先等待确认，到期仍未清除才进入告警集合 (见 alert_manager_tick)
+        alert_pending_t *p = pending_alloc();
+        if (p) {
+            *p = (alert_pending_t){ .used = true, .code = (uint8_t)code, .raise_at = now + ALERT_RAISE_HOLD_SEC, .first_ts = ts };
+        } else {
+            triggered = trigger_locked(code, ts, now);
+        }
+    }
+    xSemaphoreGive(s_lock);
+
+    if (triggered) {
+        ESP_LOGW(TAG, "Alert %d triggered", code);
+        app_events_post_alert_raised(code);
+    }
+}
+
+void alert_manager_clear(int code) {
+    if (!s_lock) return;
+    uint32_t now = uptime_sec();
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    alert_pending_t *p = pending_find(code);
+    if (p) p->used = false; // 未到确认时间即消失：抖动，不上报
+    int i = find_slot(code);
+    if (i >= 0 && (s_store.slots[i].flags & ALERT_SLOT_ACTIVE) && s_rt[i].clear_at == 0) {
+        uint32_t at = now + ALERT_CLEAR_HOLD_SEC;
+        // 窗口内反复触发：保持到窗口结束，避免每次抖动都上报一对触发/清除
+        const alert_flap_t *f = flap_find(code, now);
+        if (f && f->trigs >= ALERT_FLAP_MAX) {
+            uint32_t win_end = f->win_start + ALERT_FLAP_WINDOW_SEC;
+            if (win_end > at) at = win_end;
+        }
+        s_rt[i].clear_at = at;
+    }
+    xSemaphoreGive(s_lock);
+}
+
+bool alert_manager_is_active(int code) {
+    if (!s_lock) return false;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    int i = find_slot(code);
+    bool active = (i >= 0) && (s_store.slots[i].flags & ALERT_SLOT_ACTIVE);
+    xSemaphoreGive(s_lock);
+    return active;
+}
+
+void alert_manager_tick(void) {
+    if (!s_lock) return;
+    uint32_t now = uptime_sec();
+    alert_batch_t batch;
+    uint8_t sent_flags[ALERT_SLOTS];
+    int raised[ALERT_PENDING_MAX];
+    int raised_count = 0;
+    bool changed = false;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    // 1. 确认到期的触发
+    for (int i = 0; i < ALERT_PENDING_MAX; i++) {
+        alert_pending_t *p = &s_pending[i];
+        if (!p->used || now < p->raise_at) continue;
+        p->used = false;
+        if (trigger_locked(p->code, p->first_ts, now)) raised[raised_count++] = p->code;
+    }
+    xSemaphoreGive(s_lock);
+    for (int i = 0; i < raised_count; i++) {
+        ESP_LOGW(TAG, "Alert %d triggered", raised[i]);
+        app_events_post_alert_raised(raised[i]);
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    // 2. 到期的清除
+    for (int i = 0; i < ALERT_SLOTS; i++) {
+        alert_slot_t *s = &s_store.slots[i];
+        if ((s->flags & ALERT_SLOT_ACTIVE) && s_rt[i].clear_at != 0 && now >= s_rt[i].clear_at) {
+            s->flags = (s->flags & ~ALERT_SLOT_ACTIVE) | ALERT_SLOT_REPORT;
+            s_rt[i].clear_at = 0;
+            s_rt[i].restored = false;
+            changed = true;
+            ESP_LOGI(TAG, "Alert %d cleared after %u occurrences", s->code, s->count);
+        }
+    }
+    if (changed) {
+        save_locked();
+    } else if (s_counts_dirty && now - s_last_save >= ALERT_SAVE_INTERVAL_SEC) {
+        save_locked();
+    }
+
+    // 3. 合并本周期的变化
+    bool pending = false;
+    for (int i = 0; i < ALERT_SLOTS; i++) {
+        if (s_store.slots[i].flags & ALERT_SLOT_REPORT) pending = true;
+    }
+    if (!pending || !s_online || (s_last_flush != 0 && now - s_last_flush < ALERT_FLUSH_MIN_SEC)) {
+        xSemaphoreGive(s_lock);
+        return;
+    }
+    memset(&batch, 0, sizeof(batch));
+    for (int i = 0; i < ALERT_SLOTS; i++) {
+        const alert_slot_t *s = &s_store.slots[i];
+        sent_flags[i] = s->flags;
+        if (s->flags & ALERT_SLOT_ACTIVE) {
+            batch.active_codes[batch.active_count++] = s->code;
+        }
+        if (!(s->flags & ALERT_SLOT_REPORT)) continue;
+        alert_item_t *a = &batch.items[batch.count++];
+        a->alert_code = s->code;
+        strncpy(a->status, (s->flags & ALERT_SLOT_ACTIVE) ? "triggered" : "cleared", sizeof(a->status) - 1);
+        a->first_ts = s->first_ts;
+        a->last_ts = s->last_ts;
+        a->count = s->count;
+    }
+    s_last_flush = now;
+    xSemaphoreGive(s_lock);
+
+    if (mqtt_manager_publish_alert_batch(&batch) != ESP_OK) return;
+
+    // 4. 已上报的变化出队 (上报期间状态又变化的留到下一批)
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < ALERT_SLOTS; i++) {
+        alert_slot_t *s = &s_store.slots[i];
+        if (!(sent_flags[i] & ALERT_SLOT_REPORT) || s->flags != sent_flags[i]) continue;
+        if (s->flags & ALERT_SLOT_ACTIVE) {
+            s->flags &= ~ALERT_SLOT_REPORT;
+        } else {
+            memset(s, 0, sizeof(*s));
+        }
+    }
+    save_locked();
+    xSemaphoreGive(s_lock);
+    ESP_LOGI(TAG, "Alert batch sent: %d changes, %d active", batch.count, batch.active_count);
+}
@@ -28,6 +28,10 @@ typedef enum {
     APP_EVENT_CMD_START_WASH,          // 云端下发或按键触发的冲洗指令
     APP_EVENT_CMD_EVALUATE,            // 云端更新套餐或开关机后，要求状态机重新评估鉴权
     APP_EVENT_OTA_START,               // 触发OTA升级
+
+    // --- 状态通知事件 (供上报调度等模块订阅) ---
+    APP_EVENT_WATER_STATE_CHANGED,     // 制水业务状态转移 (app_event_water_state_t)
+    APP_EVENT_ALERT_RAISED,            // 告警触发 (app_event_alert_t)，清除前重复发生不再通知
 } app_event_id_t;
 
 typedef struct {
@@ -43,6 +47,15 @@ typedef struct {
     int type; // app_net_type_t
 } app_event_net_status_t;
 
+typedef struct {
+    int prev; // water_state_t
+    int next;
+} app_event_water_state_t;
+
+typedef struct {
+    int code; // alert_code
+} app_event_alert_t;
+
 esp_err_t app_events_post_net_mode_request(int mode);
 esp_err_t app_events_post_mqtt_config_updated(void);
 esp_err_t app_events_post_mqtt_plan_received(void);
@@ -50,6 +63,9 @@ esp_err_t app_events_post_net_ready(int net_type);
 esp_err_t app_events_post_net_lost(int net_type);
 esp_err_t app_events_post_mqtt_connected(void);
 esp_err_t app_events_post_mqtt_disconnected(void);
+// 以下两个通知可能在事件循环内投递，队列满时直接丢弃而不阻塞
+esp_err_t app_events_post_water_state_changed(int prev, int next);
+esp_err_t app_events_post_alert_raised(int code);
 
 #ifdef __cplusplus
 }
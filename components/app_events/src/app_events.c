@@ -33,3 +33,13 @@ esp_err_t app_events_post_mqtt_connected(void) {
 esp_err_t app_events_post_mqtt_disconnected(void) {
     return esp_event_post(APP_EVENTS, APP_EVENT_MQTT_DISCONNECTED, NULL, 0, portMAX_DELAY);
 }
+
+esp_err_t app_events_post_water_state_changed(int prev, int next) {
+    app_event_water_state_t evt = {.prev = prev, .next = next};
+    return esp_event_post(APP_EVENTS, APP_EVENT_WATER_STATE_CHANGED, &evt, sizeof(evt), 0);
+}
+
+esp_err_t app_events_post_alert_raised(int code) {
+    app_event_alert_t evt = {.code = code};
+    return esp_event_post(APP_EVENTS, APP_EVENT_ALERT_RAISED, &evt, sizeof(evt), 0);
+}
@@ -1,11 +1,29 @@
 #pragma once
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef enum {
+    WATER_STATE_INIT = 0,
+    WATER_STATE_WASHING,     // 冲洗状态
+    WATER_STATE_MAKING,      // 制水状态
+    WATER_STATE_FULL,        // 水满状态
+    WATER_STATE_SHORTAGE,    // 缺水状态
+    WATER_STATE_FAULT,       // 故障状态
+    WATER_STATE_DEFERRED,    // 分时计划推迟制水 (水桶未满，禁止时段内待机)
+    WATER_STATE_MAX
+} water_state_t;
+
 void app_fsm_init(void);
 
+// 当前制水业务状态 (供上报调度等模块只读查询)
+water_state_t app_fsm_get_water_state(void);
+
+// 水机空闲：水满/鉴权待机，且无前置冲洗、进行中的冲洗或即将到期的定期冲洗 (可安全重启)
+bool app_fsm_is_idle(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -2,6 +2,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 #include "esp_log.h"
 #include "esp_event.h"
 #include "esp_system.h"
@@ -17,6 +18,13 @@
 #include "bsp_pump_valve.h"
 #include "bsp_sensor.h"
 #include "bsp_pump_valve.h"
+#include "metering.h"
+#include "usage_stats.h"
+#include "alert_manager.h"
+#include "rule_engine.h"
+#include "tunables.h"
+#include "cmd_trace.h"
+#include "tou_schedule.h"
 
 
 // ============================================================================
@@ -30,15 +38,6 @@ typedef enum {
     FSM_STATE_RUNNING,
 } fsm_state_t;
 
-typedef enum {
-    WATER_STATE_INIT = 0,
-    WATER_STATE_WASHING,     // 冲洗状态
-    WATER_STATE_MAKING,      // 制水状态
-    WATER_STATE_FULL,        // 水满状态
-    WATER_STATE_SHORTAGE,    // 缺水状态
-    WATER_STATE_FAULT        // 故障状态
-} water_state_t;
-
 // 定义专属于水机流转的内部事件基，用于解耦硬件中断与状态机评估
 ESP_EVENT_DEFINE_BASE(WATER_INTERNAL_EVENTS);
 enum {
@@ -52,6 +51,12 @@ enum {
 // ============================================================================
 static const char *TAG = "APP_FSM";
 
+#define TIME_VALID_THRESHOLD 1700000000 // 早于该时间说明尚未对时
+#define PUMP_SUPPLY_MV       24000      // 水泵标称供电电压 (mV)，能耗 = 电流 x 标称电压
+#define PUMP_HEALTHY_SEC     60         // 连续正常运行该时长后清除水泵异常告警
+#define IDLE_WASH_MARGIN_SEC 600        // 定期冲洗剩余时间不足该值时不算空闲
+#define FLOW_WINDOW_SEC      60         // 流量滑动窗口：慢速漏水每秒不足 1 个脉冲，按窗口内累计脉冲折算
+
 static fsm_state_t s_state = FSM_STATE_IDLE;             // 网络/MQTT状态
 static water_state_t s_water_state = WATER_STATE_INIT;   // 制水业务状态
 static bool s_net_ready = false;
@@ -63,17 +68,22 @@ static bool s_hw_high_pressure = false; // true = 水满
 // 业务流转标志与计时器
 static bool s_need_pre_wash = false;        // 是否需要制水前置冲洗
 static uint32_t s_making_water_seconds = 0; // 单次连续制水时长(秒)
-static uint32_t s_total_making_time = 0;    // 累计制水时长(秒) - 用于2小时冲洗
-static uint32_t s_time_since_last_wash = 0; // 距离上次冲洗时长(秒) - 用于6小时冲洗
-static uint32_t s_fault_timer_seconds = 0;  // 故障恢复倒计时(秒) - 用于30分钟恢复
+static uint32_t s_total_making_time = 0;    // 累计制水时长(秒) - 用于维护冲洗 (TUN_MAINT_WASH_SEC)
+static uint32_t s_time_since_last_wash = 0; // 距离上次冲洗时长(秒) - 用于定期冲洗 (TUN_IDLE_WASH_SEC)
+static uint32_t s_fault_timer_seconds = 0;  // 故障恢复倒计时(秒) - 用于故障恢复 (TUN_FAULT_REST_SEC)
+static uint32_t s_demand_seconds = 0;       // 水桶离开水满的时长(秒) - 用于分时推迟的保底
 
-static float s_accumulated_liters = 0.0f;
+static uint32_t s_flow_pulse_frac = 0;      // 不足 1 毫升的脉冲余量 (x1000)
+static uint16_t s_flow_win[FLOW_WINDOW_SEC]; // 最近每秒的流量脉冲数 (环形)
+static uint8_t s_flow_win_len = 0;
+static uint8_t s_flow_win_pos = 0;
+static uint32_t s_flow_win_sum = 0;
+static bool s_flow_win_pumping = false;     // 窗口对应的阀门状态 (制水/冲洗 或 进水阀关闭)
 
-static TimerHandle_t s_wash_timer = NULL;   // 18秒冲洗倒计时
+static TimerHandle_t s_wash_timer = NULL;   // 冲洗倒计时 (TUN_WASH_SEC)
 
 // --- 新增：水泵自适应与保护变量 ---
-static float s_pump_limit_over = 3.0f; // 默认给个大值，防止启动误判
-static float s_pump_limit_dry  = 0.5f; // 空转阈值通常通用
+// 过流阈值按识别出的规格取对应参数 (未识别时取 400G 的较大值，防止启动误判)，空转阈值通用
 static bool  s_pump_recognized = false;// 是否已完成硬件识别
 static uint8_t s_pump_overcurrent_cnt = 0;
 static uint8_t s_pump_dryrun_cnt = 0;
@@ -81,6 +91,15 @@ static uint32_t s_pump_run_seconds = 0;
 
 static uint8_t s_pump_spec_cached = 0;
 
+static float pump_limit_over(void) {
+    int32_t ma = (s_pump_spec_cached == 1) ? tunable(TUN_PUMP_100G_MA) : tunable(TUN_PUMP_400G_MA);
+    return ma / 1000.0f;
+}
+
+static float pump_limit_dry(void) {
+    return tunable(TUN_PUMP_DRY_MA) / 1000.0f;
+}
+
 // ============================================================================
 // [模块一] 原有的网络与 MQTT 管理逻辑 (原封不动保留)
 // ============================================================================
@@ -170,6 +189,103 @@ static bool check_quota_allow_water(void) {
     return true;
 }
 
+// --- 制水会话记录 ---
+// 进入制水时开始、离开制水时结束并上报一条 (水量取流量计脉冲，TDS 取会话内的采样快照平均)
+typedef struct {
+    bool active;
+    uint32_t start_ts;      // Unix 秒，未对时为 0
+    int64_t start_us;
+    uint32_t volume_ml;
+    uint32_t peak_pump_ma;
+    uint32_t energy_mj;     // 6 小时连续制水上限下不会溢出
+    uint32_t tds_in_sum;
+    uint32_t tds_out_sum;
+    uint32_t tds_n;
+    int64_t tds_seen_us;    // 已计入的 TDS 快照
+} water_session_t;
+
+static water_session_t s_session;
+
+static uint32_t wall_time_now(void) {
+    time_t now = time(NULL);
+    return (now >= TIME_VALID_THRESHOLD) ? (uint32_t)now : 0;
+}
+
+static void session_begin(void) {
+    memset(&s_session, 0, sizeof(s_session));
+    s_session.active = true;
+    s_session.start_ts = wall_time_now();
+    s_session.start_us = esp_timer_get_time();
+    // 进入制水前的快照不计入本次会话
+    bsp_tds_snapshot_t snap;
+    bsp_sensor_get_tds_snapshot(&snap);
+    s_session.tds_seen_us = snap.sample_us;
+}
+
+// 制水期间每秒调用
+static void session_tick(uint32_t ml, uint32_t pump_ma, uint32_t energy_mj) {
+    if (!s_session.active) return;
+    s_session.volume_ml += ml;
+    s_session.energy_mj += energy_mj;
+    if (pump_ma > s_session.peak_pump_ma) s_session.peak_pump_ma = pump_ma;
+
+    bsp_tds_snapshot_t snap;
+    bsp_sensor_get_tds_snapshot(&snap);
+    if (snap.sample_us != 0 && snap.sample_us != s_session.tds_seen_us) {
+        s_session.tds_seen_us = snap.sample_us;
+        s_session.tds_in_sum += (uint32_t)snap.tds_in;
+        s_session.tds_out_sum += (uint32_t)snap.tds_out;
+        s_session.tds_n++;
+    }
+}
+
+static void session_end(water_state_t next) {
+    if (!s_session.active) return;
+    s_session.active = false;
+
+    uint32_t duration = (uint32_t)((esp_timer_get_time() - s_session.start_us) / 1000000);
+    if (duration == 0 && s_session.volume_ml == 0) return; // 刚进入就退出，不产生记录
+
+    session_report_t rpt = {
+        .start_ts = s_session.start_ts,
+        .end_ts = wall_time_now(),
+        .duration_sec = duration,
+        .volume_ml = s_session.volume_ml,
+        .flow_ml_min = duration ? (uint32_t)((uint64_t)s_session.volume_ml * 60 / duration) : 0,
+        .tds_in_avg = -1,
+        .tds_out_avg = -1,
+        .rejection_permille = -1,
+        .peak_pump_ma = s_session.peak_pump_ma,
+        .end_state = next,
+    };
+    if (s_session.tds_n > 0) {
+        rpt.tds_in_avg = (int)(s_session.tds_in_sum / s_session.tds_n);
+        rpt.tds_out_avg = (int)(s_session.tds_out_sum / s_session.tds_n);
+        if (rpt.tds_in_avg > 0 && rpt.tds_out_avg <= rpt.tds_in_avg) {
+            rpt.rejection_permille = (rpt.tds_in_avg - rpt.tds_out_avg) * 1000 / rpt.tds_in_avg;
+        }
+    }
+
+    // 能耗：本次会话、当天、累计，以及单位产水能耗相对基线的漂移
+    usage_energy_t energy;
+    usage_stats_on_session(s_session.energy_mj, s_session.volume_ml, &energy);
+    rpt.energy_mwh = s_session.energy_mj / 3600;
+    rpt.mwh_per_l = energy.mwh_per_l;
+    rpt.base_mwh_per_l = energy.base_mwh_per_l;
+    rpt.drift_pct = energy.drift_pct;
+    rpt.day_wh = energy.day_wh;
+    rpt.lifetime_wh = energy.lifetime_wh;
+
+    ESP_LOGI(TAG, "制水会话结束: %lus, %lumL, TDS %d -> %d, %lumWh", (unsigned long)rpt.duration_sec,
+             (unsigned long)rpt.volume_ml, rpt.tds_in_avg, rpt.tds_out_avg, (unsigned long)rpt.energy_mwh);
+    mqtt_manager_queue_session(&rpt); // 状态转移可能在事件循环中执行，不直接发布 QoS1
+    if (energy.drift_alert) {
+        alert_manager_raise(ALERT_ENERGY_DRIFT);
+    } else if (energy.drift_clear) {
+        alert_manager_clear(ALERT_ENERGY_DRIFT);
+    }
+}
+
 // --- 硬件动作转移引擎 ---
 static void transition_water_state(water_state_t next, const char *reason) {
     if (s_water_state == next) return;
@@ -177,6 +293,7 @@ static void transition_water_state(water_state_t next, const char *reason) {
     
     water_state_t prev = s_water_state;
     s_water_state = next;
+    app_events_post_water_state_changed(prev, next);
 
     // 退出上一个状态时的清理工作
     if (prev == WATER_STATE_MAKING) {
@@ -186,18 +303,17 @@ static void transition_water_state(water_state_t next, const char *reason) {
             esp_event_post(WATER_INTERNAL_EVENTS, WATER_EV_TRIGGER_WASH, NULL, 0, 0);
         }
         s_making_water_seconds = 0;
-        // if (s_accumulated_liters > 0.001f) { //白嫖漏洞
-        //     device_status_t status;
-        //     app_storage_load_status(&status);
-        //     status.total_flow += (int)(s_accumulated_liters * 1000.0f);
-        //     app_storage_save_status(&status);
-        //     s_accumulated_liters = 0.0f; // 存完清零
-        // }
-        //
+        // 一次制水结束，关闭计量账本记录并同步云端 (零头由计量模块持久化，不再丢失)
+        metering_close_entry();
+        session_end(next);
     }
     if (prev == WATER_STATE_WASHING) {
         xTimerStop(s_wash_timer, 0);
     }
+    // 推迟期间水桶已满、缺水或鉴权拦截：本次推迟作废 (放行进入制水/冲洗的不算)
+    if (prev == WATER_STATE_DEFERRED && next != WATER_STATE_MAKING && next != WATER_STATE_WASHING) {
+        tou_schedule_cancel_hold();
+    }
 
     // 进入新状态时的硬件执行
     switch (next) {
@@ -208,14 +324,16 @@ static void transition_water_state(water_state_t next, const char *reason) {
             s_pump_dryrun_cnt = 0;
             s_time_since_last_wash = 0; // 重置6小时计时器
             s_need_pre_wash = false;
+            usage_stats_on_wash();
             bsp_set_pump(true);
             bsp_set_inlet_valve(true);
             bsp_set_flush_valve(true);
-            xTimerStart(s_wash_timer, 0); // 18秒倒计时
+            xTimerChangePeriod(s_wash_timer, pdMS_TO_TICKS(tunable(TUN_WASH_SEC) * 1000), 0); // 修改周期并启动倒计时
             break;
 
         case WATER_STATE_MAKING:
             s_making_water_seconds = 0;
+            session_begin();
             calibrate_pump_zero_if_safe();
             s_pump_run_seconds = 0;
             s_pump_overcurrent_cnt = 0;
@@ -227,6 +345,7 @@ static void transition_water_state(water_state_t next, const char *reason) {
 
         case WATER_STATE_FULL:
         case WATER_STATE_SHORTAGE:
+        case WATER_STATE_DEFERRED:
             bsp_set_pump(false);
             bsp_set_inlet_valve(false);
             bsp_set_flush_valve(false);
@@ -263,6 +382,11 @@ static void evaluate_water_state_ex(bool allow_exit_washing) {
 
     // 既不缺水，也不水满 -> 需要制水
     if (check_quota_allow_water()) {
+        // 分时计划：禁止时段推迟制水 (已在制水的不打断；未满时长达到保底后不再推迟)
+        if (s_water_state != WATER_STATE_MAKING && tou_schedule_hold_making(s_demand_seconds)) {
+            transition_water_state(WATER_STATE_DEFERRED, "评估: 分时禁止时段推迟制水");
+            return;
+        }
         if (s_need_pre_wash) {
             // 规则：开始制水时冲洗 / 缺水转制水状态冲洗
             s_need_pre_wash = false;
@@ -281,7 +405,7 @@ static void evaluate_water_state(void) {
 
 // --- 冲洗结束定时器回调 ---
 static void wash_timer_cb(TimerHandle_t xTimer) {
-    ESP_LOGI(TAG, "18秒冲洗结束，请求重新评估状态...");
+    ESP_LOGI(TAG, "冲洗结束，请求重新评估状态...");
     esp_event_post(WATER_INTERNAL_EVENTS, WATER_EV_WASH_DONE, NULL, 0, 0);
 }
 
@@ -292,7 +416,9 @@ static void wash_timer_cb(TimerHandle_t xTimer) {
 // 1. 处理水机内部的流转事件
 static void on_water_internal_event(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
     if (event_id == WATER_EV_EVALUATE) {
+        cmd_trace_mark(CMD_STAGE_WATER_EVAL);
         evaluate_water_state();
+        cmd_trace_mark(CMD_STAGE_ACTUATED);
     } else if (event_id == WATER_EV_TRIGGER_WASH) {
         s_need_pre_wash = false;
         transition_water_state(WATER_STATE_WASHING, "内部触发强制冲洗");
@@ -346,11 +472,13 @@ static void on_app_event(void *arg, esp_event_base_t event_base, int32_t event_i
         // --- 硬件与指令流转逻辑 ---
         case APP_EVENT_HW_LOW_PRESSURE_ALARM:
             s_hw_low_pressure = true;
+            alert_manager_raise(ALERT_LOW_PRESSURE);
             esp_event_post(WATER_INTERNAL_EVENTS, WATER_EV_EVALUATE, NULL, 0, 0);
             break;
 
         case APP_EVENT_HW_LOW_PRESSURE_RECOVER:
             s_hw_low_pressure = false;
+            alert_manager_clear(ALERT_LOW_PRESSURE);
             s_need_pre_wash = true; // 规则：缺水转制水状态冲洗
             esp_event_post(WATER_INTERNAL_EVENTS, WATER_EV_EVALUATE, NULL, 0, 0);
             break;
@@ -373,6 +501,7 @@ static void on_app_event(void *arg, esp_event_base_t event_base, int32_t event_i
 
         case APP_EVENT_CMD_EVALUATE:
             ESP_LOGI(TAG, "收到云端参数更新，触发状态机重新评估...");
+            cmd_trace_mark(CMD_STAGE_EVALUATE);
             esp_event_post(WATER_INTERNAL_EVENTS, WATER_EV_EVALUATE, NULL, 0, 0);
             break;
 
@@ -384,19 +513,43 @@ static void on_app_event(void *arg, esp_event_base_t event_base, int32_t event_i
 // ============================================================================
 // [模块四] 制水看门狗：处理超时保护与【流量精准计费结算】
 // ============================================================================
+// 记入本秒流量脉冲，返回窗口内的平均流量 (mL/min)
+// 进水阀开关切换时窗口重新开始，避免制水的流量在停机后被算作漏水
+static int flow_window_push(uint32_t pulses, bool pumping, uint32_t pulses_per_liter) {
+    if (pumping != s_flow_win_pumping) {
+        s_flow_win_pumping = pumping;
+        s_flow_win_len = 0;
+        s_flow_win_pos = 0;
+        s_flow_win_sum = 0;
+    }
+    if (s_flow_win_len == FLOW_WINDOW_SEC) {
+        s_flow_win_sum -= s_flow_win[s_flow_win_pos];
+    } else {
+        s_flow_win_len++;
+    }
+    s_flow_win[s_flow_win_pos] = (pulses > UINT16_MAX) ? UINT16_MAX : (uint16_t)pulses;
+    s_flow_win_sum += s_flow_win[s_flow_win_pos];
+    s_flow_win_pos = (s_flow_win_pos + 1) % FLOW_WINDOW_SEC;
+    if (pulses_per_liter == 0) return 0;
+    return (int)((uint64_t)s_flow_win_sum * 1000 * 60 / ((uint64_t)pulses_per_liter * s_flow_win_len));
+}
+
 static void water_monitor_task(void *pvParameters) {
-    // 假设流量计规格：450 个脉冲 = 1 升水 (请根据您的流量计实际规格修改)
-    const float PULSES_PER_LITER = 450.0f; 
+    // 流量计规格 (默认 450 个脉冲 = 1 升水) 与各项时长规则均取自运行参数，每秒读取一次
     
   
 
     while(1) {
         vTaskDelay(pdMS_TO_TICKS(1000)); // 1秒周期
+        usage_tick_t usage = { .making = (s_water_state == WATER_STATE_MAKING) };
+        uint32_t pump_ma = 0;
+        uint32_t flow_pulses = 0;
+        uint32_t pulses_per_liter = (uint32_t)tunable(TUN_PULSES_PER_L);
 
         // 1. 故障恢复规则：连续制水 6 小时无水满，报故障停机 30 分钟后恢复
         if (s_water_state == WATER_STATE_FAULT) {
             s_fault_timer_seconds++;
-            if (s_fault_timer_seconds >= 30 * 60) {
+            if (s_fault_timer_seconds >= (uint32_t)tunable(TUN_FAULT_REST_SEC)) {
                 ESP_LOGI(TAG, "故障停机30分钟结束，尝试恢复制水");
                 s_fault_timer_seconds = 0;
                 s_need_pre_wash = true;
@@ -404,10 +557,17 @@ static void water_monitor_task(void *pvParameters) {
             }
         }
 
+        // 分时计划：推迟中的制水在离开禁止时段或达到保底时长时放行
+        s_demand_seconds = s_hw_high_pressure ? 0 : s_demand_seconds + 1;
+        if (s_water_state == WATER_STATE_DEFERRED && !tou_schedule_hold_making(s_demand_seconds)) {
+            esp_event_post(WATER_INTERNAL_EVENTS, WATER_EV_EVALUATE, NULL, 0, 0);
+        }
+
         // 2. 待机冲洗规则：每 6 小时自动冲洗一次
         if (s_water_state != WATER_STATE_FAULT && s_water_state != WATER_STATE_WASHING) {
             s_time_since_last_wash++;
-            if (s_time_since_last_wash >= 6 * 3600) {
+            // 分时计划：优先时段提前、禁止时段推迟
+            if (tou_schedule_wash_due(s_time_since_last_wash, (uint32_t)tunable(TUN_IDLE_WASH_SEC))) {
                 ESP_LOGI(TAG, "已待机/运行满6小时，触发自动冲洗");
                 esp_event_post(WATER_INTERNAL_EVENTS, WATER_EV_TRIGGER_WASH, NULL, 0, 0);
             }
@@ -421,6 +581,8 @@ static void water_monitor_task(void *pvParameters) {
             // ==========================================
             float pump_current = bsp_sensor_get_pump_current();
             s_pump_run_seconds++;
+            pump_ma = (uint32_t)(pump_current * 1000.0f);
+            usage.energy_mj = pump_ma * PUMP_SUPPLY_MV / 1000; // mA x V x 1s = mJ (定点积分)
             
             // ==========================================
             // [B] 硬件自适应识别 (开机后的首次运行)
@@ -428,14 +590,12 @@ static void water_monitor_task(void *pvParameters) {
             // 避开前4秒的启动浪涌，在第5秒进行平稳期采样识别
             if (s_pump_run_seconds == 5) {
                 uint8_t spec_new = 0;
-                if (pump_current < 1.8f) {
-                    s_pump_limit_over = 2.0f; // 100G 泵最大 2A
-                    spec_new = 1;
-                    ESP_LOGW(TAG, "🤖 硬件自适应: 识别为【100G水泵】(当前 %.2fA), 锁定过流阈值: %.2fA", pump_current, s_pump_limit_over);
+                if (pump_ma < (uint32_t)tunable(TUN_PUMP_SPEC_MA)) {
+                    spec_new = 1; // 100G 泵 (默认最大 2A)
+                    ESP_LOGW(TAG, "🤖 硬件自适应: 识别为【100G水泵】(当前 %.2fA), 锁定过流阈值: %.2fA", pump_current, tunable(TUN_PUMP_100G_MA) / 1000.0f);
                 } else {
-                    s_pump_limit_over = 3.0f; // 400G 泵最大 3A
-                    spec_new = 2;
-                    ESP_LOGW(TAG, "🤖 硬件自适应: 识别为【400G水泵】(当前 %.2fA), 锁定过流阈值: %.2fA", pump_current, s_pump_limit_over);
+                    spec_new = 2; // 400G 泵 (默认最大 3A)
+                    ESP_LOGW(TAG, "🤖 硬件自适应: 识别为【400G水泵】(当前 %.2fA), 锁定过流阈值: %.2fA", pump_current, tunable(TUN_PUMP_400G_MA) / 1000.0f);
                 }
                 s_pump_recognized = true;
 
@@ -446,12 +606,7 @@ static void water_monitor_task(void *pvParameters) {
                     }
                 }
                 if (s_pump_spec_cached != 0 && spec_new != 0 && s_pump_spec_cached != spec_new) {
-                    alert_report_t alert = {
-                        .timestamp = 0,
-                        .alert_code = 5,
-                        .status = "triggered",
-                    };
-                    mqtt_manager_publish_alert(&alert);
+                    alert_manager_raise(ALERT_PUMP_ERR);
                 }
                 if (spec_new != 0) {
                     app_storage_set_pump_spec(spec_new);
@@ -465,16 +620,12 @@ static void water_monitor_task(void *pvParameters) {
             if (s_pump_run_seconds >= 5) {
                 
                 // 1) 过流/堵转保护检测
-                if (pump_current > s_pump_limit_over) {
+                float limit_over = pump_limit_over();
+                if (pump_current > limit_over) {
                     s_pump_overcurrent_cnt++;
                     if (s_pump_overcurrent_cnt >= 2) { // 连续 2 秒超标
-                        ESP_LOGE(TAG, "🚨 致命异常：水泵过流/堵转！当前电流: %.2f A，阈值: %.2f A", pump_current, s_pump_limit_over);
-                        alert_report_t alert = {
-                            .timestamp = 0,
-                            .alert_code = 5,
-                            .status = "triggered",
-                        };
-                        mqtt_manager_publish_alert(&alert);
+                        ESP_LOGE(TAG, "🚨 致命异常：水泵过流/堵转！当前电流: %.2f A，阈值: %.2f A", pump_current, limit_over);
+                        alert_manager_raise(ALERT_PUMP_ERR);
                         transition_water_state(WATER_STATE_FAULT, "水泵过流保护");
                     }
                 } else {
@@ -482,21 +633,21 @@ static void water_monitor_task(void *pvParameters) {
                 }
 
                 // 2) 空转/缺水保护检测
-                if (pump_current < s_pump_limit_dry) {
+                if (pump_current < pump_limit_dry()) {
                     s_pump_dryrun_cnt++;
                     if (s_pump_dryrun_cnt >= 3) { // 连续 3 秒过低
                         ESP_LOGE(TAG, "🚨 致命异常：水泵空转/无负载！当前电流: %.2f A", pump_current);
-                        alert_report_t alert = {
-                            .timestamp = 0,
-                            .alert_code = 5,
-                            .status = "triggered",
-                        };
-                        mqtt_manager_publish_alert(&alert);
+                        alert_manager_raise(ALERT_PUMP_ERR);
                         transition_water_state(WATER_STATE_FAULT, "水泵空转保护");
                     }
                 } else {
                     s_pump_dryrun_cnt = 0;
                 }
+
+                // 3) 连续正常运行满 1 分钟，水泵异常告警恢复
+                if (s_pump_run_seconds == PUMP_HEALTHY_SEC) {
+                    alert_manager_clear(ALERT_PUMP_ERR);
+                }
             }
             if (s_water_state == WATER_STATE_MAKING) {
                 s_making_water_seconds++;
@@ -506,17 +657,18 @@ static void water_monitor_task(void *pvParameters) {
             // --- 【新增】读取流量计并精准扣费 ---
             uint32_t pulses = bsp_sensor_get_flow_pulses();
             bsp_sensor_clear_flow_pulses(); // 读取后立刻清零，等待下一秒累加
+            flow_pulses = pulses;
 
             if (pulses > 0) {
-                // 计算这 1 秒内的真实制水量 (小数)
-                float current_liters = (float)pulses / PULSES_PER_LITER;
-                s_accumulated_liters += current_liters;
-
-                // 当累积水量达到 1 升时，才进行 NVS 扣减 (保护 Flash 寿命，防精度丢失)
-                if (s_accumulated_liters >= 1.0f) {
-                    int deduct_liters = (int)s_accumulated_liters; // 提取整数部分
-                    s_accumulated_liters -= deduct_liters;         // 留下零头下次算
-
+                // 换算为毫升 (整数运算，余量留到下一秒)，计入账本；凑满整升时才进行 NVS 扣减
+                uint32_t milli = pulses * 1000 + s_flow_pulse_frac;
+                uint32_t ml = milli / pulses_per_liter;
+                s_flow_pulse_frac = milli % pulses_per_liter;
+                int deduct_liters = metering_add_ml(ml);
+                if (usage.making) usage.making_ml = ml;
+                else usage.wash_ml = ml;
+
+                if (deduct_liters > 0) {
                     device_status_t status;
                     app_storage_load_status(&status);
 
@@ -558,23 +710,48 @@ static void water_monitor_task(void *pvParameters) {
                 }
             }
             
+            if (usage.making) {
+                session_tick(usage.making_ml, pump_ma, usage.energy_mj);
+            }
+
             // 4. 制水超时保护：连续制水超过 6 小时
-            if (s_making_water_seconds >= 6 * 3600) {
+            if (s_making_water_seconds >= (uint32_t)tunable(TUN_MAKING_MAX_SEC)) {
                 ESP_LOGE(TAG, "严重：连续制水超过6小时，触发保护停机！");
                 transition_water_state(WATER_STATE_FAULT, "制水超时");
             }
 
             // 5. 制水期间维护：累计制水满 2 小时强制冲洗
-            if (s_total_making_time >= 2 * 3600) {
+            if (s_total_making_time >= (uint32_t)tunable(TUN_MAINT_WASH_SEC)) {
                 ESP_LOGI(TAG, "累计制水达2小时，触发维护冲洗！");
                 s_total_making_time = 0; 
                 esp_event_post(WATER_INTERNAL_EVENTS, WATER_EV_TRIGGER_WASH, NULL, 0, 0);
             }
         } else {
-            // 如果不在制水状态，清空残留的水量零头和脉冲，防止误算
+            // 如果不在制水状态，清空残留的脉冲，防止误算 (不计费，只用于漏水检测)
+            flow_pulses = bsp_sensor_get_flow_pulses();
             bsp_sensor_clear_flow_pulses();
-            // s_accumulated_liters = 0.0f; //白嫖漏洞
         }
+        int flow_ml_min = flow_window_push(flow_pulses, s_water_state == WATER_STATE_MAKING ||
+                                           s_water_state == WATER_STATE_WASHING, pulses_per_liter);
+
+        // 告警规则 (TDS 仅在出现新快照时参与评估)
+        bsp_tds_snapshot_t snap;
+        bsp_sensor_get_tds_snapshot(&snap);
+        rule_sample_t sample = {
+            .water_state = s_water_state,
+            .tds_us = snap.sample_us,
+            .tds_in = snap.tds_in,
+            .tds_out = snap.tds_out,
+            .temp_c10 = (int)(bsp_sensor_get_temperature() * 10.0f),
+            .flow_ml_min = flow_ml_min,
+            .pump_ma = (int)pump_ma,
+        };
+        rule_engine_evaluate(&sample);
+
+        // 小时/天使用统计
+        usage_stats_tick(&usage);
+        tou_schedule_tick(s_water_state == WATER_STATE_MAKING, s_water_state == WATER_STATE_WASHING, usage.energy_mj);
+        alert_manager_tick();
 
     }
 }
@@ -588,6 +765,7 @@ static const char *water_state_name(water_state_t state) {
         case WATER_STATE_FULL: return "WATER_FULL (水满待机)";
         case WATER_STATE_SHORTAGE: return "SHORTAGE (缺水报警)";
         case WATER_STATE_FAULT: return "FAULT (超时故障)";
+        case WATER_STATE_DEFERRED: return "DEFERRED (分时推迟)";
         default: return "UNKNOWN";
     }
 }
@@ -626,8 +804,9 @@ static void system_dashboard_task(void *pvParameters) {
 
         uint32_t fault_elapsed_s = (s_water_state == WATER_STATE_FAULT) ? s_fault_timer_seconds : 0;
         uint32_t fault_remain_s = 0;
-        if (s_water_state == WATER_STATE_FAULT && s_fault_timer_seconds < 30 * 60) {
-            fault_remain_s = (30 * 60) - s_fault_timer_seconds;
+        uint32_t fault_rest_s = (uint32_t)tunable(TUN_FAULT_REST_SEC);
+        if (s_water_state == WATER_STATE_FAULT && s_fault_timer_seconds < fault_rest_s) {
+            fault_remain_s = fault_rest_s - s_fault_timer_seconds;
         }
 
         printf("\n");
@@ -643,10 +822,13 @@ static void system_dashboard_task(void *pvParameters) {
         printf("  ├─ Net/MQTT FSM  : %s (net_ready=%d)\n", state_name(s_state), s_net_ready ? 1 : 0);
         printf("  ├─ Water FSM     : %s (quota=%s, need_pre_wash=%d)\n",
                water_state_name(s_water_state), quota_allow ? "OK" : "BLOCK", s_need_pre_wash ? 1 : 0);
-        printf("  ├─ 单次连续制水 : %lu 秒 (限 6h 超时保护)\n", (unsigned long)s_making_water_seconds);
-        printf("  ├─ 累计制水时长 : %lu 秒 (满 2h 触发维护冲洗)\n", (unsigned long)s_total_making_time);
-        printf("  ├─ 距上次冲洗   : %lu 秒 (满 6h 触发定期冲洗)\n", (unsigned long)s_time_since_last_wash);
-        printf("  └─ 故障恢复(30min): 已停机 %lu s, 剩余 %lu s\n",
+        printf("  ├─ 单次连续制水 : %lu 秒 (限 %ld 秒超时保护)\n", (unsigned long)s_making_water_seconds,
+               (long)tunable(TUN_MAKING_MAX_SEC));
+        printf("  ├─ 累计制水时长 : %lu 秒 (满 %ld 秒触发维护冲洗)\n", (unsigned long)s_total_making_time,
+               (long)tunable(TUN_MAINT_WASH_SEC));
+        printf("  ├─ 距上次冲洗   : %lu 秒 (满 %ld 秒触发定期冲洗)\n", (unsigned long)s_time_since_last_wash,
+               (long)tunable(TUN_IDLE_WASH_SEC));
+        printf("  └─ 故障恢复     : 已停机 %lu s, 剩余 %lu s\n",
                (unsigned long)fault_elapsed_s, (unsigned long)fault_remain_s);
         printf("\n");
 
@@ -664,9 +846,9 @@ static void system_dashboard_task(void *pvParameters) {
                s_pump_recognized ? 1 : 0,
                (unsigned long)s_pump_run_seconds,
                (unsigned)s_pump_overcurrent_cnt,
-               (double)s_pump_limit_over,
+               (double)pump_limit_over(),
                (unsigned)s_pump_dryrun_cnt,
-               (double)s_pump_limit_dry);
+               (double)pump_limit_dry());
         printf("\n");
 
         // 3. 继电器与外设执行器
@@ -706,15 +888,16 @@ static void system_dashboard_task(void *pvParameters) {
         printf("  ├─ 设备软开关机   : %s\n", status.switch_state ? "开机" : "关机拦截");
         printf("  ├─ 当前计费模式   : %s\n", status.pay_mode == 0 ? "计时模式" : "计量模式");
 
+        uint32_t unbilled_ml = metering_get_unbilled_ml();
         float display_capacity = (float)status.capacity;
         if (status.pay_mode == 1) {
-            display_capacity -= s_accumulated_liters; // 实时扣减零头显示
+            display_capacity -= (float)unbilled_ml / 1000.0f; // 实时扣减零头显示
         }
-        uint32_t display_total_flow = (uint32_t)status.total_flow + (uint32_t)(s_accumulated_liters * 1000.0f);
+        uint32_t display_total_flow = (uint32_t)status.total_flow + unbilled_ml;
         
         printf("  ├─ 剩余天数/水量  : %d 天 / %.2f L\n", status.days, display_capacity);
-        printf("  ├─ 历史总制水量   : %lu mL (delta %.2f L)\n",
-               (unsigned long)display_total_flow, (double)s_accumulated_liters);
+        printf("  ├─ 历史总制水量   : %lu mL (delta %lu mL, 账本未确认 %lu 条)\n",
+               (unsigned long)display_total_flow, (unsigned long)unbilled_ml, (unsigned long)metering_get_unacked());
         
         printf("  └─ 滤芯剩余       : ");
         bool any_filter = false;
@@ -735,6 +918,17 @@ static void system_dashboard_task(void *pvParameters) {
     }
 }
 
+water_state_t app_fsm_get_water_state(void) {
+    return s_water_state;
+}
+
+bool app_fsm_is_idle(void) {
+    if (s_water_state != WATER_STATE_FULL) return false;
+    if (s_need_pre_wash || xTimerIsTimerActive(s_wash_timer)) return false;
+    // 定期冲洗即将到期时同样视为忙碌
+    return s_time_since_last_wash + IDLE_WASH_MARGIN_SEC < (uint32_t)tunable(TUN_IDLE_WASH_SEC);
+}
+
 // ============================================================================
 // 初始化入口
 // ============================================================================
@@ -745,8 +939,8 @@ void app_fsm_init(void) {
     ESP_ERROR_CHECK(esp_event_handler_register(WATER_INTERNAL_EVENTS, ESP_EVENT_ANY_ID, &on_water_internal_event, NULL));
     
     // 初始化定时器与任务
-    s_wash_timer = xTimerCreate("wash_tmr", pdMS_TO_TICKS(18000), pdFALSE, NULL, wash_timer_cb);
-    xTaskCreate(water_monitor_task, "water_dog", 3072, NULL, 5, NULL);
+    s_wash_timer = xTimerCreate("wash_tmr", pdMS_TO_TICKS(tunable(TUN_WASH_SEC) * 1000), pdFALSE, NULL, wash_timer_cb);
+    xTaskCreate(water_monitor_task, "water_dog", 4096, NULL, 5, NULL); // 告警合并上报与规则评估也在该任务中
     // 【新增】启动诊断面板任务 (堆栈稍微给大一点点保证 printf 不溢出)
     // xTaskCreate(system_dashboard_task, "sys_dash", 4096, NULL, 4, NULL);
 
@@ -756,14 +950,12 @@ void app_fsm_init(void) {
     s_water_state = WATER_STATE_INIT;
     transition_to(FSM_STATE_WAIT_NET, "fsm init");
 
+    // 制水鉴权只看本地缓存套餐，从不等待云端；戳不符时由云端对账补发
+    ESP_LOGI(TAG, "Cached plan: %s", app_storage_plan_is_valid() ? "valid" : "unconfirmed, wait for cloud");
+
     uint8_t pump_spec = 0;
     if (app_storage_get_pump_spec(&pump_spec) == ESP_OK) {
-        s_pump_spec_cached = pump_spec;
-        if (pump_spec == 1) {
-            s_pump_limit_over = 2.0f;
-        } else if (pump_spec == 2) {
-            s_pump_limit_over = 3.0f;
-        }
+        s_pump_spec_cached = pump_spec; // 过流阈值随规格取对应参数
     }
 
     // 规则：开机流程 -> 执行一次自动冲洗
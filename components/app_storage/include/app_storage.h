@@ -5,6 +5,11 @@
 #define NET_CONFIG_NAMESPACE "net_cfg"
 #define NET_CONFIG_KEY       "config"
 
+// 私有 CA / SPKI 指纹 (产线写入，恢复出厂不清除)
+#define TLS_CA_MAX_LEN       4096
+#define TLS_PIN_MAX          4
+#define TLS_PIN_LEN          32   // SHA-256
+
 
 // 定义一些结构体方便数据交互
 typedef struct {
@@ -29,6 +34,7 @@ typedef struct {
     int pay_mode;        // 0: 计时, 1: 计量
     int days;            // 剩余天数 (计时模式)
     int capacity;        // 剩余水量/L (计量模式)
+    uint32_t plan_ver;   // 已应用的期望状态版本 (与套餐一起保存，重启后用于与云端对账)
     
     // 使用 9 个元素的数组存储滤芯
     bool filter_valid[9]; // true 表示该级滤芯已安装/云端已下发
@@ -37,6 +43,138 @@ typedef struct {
     int  filter_capacity[9];
 } device_status_t;
 
+// Broker 接入点列表 (按优先级排序，第一个与 net_config_t.full_url 一致)
+#define BROKER_MAX           4
+#define BROKER_URL_LEN       128
+
+typedef struct {
+    uint8_t count;
+    uint8_t active;      // 当前使用的接入点 (故障切换后保持，重启沿用)
+    char urls[BROKER_MAX][BROKER_URL_LEN]; // "mqtts://host:port"
+} broker_list_t;
+
+// MQTT 心跳自适应记录 (按联网方式分别保存)
+typedef struct {
+    uint16_t good_sec;   // 已验证可穿透 NAT 的最长心跳 (秒)
+    uint16_t ceil_sec;   // 已探测到会断线的心跳上限 (秒)，0 = 未知
+} keepalive_record_t;
+
+// 计量账本 (环形，按 seq % LEDGER_RING_LEN 存放)，云端按 seq 确认后才可覆盖
+#define LEDGER_RING_LEN      32
+
+typedef struct {
+    uint32_t seq;        // 单调递增序号，从 1 开始
+    uint32_t ml;         // 本条记录的制水量 (毫升)
+    uint32_t ts;         // 记录关闭时间 (Unix 秒，未对时为开机秒数)
+} ledger_entry_t;
+
+typedef struct {
+    uint32_t next_seq;   // 下一条记录的序号
+    uint32_t acked_seq;  // 云端已确认的最大序号 (之前的记录均已确认)
+    ledger_entry_t entries[LEDGER_RING_LEN];
+} ledger_store_t;
+
+// 计量累加器 (未结账的水量，断电重启后恢复)
+typedef struct {
+    uint32_t open_seq;    // 当前未关闭记录将使用的序号 (与账本 next_seq 不一致说明已关闭入账)
+    uint32_t open_ml;     // 当前未关闭账本记录的水量
+    uint32_t unbilled_ml; // 不足 1 升、尚未从套餐扣减的零头
+} meter_acc_t;
+
+// 使用统计汇总桶 (按小时/按天)，TDS 为纯水侧
+typedef struct {
+    uint32_t start_ts;    // 桶起始时间 (本地整点/零点，Unix 秒)，0 表示空桶
+    uint32_t water_ml;    // 制水量 (毫升)
+    uint32_t making_sec;  // 制水时长 (秒)
+    uint32_t wash_ml;     // 冲洗用水量 (毫升)
+    uint32_t energy_j;    // 水泵能耗 (焦耳)
+    uint32_t tds_sum;     // TDS 采样累加 (求平均用)
+    uint16_t tds_n;       // TDS 采样次数
+    uint16_t tds_min;
+    uint16_t tds_max;
+    uint16_t wash_count;  // 冲洗次数
+} usage_bucket_t;
+
+#define USAGE_HOURS          48   // 小时环：最近 2 天
+#define USAGE_DAYS           31   // 天环：最近 1 个月
+#define USAGE_CHUNK          8    // 落盘分片：每个 NVS 键存放的桶数
+
+typedef struct {
+    uint32_t open_hour;   // 当前未结束的小时 (结束时并入对应的天桶)
+    uint32_t digest_ts;   // 已上传日摘要的最后一天 (零点时间)
+    uint64_t lifetime_mj; // 水泵累计能耗 (毫焦)
+    // 单位产水能耗 (mWh/L, Q4 定点)：前若干次会话建立基线，之后跟踪近期均值，膜老化时近期值上升
+    uint32_t eff_base_q4;
+    uint32_t eff_recent_q4;
+    uint16_t eff_sessions; // 参与基线的会话数
+    uint8_t eff_alerted;   // 漂移告警已触发
+    usage_bucket_t hours[USAGE_HOURS]; // 按 (start_ts / 3600) % USAGE_HOURS 存放
+    usage_bucket_t days[USAGE_DAYS];   // 按 (本地日序号) % USAGE_DAYS 存放
+} usage_store_t;
+
+// 当前告警集合 (告警管理器维护，重启后恢复；未上报的触发/清除也一并保存)
+#define ALERT_SLOTS          8
+
+#define ALERT_SLOT_USED      (1 << 0)
+#define ALERT_SLOT_ACTIVE    (1 << 1) // 处于触发状态 (无此标志且仍占用表示待上报清除)
+#define ALERT_SLOT_REPORT    (1 << 2) // 状态变化尚未上报
+
+typedef struct {
+    uint8_t code;        // alert_code
+    uint8_t flags;       // ALERT_SLOT_*
+    uint16_t count;      // 本次触发以来的发生次数
+    uint32_t first_ts;   // 首次发生 (Unix 秒，未对时为 0)
+    uint32_t last_ts;    // 最近一次发生
+} alert_slot_t;
+
+typedef struct {
+    alert_slot_t slots[ALERT_SLOTS];
+} alert_store_t;
+
+// 告警规则 (紧凑存储，字段含义见 rule_engine.h)
+#define ALERT_RULE_MAX       16
+
+typedef struct {
+    uint8_t source;      // rule_source_t
+    uint8_t op;          // rule_op_t
+    uint8_t alert_code;
+    uint8_t state_mask;  // bit = water_state_t，0 表示全部状态
+    int16_t threshold;
+    uint16_t hysteresis;
+    uint16_t min_sec;
+} alert_rule_t;
+
+typedef struct {
+    uint8_t count;
+    alert_rule_t rules[ALERT_RULE_MAX];
+} rule_store_t;
+
+// 分时制水计划 (字段含义见 tou_schedule.h)
+#define TOU_WINDOW_MAX       8
+
+typedef struct {
+    uint8_t type;        // tou_window_t
+    uint8_t day_mask;    // bit0 = 周日 ... bit6 = 周六，0 表示每天
+    uint16_t start_min;  // 当地时间，当天 0 点起的分钟数
+    uint16_t end_min;    // 不大于 start_min 表示跨零点
+} tou_window_rec_t;
+
+typedef struct {
+    uint8_t count;
+    uint8_t early_wash_pct;  // 优惠时段内冲洗间隔达到该比例即提前冲洗
+    uint16_t reserve_min;    // 水桶未满时最多推迟制水的时长
+    tou_window_rec_t windows[TOU_WINDOW_MAX];
+} tou_store_t;
+
+// 固件下载断点 (断网/重启后按 Range 续传)
+typedef struct {
+    char url[128];           // 下载地址 (与 CMD_URL_LEN 一致)
+    uint32_t part_addr;      // 目标 OTA 分区地址
+    uint32_t written;        // 已写入分区的字节数 (续传起点)
+    uint32_t image_size;     // 镜像总长度，未知为 0
+    uint8_t elf_sha256[32];  // 镜像描述中的 app_elf_sha256，用于确认分区内是同一镜像
+} ota_progress_t;
+
 typedef enum {
     RESET_LEVEL_NET     = 1, // 仅重置网络 (保留滤芯数据)
     RESET_LEVEL_FACTORY = 9  // 恢复出厂 (清除所有)
@@ -60,6 +198,14 @@ esp_err_t app_storage_load_net_config(net_config_t *cfg);
 esp_err_t app_storage_save_status(const device_status_t *status);
 esp_err_t app_storage_load_status(device_status_t *status);
 
+/**
+ * @brief 套餐有效性戳
+ * mark: 云端确认当前状态后调用，之后每次保存状态都会续签 (加载时已不符的状态不续签)
+ * is_valid: 缓存套餐经云端确认且与戳一致；不一致时上报 planVer=0，由云端补发并覆盖
+ */
+esp_err_t app_storage_mark_plan_valid(void);
+bool app_storage_plan_is_valid(void);
+
 /**
  * @brief 记录用户离线操作 (追加模式，简单示例)
  * @param action 操作字符串，如 "start_wash"
@@ -91,5 +237,93 @@ uint8_t app_storage_get_pending_init(void);
 esp_err_t app_storage_set_sn(const char *sn);
 esp_err_t app_storage_get_sn(char *out_sn, size_t max_len);
 
+/**
+ * @brief Broker 接入点列表 (蓝牙配网或云端下发)，重置网络时一并清除
+ */
+esp_err_t app_storage_save_broker_list(const broker_list_t *list);
+esp_err_t app_storage_load_broker_list(broker_list_t *list);
+
+/**
+ * @brief MQTT 心跳探测结果 (net_mode: 0=WiFi, 1=4G)，重置网络时一并清除
+ */
+esp_err_t app_storage_save_keepalive(int net_mode, const keepalive_record_t *rec);
+esp_err_t app_storage_load_keepalive(int net_mode, keepalive_record_t *rec);
+
+/**
+ * @brief 设备分组 (云端 SET_GROUP 下发)，传空字符串清除
+ */
+esp_err_t app_storage_set_group(const char *group);
+esp_err_t app_storage_get_group(char *out_group, size_t max_len);
+
+/**
+ * @brief 计量账本、累加器与使用统计 (恢复出厂时清除)
+ */
+esp_err_t app_storage_save_ledger(const ledger_store_t *ledger);
+esp_err_t app_storage_load_ledger(ledger_store_t *ledger);
+esp_err_t app_storage_save_meter_acc(const meter_acc_t *acc);
+esp_err_t app_storage_load_meter_acc(meter_acc_t *acc);
+
+/**
+ * @brief 使用统计分片保存：头部 (hours 之前的字段)、含指定槽位的小时分片、含指定槽位的天分片
+ * 每个分片 USAGE_CHUNK 个桶，定时落盘只改写一个分片，不再整块改写 usage_store_t；
+ * 天分片连同最后并入的小时一起写入，加载时取最大值，用于防止重启后重复并入
+ */
+esp_err_t app_storage_save_usage_head(const usage_store_t *store);
+esp_err_t app_storage_save_usage_hours(const usage_store_t *store, int slot);
+esp_err_t app_storage_save_usage_days(const usage_store_t *store, int slot, uint32_t merged_hour);
+/**
+ * @brief 加载头部与全部分片 (缺失的分片保持为空桶)
+ * @param merged_hour 输出已并入天桶的最后一个小时，无记录为 0
+ */
+esp_err_t app_storage_load_usage(usage_store_t *store, uint32_t *merged_hour);
+
+/**
+ * @brief 当前告警集合 (随设备状态一起在恢复出厂时清除)
+ */
+esp_err_t app_storage_save_alerts(const alert_store_t *store);
+esp_err_t app_storage_load_alerts(alert_store_t *store);
+
+/**
+ * @brief 告警规则 (云端下发)，未保存时返回 ESP_ERR_NVS_NOT_FOUND，恢复出厂时清除
+ */
+esp_err_t app_storage_save_rules(const rule_store_t *store);
+esp_err_t app_storage_load_rules(rule_store_t *store);
+
+/**
+ * @brief 分时制水计划 (云端下发)，未保存时返回 ESP_ERR_NVS_NOT_FOUND，恢复出厂时清除
+ */
+esp_err_t app_storage_save_tou(const tou_store_t *store);
+esp_err_t app_storage_load_tou(tou_store_t *store);
+
+/**
+ * @brief 固件下载断点，未保存时返回 ESP_ERR_NVS_NOT_FOUND；下载完成或镜像校验失败后清除
+ */
+esp_err_t app_storage_save_ota_progress(const ota_progress_t *prog);
+esp_err_t app_storage_load_ota_progress(ota_progress_t *prog);
+esp_err_t app_storage_clear_ota_progress(void);
+
+/**
+ * @brief 运行参数覆盖值 (云端 SET_CONFIG 下发，按参数名存放)
+ * @param value 传 NULL 删除覆盖值 (恢复固件默认)
+ * 未覆盖时 get 返回 ESP_ERR_NVS_NOT_FOUND；恢复出厂时清除
+ */
+esp_err_t app_storage_set_tunable(const char *key, const int32_t *value);
+esp_err_t app_storage_get_tunable(const char *key, int32_t *out_value);
+
 esp_err_t app_storage_set_pump_spec(uint8_t spec);
 esp_err_t app_storage_get_pump_spec(uint8_t *out_spec);
+
+// 信任根只由出厂 NVS 镜像写入 (命名空间 tls，见 tools/README.md)，固件不提供写入接口：
+// 蓝牙或云端指令能改写信任根，就能把设备引向任意服务器；恢复出厂也不擦除该命名空间
+
+/**
+ * @brief 私有 CA 证书链 (PEM，含结尾 '\0')
+ * @param out 输出缓冲区，传 NULL 时仅通过 inout_len 返回所需长度
+ * @param inout_len 输入缓冲区大小，输出实际长度
+ */
+esp_err_t app_storage_get_tls_ca(char *out, size_t *inout_len);
+
+/**
+ * @brief SPKI 指纹 (服务器证书链公钥的 SHA-256)，最多 TLS_PIN_MAX 个
+ */
+esp_err_t app_storage_get_tls_pins(uint8_t pins[][TLS_PIN_LEN], size_t max, size_t *out_count);
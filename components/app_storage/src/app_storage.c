@@ -5,7 +5,11 @@
 #include "esp_log.h"
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
 #include "esp_wifi.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 static const char *TAG = "STORAGE";
 
@@ -14,8 +18,19 @@ static const char *TAG = "STORAGE";
 #define NS_DEV_STAT  "dev_stat"
 #define NS_ACTION_LOG "act_log"
 #define NS_DEV_ID    "dev_id"
+#define NS_TLS       "tls"
+#define NS_METER     "meter"
+#define NS_TUNE      "tunables"
+
+// 设备状态 RAM 缓存：状态每秒都可能被读取 (鉴权评估、扣费、面板)，
+// 首次从 NVS 加载后由缓存提供，保存时同步更新
+static device_status_t s_status_cache;
+static bool s_status_cached = false;
+static bool s_plan_valid = false;   // 缓存状态与有效性戳一致 (随缓存首次加载判定，之后只由云端确认置位)
+static SemaphoreHandle_t s_status_lock = NULL;
 
 esp_err_t app_storage_init(void) {
+    if (!s_status_lock) s_status_lock = xSemaphoreCreateMutex();
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
         ESP_ERROR_CHECK(nvs_flash_erase());
@@ -61,7 +76,44 @@ esp_err_t app_storage_load_net_config(net_config_t *cfg) {
 
 
 // --- 设备状态实现 ---
-esp_err_t app_storage_save_status(const device_status_t *status) {
+// 套餐有效性戳：云端确认过的状态在每次保存时附带 {版本, CRC}，最后写入；
+// 写入中途掉电或被篡改时 CRC 不符，重启后不再信任缓存套餐
+typedef struct {
+    uint32_t plan_ver;
+    uint32_t crc;
+} plan_stamp_t;
+
+static uint32_t status_crc(const device_status_t *s) {
+    int32_t head[6] = {s->total_flow, s->switch_state, s->pay_mode, s->days, s->capacity, (int32_t)s->plan_ver};
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)head, sizeof(head));
+    for (int i = 0; i < 9; i++) {
+        int32_t f[4] = {s->filter_valid[i] ? 1 : 0, s->filter_type[i], s->filter_days[i], s->filter_capacity[i]};
+        crc = esp_rom_crc32_le(crc, (const uint8_t *)f, sizeof(f));
+    }
+    return crc;
+}
+
+// NVS 中的有效性戳是否与给定状态一致
+static bool stamp_matches(const device_status_t *s) {
+    plan_stamp_t stamp = {0};
+    size_t len = sizeof(stamp);
+    nvs_handle_t handle;
+    if (nvs_open(NS_DEV_STAT, NVS_READONLY, &handle) != ESP_OK) return false;
+    esp_err_t err = nvs_get_blob(handle, "stamp", &stamp, &len);
+    nvs_close(handle);
+    if (err != ESP_OK || len != sizeof(stamp)) return false;
+    return stamp.plan_ver == s->plan_ver && stamp.crc == status_crc(s);
+}
+
+static void status_lock(void) {
+    if (s_status_lock) xSemaphoreTake(s_status_lock, portMAX_DELAY);
+}
+
+static void status_unlock(void) {
+    if (s_status_lock) xSemaphoreGive(s_status_lock);
+}
+
+static esp_err_t status_save_nvs(const device_status_t *status) {
     nvs_handle_t handle;
     esp_err_t err = nvs_open(NS_DEV_STAT, NVS_READWRITE, &handle);
     if (err != ESP_OK) return err;
@@ -71,6 +123,7 @@ esp_err_t app_storage_save_status(const device_status_t *status) {
     nvs_set_i32(handle, "pay_mode", status->pay_mode);
     nvs_set_i32(handle, "days", status->days);
     nvs_set_i32(handle, "capacity", status->capacity);
+    nvs_set_u32(handle, "plan_ver", status->plan_ver);
     
     char key_val[16], key_typ[16], key_days[16], key_cap[16];
     for (int i = 0; i < 9; i++) {
@@ -84,14 +137,20 @@ esp_err_t app_storage_save_status(const device_status_t *status) {
         nvs_set_i32(handle, key_days, status->filter_days[i]);
         nvs_set_i32(handle, key_cap, status->filter_capacity[i]);
     }
+
+    // 已确认过的套餐随状态一起续签有效性戳 (放在最后写)；加载时戳已不符的状态不续签，
+    // 否则本地的一次扣费保存就会把掉电残缺或被篡改的套餐重新签为有效
+    if (s_plan_valid) {
+        plan_stamp_t stamp = {.plan_ver = status->plan_ver, .crc = status_crc(status)};
+        nvs_set_blob(handle, "stamp", &stamp, sizeof(stamp));
+    }
     
     nvs_commit(handle);
     nvs_close(handle);
     return ESP_OK;
 }
 
-esp_err_t app_storage_load_status(device_status_t *status) {
-    if (!status) return ESP_ERR_INVALID_ARG;
+static esp_err_t status_load_nvs(device_status_t *status) {
     memset(status, 0, sizeof(device_status_t));
     nvs_handle_t handle;
     esp_err_t err = nvs_open(NS_DEV_STAT, NVS_READONLY, &handle);
@@ -112,6 +171,7 @@ esp_err_t app_storage_load_status(device_status_t *status) {
     if (nvs_get_i32(handle, "pay_mode", &val) == ESP_OK) status->pay_mode = val;
     if (nvs_get_i32(handle, "days", &val) == ESP_OK) status->days = val;
     if (nvs_get_i32(handle, "capacity", &val) == ESP_OK) status->capacity = val;
+    nvs_get_u32(handle, "plan_ver", &status->plan_ver);
     
     char key_val[16], key_typ[16], key_days[16], key_cap[16];
     uint8_t b_val = 0;
@@ -130,6 +190,78 @@ esp_err_t app_storage_load_status(device_status_t *status) {
     return ESP_OK;
 }
 
+esp_err_t app_storage_save_status(const device_status_t *status) {
+    if (!status) return ESP_ERR_INVALID_ARG;
+    status_lock();
+    if (!s_status_cached) {
+        device_status_t stored;
+        s_plan_valid = (status_load_nvs(&stored) == ESP_OK) && stamp_matches(&stored);
+    }
+    esp_err_t err = status_save_nvs(status);
+    if (err == ESP_OK) {
+        s_status_cache = *status;
+        s_status_cached = true;
+    }
+    status_unlock();
+    return err;
+}
+
+esp_err_t app_storage_load_status(device_status_t *status) {
+    if (!status) return ESP_ERR_INVALID_ARG;
+    status_lock();
+    esp_err_t err = ESP_OK;
+    if (s_status_cached) {
+        *status = s_status_cache;
+    } else {
+        err = status_load_nvs(status);
+        if (err == ESP_OK) {
+            s_status_cache = *status;
+            s_status_cached = true;
+            s_plan_valid = stamp_matches(status);
+        }
+    }
+    status_unlock();
+    return err;
+}
+
+esp_err_t app_storage_mark_plan_valid(void) {
+    device_status_t status;
+    nvs_handle_t handle;
+
+    status_lock();
+    esp_err_t err = ESP_OK;
+    if (s_status_cached) {
+        status = s_status_cache;
+    } else {
+        err = status_load_nvs(&status);
+    }
+    if (err == ESP_OK) {
+        err = nvs_open(NS_DEV_STAT, NVS_READWRITE, &handle);
+    }
+    if (err == ESP_OK) {
+        plan_stamp_t stamp = {.plan_ver = status.plan_ver, .crc = status_crc(&status)};
+        err = nvs_set_blob(handle, "stamp", &stamp, sizeof(stamp));
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (err == ESP_OK) {
+        s_plan_valid = true;
+    }
+    status_unlock();
+    return err;
+}
+
+bool app_storage_plan_is_valid(void) {
+    device_status_t status;
+    if (app_storage_load_status(&status) != ESP_OK) return false; // 确保缓存与判定已加载
+    status_lock();
+    bool valid = s_plan_valid;
+    status_unlock();
+    return valid;
+}
+
 // TODO 待完善
 // --- 操作日志实现 ---
 // 使用 NVS Blob / SPIFFS 
@@ -167,11 +299,21 @@ esp_err_t app_storage_erase(reset_level_t level) {
 
     // 2. Level 3: 恢复出厂 (慎用)
     if (level >= RESET_LEVEL_FACTORY) {
-        // A. 清除设备状态 (滤芯、流量)
+        // A. 清除设备状态 (滤芯、流量、套餐有效性戳、告警集合)
+        status_lock();
         erase_namespace(NS_DEV_STAT);
+        s_status_cached = false;
+        s_plan_valid = false;
+        status_unlock();
         
         // B. 清除日志
         erase_namespace(NS_ACTION_LOG);
+
+        // C. 清除计量账本
+        erase_namespace(NS_METER);
+
+        // D. 清除云端下发的运行参数 (恢复固件默认值)
+        erase_namespace(NS_TUNE);
         
         ESP_LOGW(TAG, "!!! FACTORY RESET COMPLETED !!!");
     }
@@ -242,6 +384,292 @@ esp_err_t app_storage_get_sn(char *out_sn, size_t max_len) {
     return err;
 }
 
+esp_err_t app_storage_save_keepalive(int net_mode, const keepalive_record_t *rec) {
+    if (!rec) return ESP_ERR_INVALID_ARG;
+    char key[8];
+    snprintf(key, sizeof(key), "ka_%d", net_mode);
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NET_CONFIG_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) return err;
+    err = nvs_set_blob(handle, key, rec, sizeof(keepalive_record_t));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t app_storage_load_keepalive(int net_mode, keepalive_record_t *rec) {
+    if (!rec) return ESP_ERR_INVALID_ARG;
+    memset(rec, 0, sizeof(keepalive_record_t));
+    char key[8];
+    snprintf(key, sizeof(key), "ka_%d", net_mode);
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NET_CONFIG_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) return err;
+    size_t len = sizeof(keepalive_record_t);
+    err = nvs_get_blob(handle, key, rec, &len);
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t app_storage_set_group(const char *group) {
+    if (!group) return ESP_ERR_INVALID_ARG;
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NS_DEV_ID, NVS_READWRITE, &handle);
+    if (err != ESP_OK) return err;
+    if (group[0]) {
+        err = nvs_set_str(handle, "group", group);
+    } else {
+        err = nvs_erase_key(handle, "group");
+        if (err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t app_storage_get_group(char *out_group, size_t max_len) {
+    if (!out_group || max_len == 0) return ESP_ERR_INVALID_ARG;
+    out_group[0] = 0;
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NS_DEV_ID, NVS_READONLY, &handle);
+    if (err != ESP_OK) return err;
+    size_t required = max_len;
+    err = nvs_get_str(handle, "group", out_group, &required);
+    if (err != ESP_OK) out_group[0] = 0;
+    nvs_close(handle);
+    return err;
+}
+
+// 定长 Blob 读写 (计量相关记录)
+static esp_err_t save_blob(const char *ns, const char *key, const void *data, size_t len) {
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(ns, NVS_READWRITE, &handle);
+    if (err != ESP_OK) return err;
+    err = nvs_set_blob(handle, key, data, len);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+static esp_err_t load_blob(const char *ns, const char *key, void *data, size_t len) {
+    memset(data, 0, len);
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(ns, NVS_READONLY, &handle);
+    if (err != ESP_OK) return err;
+    size_t got = len;
+    err = nvs_get_blob(handle, key, data, &got);
+    nvs_close(handle);
+    if (err == ESP_OK && got != len) {
+        memset(data, 0, len); // 结构体版本不一致，视为无记录
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    return err;
+}
+
+esp_err_t app_storage_save_broker_list(const broker_list_t *list) {
+    if (!list || list->count > BROKER_MAX) return ESP_ERR_INVALID_ARG;
+    return save_blob(NET_CONFIG_NAMESPACE, "brokers", list, sizeof(broker_list_t));
+}
+
+esp_err_t app_storage_load_broker_list(broker_list_t *list) {
+    if (!list) return ESP_ERR_INVALID_ARG;
+    esp_err_t err = load_blob(NET_CONFIG_NAMESPACE, "brokers", list, sizeof(broker_list_t));
+    if (err == ESP_OK && (list->count > BROKER_MAX || list->active >= list->count)) {
+        memset(list, 0, sizeof(broker_list_t));
+        err = ESP_ERR_INVALID_STATE;
+    }
+    return err;
+}
+
+esp_err_t app_storage_save_ledger(const ledger_store_t *ledger) {
+    if (!ledger) return ESP_ERR_INVALID_ARG;
+    return save_blob(NS_METER, "ledger", ledger, sizeof(ledger_store_t));
+}
+
+esp_err_t app_storage_load_ledger(ledger_store_t *ledger) {
+    if (!ledger) return ESP_ERR_INVALID_ARG;
+    return load_blob(NS_METER, "ledger", ledger, sizeof(ledger_store_t));
+}
+
+esp_err_t app_storage_save_meter_acc(const meter_acc_t *acc) {
+    if (!acc) return ESP_ERR_INVALID_ARG;
+    return save_blob(NS_METER, "acc", acc, sizeof(meter_acc_t));
+}
+
+esp_err_t app_storage_load_meter_acc(meter_acc_t *acc) {
+    if (!acc) return ESP_ERR_INVALID_ARG;
+    return load_blob(NS_METER, "acc", acc, sizeof(meter_acc_t));
+}
+
+// 使用统计分片：头部 "u_hd"，小时分片 "uh0".."uh5"，天分片 "ud0".."ud3"
+// 共占 106 个 NVS 条目 (整块保存时 82 个)，每次定时落盘只改写头部与一个小时分片共 13 个
+#define USAGE_HEAD_LEN offsetof(usage_store_t, hours)
+
+// 天分片与"最后并入的小时"在同一个键里，两者一起生效
+typedef struct {
+    uint32_t merged_hour;
+    usage_bucket_t buckets[USAGE_CHUNK];
+} usage_day_chunk_t;
+
+static size_t usage_chunk_count(int total, int chunk) {
+    int n = total - chunk * USAGE_CHUNK;
+    return (size_t)(n < USAGE_CHUNK ? n : USAGE_CHUNK);
+}
+
+esp_err_t app_storage_save_usage_head(const usage_store_t *store) {
+    if (!store) return ESP_ERR_INVALID_ARG;
+    return save_blob(NS_METER, "u_hd", store, USAGE_HEAD_LEN);
+}
+
+esp_err_t app_storage_save_usage_hours(const usage_store_t *store, int slot) {
+    if (!store || slot < 0 || slot >= USAGE_HOURS) return ESP_ERR_INVALID_ARG;
+    int chunk = slot / USAGE_CHUNK;
+    char key[8];
+    snprintf(key, sizeof(key), "uh%d", chunk);
+    return save_blob(NS_METER, key, &store->hours[chunk * USAGE_CHUNK],
+                     usage_chunk_count(USAGE_HOURS, chunk) * sizeof(usage_bucket_t));
+}
+
+esp_err_t app_storage_save_usage_days(const usage_store_t *store, int slot, uint32_t merged_hour) {
+    if (!store || slot < 0 || slot >= USAGE_DAYS) return ESP_ERR_INVALID_ARG;
+    int chunk = slot / USAGE_CHUNK;
+    size_t n = usage_chunk_count(USAGE_DAYS, chunk);
+    usage_day_chunk_t rec = { .merged_hour = merged_hour };
+    memcpy(rec.buckets, &store->days[chunk * USAGE_CHUNK], n * sizeof(usage_bucket_t));
+    char key[8];
+    snprintf(key, sizeof(key), "ud%d", chunk);
+    return save_blob(NS_METER, key, &rec, offsetof(usage_day_chunk_t, buckets) + n * sizeof(usage_bucket_t));
+}
+
+esp_err_t app_storage_load_usage(usage_store_t *store, uint32_t *merged_hour) {
+    if (!store || !merged_hour) return ESP_ERR_INVALID_ARG;
+    memset(store, 0, sizeof(usage_store_t));
+    *merged_hour = 0;
+
+    esp_err_t err = load_blob(NS_METER, "u_hd", store, USAGE_HEAD_LEN);
+    if (err != ESP_OK) return err;
+
+    char key[8];
+    for (int c = 0; c * USAGE_CHUNK < USAGE_HOURS; c++) {
+        snprintf(key, sizeof(key), "uh%d", c);
+        load_blob(NS_METER, key, &store->hours[c * USAGE_CHUNK],
+                  usage_chunk_count(USAGE_HOURS, c) * sizeof(usage_bucket_t));
+    }
+    for (int c = 0; c * USAGE_CHUNK < USAGE_DAYS; c++) {
+        size_t n = usage_chunk_count(USAGE_DAYS, c);
+        usage_day_chunk_t rec;
+        snprintf(key, sizeof(key), "ud%d", c);
+        if (load_blob(NS_METER, key, &rec, offsetof(usage_day_chunk_t, buckets) + n * sizeof(usage_bucket_t)) == ESP_OK) {
+            memcpy(&store->days[c * USAGE_CHUNK], rec.buckets, n * sizeof(usage_bucket_t));
+            if (rec.merged_hour > *merged_hour) *merged_hour = rec.merged_hour;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t app_storage_save_alerts(const alert_store_t *store) {
+    if (!store) return ESP_ERR_INVALID_ARG;
+    return save_blob(NS_DEV_STAT, "alerts", store, sizeof(alert_store_t));
+}
+
+esp_err_t app_storage_load_alerts(alert_store_t *store) {
+    if (!store) return ESP_ERR_INVALID_ARG;
+    return load_blob(NS_DEV_STAT, "alerts", store, sizeof(alert_store_t));
+}
+
+esp_err_t app_storage_save_rules(const rule_store_t *store) {
+    if (!store || store->count > ALERT_RULE_MAX) return ESP_ERR_INVALID_ARG;
+    return save_blob(NS_DEV_STAT, "rules", store, sizeof(rule_store_t));
+}
+
+esp_err_t app_storage_load_rules(rule_store_t *store) {
+    if (!store) return ESP_ERR_INVALID_ARG;
+    esp_err_t err = load_blob(NS_DEV_STAT, "rules", store, sizeof(rule_store_t));
+    if (err == ESP_OK && store->count > ALERT_RULE_MAX) {
+        memset(store, 0, sizeof(rule_store_t));
+        err = ESP_ERR_INVALID_STATE;
+    }
+    return err;
+}
+
+esp_err_t app_storage_save_tou(const tou_store_t *store) {
+    if (!store || store->count > TOU_WINDOW_MAX) return ESP_ERR_INVALID_ARG;
+    return save_blob(NS_DEV_STAT, "tou", store, sizeof(tou_store_t));
+}
+
+esp_err_t app_storage_load_tou(tou_store_t *store) {
+    if (!store) return ESP_ERR_INVALID_ARG;
+    esp_err_t err = load_blob(NS_DEV_STAT, "tou", store, sizeof(tou_store_t));
+    if (err == ESP_OK && store->count > TOU_WINDOW_MAX) {
+        memset(store, 0, sizeof(tou_store_t));
+        err = ESP_ERR_INVALID_STATE;
+    }
+    return err;
+}
+
+esp_err_t app_storage_save_ota_progress(const ota_progress_t *prog) {
+    if (!prog) return ESP_ERR_INVALID_ARG;
+    return save_blob(NS_DEV_STAT, "ota_prog", prog, sizeof(ota_progress_t));
+}
+
+esp_err_t app_storage_load_ota_progress(ota_progress_t *prog) {
+    if (!prog) return ESP_ERR_INVALID_ARG;
+    esp_err_t err = load_blob(NS_DEV_STAT, "ota_prog", prog, sizeof(ota_progress_t));
+    if (err == ESP_OK) prog->url[sizeof(prog->url) - 1] = '\0';
+    return err;
+}
+
+esp_err_t app_storage_clear_ota_progress(void) {
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NS_DEV_STAT, NVS_READWRITE, &handle);
+    if (err != ESP_OK) return err;
+    err = nvs_erase_key(handle, "ota_prog");
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        err = ESP_OK;
+    } else if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t app_storage_set_tunable(const char *key, const int32_t *value) {
+    if (!key) return ESP_ERR_INVALID_ARG;
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NS_TUNE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) return err;
+    if (value) {
+        err = nvs_set_i32(handle, key, *value);
+    } else {
+        err = nvs_erase_key(handle, key);
+        if (err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t app_storage_get_tunable(const char *key, int32_t *out_value) {
+    if (!key || !out_value) return ESP_ERR_INVALID_ARG;
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NS_TUNE, NVS_READONLY, &handle);
+    if (err != ESP_OK) return err;
+    err = nvs_get_i32(handle, key, out_value);
+    nvs_close(handle);
+    return err;
+}
+
 esp_err_t app_storage_set_pump_spec(uint8_t spec) {
     nvs_handle_t handle;
     esp_err_t err = nvs_open(NS_DEV_ID, NVS_READWRITE, &handle);
@@ -265,3 +693,30 @@ esp_err_t app_storage_get_pump_spec(uint8_t *out_spec) {
     nvs_close(handle);
     return err;
 }
+
+esp_err_t app_storage_get_tls_ca(char *out, size_t *inout_len) {
+    if (!inout_len) return ESP_ERR_INVALID_ARG;
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NS_TLS, NVS_READONLY, &handle);
+    if (err != ESP_OK) return err;
+    err = nvs_get_blob(handle, "ca", out, inout_len);
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t app_storage_get_tls_pins(uint8_t pins[][TLS_PIN_LEN], size_t max, size_t *out_count) {
+    if (!pins || !out_count) return ESP_ERR_INVALID_ARG;
+    *out_count = 0;
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NS_TLS, NVS_READONLY, &handle);
+    if (err != ESP_OK) return err;
+    size_t len = max * TLS_PIN_LEN;
+    err = nvs_get_blob(handle, "spki", pins, &len);
+    nvs_close(handle);
+    if (err == ESP_OK) {
+        *out_count = len / TLS_PIN_LEN;
+    }
+    return err;
+}
@@ -11,6 +11,7 @@
 //    -> 成功（拿到 IP）回 {"statusWiFi":1}
 //    -> 失败回 {"statusWiFi":2}
 // 4) {"mqttserver":"ip:port","username":"..","password":".."}
+//    或 {"mqttservers":["ip:port","ip2:port"],...} (多接入点，按优先级排序，第一个为主接入点)
 //    -> 设备在“MQTT 已完成登录并成功发送 init 且收到套餐 cmd（plan）”时回 {"statusMQTT":0}
 //       （当前沿用 APP_EVENT_MQTT_PLAN_RECEIVED 触发）
 // 5) {"statusBLE":1}            -> 设备回 {"statusBLE":1} 并主动断开 BLE
@@ -854,7 +855,17 @@ static void prov_handle_json(uint8_t *data, int len) {
     }
 
     char mqtt_server_buf[128] = {0};
-    if (prov_cjson_get_string(root, "mqttserver", mqtt_server_buf, sizeof(mqtt_server_buf))) {
+    cJSON *mqtt_servers = cJSON_GetObjectItemCaseSensitive(root, "mqttservers");
+    if (!cJSON_IsArray(mqtt_servers)) mqtt_servers = NULL;
+    bool has_mqtt_server = prov_cjson_get_string(root, "mqttserver", mqtt_server_buf, sizeof(mqtt_server_buf));
+    if (!has_mqtt_server && mqtt_servers) {
+        cJSON *first = cJSON_GetArrayItem(mqtt_servers, 0);
+        if (cJSON_IsString(first) && first->valuestring && first->valuestring[0]) {
+            strncpy(mqtt_server_buf, first->valuestring, sizeof(mqtt_server_buf) - 1);
+            has_mqtt_server = true;
+        }
+    }
+    if (has_mqtt_server) {
         if (s_step != PROV_STEP_WAIT_MQTT_CFG) {
             PROV_W("step mismatch for mqtt cfg, cur=%s", prov_step_str(s_step));
             cJSON_Delete(root);
@@ -881,6 +892,27 @@ static void prov_handle_json(uint8_t *data, int len) {
         strncpy(cfg.password_mqtt, password_buf, sizeof(cfg.password_mqtt) - 1);
         snprintf(cfg.full_url, sizeof(cfg.full_url), "%s://%s:%d", scheme, cfg.mqtt_host, cfg.mqtt_port);
 
+        // 接入点列表：单个 mqttserver 时只有主接入点 (覆盖旧列表)
+        broker_list_t brokers = {0};
+        strncpy(brokers.urls[0], cfg.full_url, BROKER_URL_LEN - 1);
+        brokers.count = 1;
+        if (mqtt_servers) {
+            int n = cJSON_GetArraySize(mqtt_servers);
+            for (int i = 1; i < n && brokers.count < BROKER_MAX; i++) {
+                cJSON *it = cJSON_GetArrayItem(mqtt_servers, i);
+                if (!cJSON_IsString(it) || !it->valuestring || !it->valuestring[0]) continue;
+                char ep_scheme[8] = {0};
+                char ep_host[64] = {0};
+                int ep_port = 0;
+                prov_parse_mqtt_server(it->valuestring, ep_scheme, sizeof(ep_scheme), ep_host, sizeof(ep_host), &ep_port);
+                if (!ep_host[0]) continue;
+                snprintf(brokers.urls[brokers.count], BROKER_URL_LEN, "%s://%s:%d", ep_scheme, ep_host, ep_port);
+                PROV_I("MQTT backup endpoint[%d]: %s", brokers.count, brokers.urls[brokers.count]);
+                brokers.count++;
+            }
+        }
+        app_storage_save_broker_list(&brokers);
+
         app_storage_save_net_config(&cfg);
         app_storage_set_pending_init(1);
         app_events_post_mqtt_config_updated();
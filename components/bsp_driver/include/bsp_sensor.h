@@ -12,11 +12,28 @@ void bsp_sensor_init(void);
 // 获取温度值 (摄氏度)
 float bsp_sensor_get_temperature(void);
 
-// 获取 TDS 值 (ppm)，内部已做温度补偿
+// TDS 快照：由后台采样任务周期性上电采样并做温度补偿，读取方只访问内存
+typedef struct {
+    int tds_in;         // ppm
+    int tds_out;
+    int tds_backup;
+    int64_t sample_us;  // 采样时刻 (esp_timer 时基)，0 表示尚未采样
+} bsp_tds_snapshot_t;
+
+// 获取 TDS 快照，返回采样距今的秒数 (尚未采样时返回 -1)
+int bsp_sensor_get_tds_snapshot(bsp_tds_snapshot_t *out);
+
+// 获取 TDS 值 (ppm)，返回快照中的缓存值，不阻塞、不触发探头上电
 int bsp_sensor_get_tds_in(void);
 int bsp_sensor_get_tds_out(void);
 int bsp_sensor_get_tds_backup(void);
 
+// 设置后台采样周期 (毫秒)，0 恢复默认的空闲周期；新周期立即生效
+void bsp_sensor_set_sample_interval(uint32_t interval_ms);
+
+// 请求尽快补采一次 (异步，1 秒内的重复请求合并)
+void bsp_sensor_request_sample(void);
+
 // 流量计接口
 uint32_t bsp_sensor_get_flow_pulses(void);
 void bsp_sensor_clear_flow_pulses(void);
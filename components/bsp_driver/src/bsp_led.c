@@ -3,6 +3,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "tunables.h"
 
 static const char *TAG = "BSP_LED";
 
@@ -38,7 +39,7 @@ static void led_animation_task(void *arg) {
     uint32_t tick = 0;
     
     while(1) {
-        vTaskDelay(pdMS_TO_TICKS(150)); // 150ms 刷新一帧
+        vTaskDelay(pdMS_TO_TICKS(tunable(TUN_LED_FRAME_MS))); // 默认 150ms 刷新一帧
         tick++;
         
         uint8_t dig1 = 0x00;
@@ -8,6 +8,8 @@
 #include "esp_event.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
 #include "app_events.h"
 #include <math.h>
 #include "bsp_pump_valve.h"
@@ -37,6 +39,19 @@ static bool s_pump_zero_enabled = false;
 static bool s_last_low_press = true;  // 假设初始正常
 static bool s_last_high_press = false; // 假设初始未满
 
+// --- TDS 后台采样 ---
+// 探头上电、稳定、读数都在采样任务内完成，查询方只读快照；
+// 上电次数只取决于采样周期，与查询频率无关
+#define TDS_SAMPLE_IDLE_MS  (10 * 60 * 1000) // 默认空闲采样周期
+#define TDS_SAMPLE_MIN_MS   1000             // 两次上电的最小间隔，防止密集轰炸硬件 LDO
+
+static bsp_tds_snapshot_t s_tds_snap = {0};
+static SemaphoreHandle_t s_tds_lock = NULL;
+static TaskHandle_t s_tds_task = NULL;
+static volatile uint32_t s_tds_interval_ms = TDS_SAMPLE_IDLE_MS;
+
+static void tds_sampler_task(void *arg);
+
 // ==========================================
 // 1. 高低压开关消抖任务 (取代 ISR 中断)
 // ==========================================
@@ -161,6 +176,10 @@ adc_oneshot_chan_cfg_t config_11db = {
     ESP_ERROR_CHECK(pcnt_unit_clear_count(s_pcnt_unit));
     ESP_ERROR_CHECK(pcnt_unit_start(s_pcnt_unit));
 
+    // 4. 启动 TDS 后台采样 (启动即采样一次，保证快照尽早可用)
+    s_tds_lock = xSemaphoreCreateMutex();
+    xTaskCreate(tds_sampler_task, "tds_smp", 2560, NULL, 4, &s_tds_task);
+
     ESP_LOGI(TAG, "传感器子系统初始化完成");
 }
 
@@ -168,12 +187,6 @@ adc_oneshot_chan_cfg_t config_11db = {
 // 3. 算法计算逻辑 (NTC 独立，TDS 批处理防浪涌)
 // ==========================================
 
-// 缓存 TDS 读取的值，防止频繁唤醒硬件
-static int s_raw_tds_in = 0;
-static int s_raw_tds_out = 0;
-static int s_raw_tds_backup = 0;
-static uint32_t s_last_read_ticks = 0;
-
 // --- NTC 温度独立读取 (随时可用，不受 IO15 限制) ---
 float bsp_sensor_get_temperature(void) {
     int raw_temp;
@@ -185,12 +198,24 @@ float bsp_sensor_get_temperature(void) {
     return 25.0f; 
 }
 
+// --- 核心计算 ---
+static int calculate_tds(int raw_adc) {
+    float voltage = (float)raw_adc * 3.3f / 4095.0f;
+    
+    // 获取实时温度（现在它非常快，不会引发 IO15 动作）
+    float temp = bsp_sensor_get_temperature(); 
+    
+    // 核心：温度补偿公式 (每升高1度，电导率增加约 2%)
+    float comp_voltage = voltage / (1.0f + 0.02f * (temp - 25.0f));
+    
+    // TODO: 根据您的探头 K 值进行计算
+    int tds_value = (int)(comp_voltage * 100.0f); // 占位系数
+    return (tds_value > 0) ? tds_value : 0;
+}
+
 // --- TDS 统一批处理读取：一次通电，读取全部 3 个 TDS ---
 static void bsp_sensor_read_tds_batch(void) {
-    // 限制读取频率（1 秒内重复调用直接返回，防止密集轰炸硬件 LDO）
-    if (xTaskGetTickCount() - s_last_read_ticks < pdMS_TO_TICKS(1000) && s_last_read_ticks != 0) {
-        return; 
-    }
+    int raw_in = 0, raw_out = 0, raw_backup = 0;
 
     // 1. 打开 TDS 传感器专供电源 (IO15 = High)
     bsp_set_sensor_power(true);          
@@ -199,44 +224,77 @@ static void bsp_sensor_read_tds_batch(void) {
     vTaskDelay(pdMS_TO_TICKS(20));       
     
     // 3. 瞬间抓取 3 个 TDS 通道的数据 (去除了 NTC)
-    adc_oneshot_read(s_adc1_handle, ADC_CHAN_TDS_IN, &s_raw_tds_in);
-    adc_oneshot_read(s_adc1_handle, ADC_CHAN_TDS_OUT, &s_raw_tds_out);
-    adc_oneshot_read(s_adc1_handle, ADC_CHAN_TDS_BACKUP, &s_raw_tds_backup);
+    adc_oneshot_read(s_adc1_handle, ADC_CHAN_TDS_IN, &raw_in);
+    adc_oneshot_read(s_adc1_handle, ADC_CHAN_TDS_OUT, &raw_out);
+    adc_oneshot_read(s_adc1_handle, ADC_CHAN_TDS_BACKUP, &raw_backup);
     
     // 4. 立刻断电防极化腐蚀 (IO15 = Low)
     bsp_set_sensor_power(false);         
-    
-    s_last_read_ticks = xTaskGetTickCount();
+
+    // 5. 计算后整体替换快照，读取方不会看到半新半旧的数据
+    bsp_tds_snapshot_t snap = {
+        .tds_in = calculate_tds(raw_in),
+        .tds_out = calculate_tds(raw_out),
+        .tds_backup = calculate_tds(raw_backup),
+        .sample_us = esp_timer_get_time(),
+    };
+    xSemaphoreTake(s_tds_lock, portMAX_DELAY);
+    s_tds_snap = snap;
+    xSemaphoreGive(s_tds_lock);
 }
 
-// --- 核心计算 ---
-static int calculate_tds(int raw_adc) {
-    float voltage = (float)raw_adc * 3.3f / 4095.0f;
-    
-    // 获取实时温度（现在它非常快，不会引发 IO15 动作）
-    float temp = bsp_sensor_get_temperature(); 
-    
-    // 核心：温度补偿公式 (每升高1度，电导率增加约 2%)
-    float comp_voltage = voltage / (1.0f + 0.02f * (temp - 25.0f));
-    
-    // TODO: 根据您的探头 K 值进行计算
-    int tds_value = (int)(comp_voltage * 100.0f); // 占位系数
-    return (tds_value > 0) ? tds_value : 0;
+// 后台采样任务
+static void tds_sampler_task(void *arg) {
+    while (1) {
+        bsp_sensor_read_tds_batch();
+        vTaskDelay(pdMS_TO_TICKS(TDS_SAMPLE_MIN_MS));
+        // 周期到期或收到补采请求/周期变更时醒来 (已扣除最小间隔)
+        uint32_t interval_ms = s_tds_interval_ms;
+        uint32_t wait_ms = (interval_ms > TDS_SAMPLE_MIN_MS) ? interval_ms - TDS_SAMPLE_MIN_MS : 0;
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_ms));
+    }
+}
+
+int bsp_sensor_get_tds_snapshot(bsp_tds_snapshot_t *out) {
+    bsp_tds_snapshot_t snap = {0};
+    if (s_tds_lock) {
+        xSemaphoreTake(s_tds_lock, portMAX_DELAY);
+        snap = s_tds_snap;
+        xSemaphoreGive(s_tds_lock);
+    }
+    if (out) *out = snap;
+    if (snap.sample_us == 0) return -1;
+    return (int)((esp_timer_get_time() - snap.sample_us) / 1000000);
 }
 
 int bsp_sensor_get_tds_in(void) { 
-    bsp_sensor_read_tds_batch();
-    return calculate_tds(s_raw_tds_in); 
+    bsp_tds_snapshot_t snap;
+    bsp_sensor_get_tds_snapshot(&snap);
+    return snap.tds_in;
 }
 
 int bsp_sensor_get_tds_out(void) { 
-    bsp_sensor_read_tds_batch();
-    return calculate_tds(s_raw_tds_out); 
+    bsp_tds_snapshot_t snap;
+    bsp_sensor_get_tds_snapshot(&snap);
+    return snap.tds_out;
 }
 
 int bsp_sensor_get_tds_backup(void) { 
-    bsp_sensor_read_tds_batch();
-    return calculate_tds(s_raw_tds_backup); 
+    bsp_tds_snapshot_t snap;
+    bsp_sensor_get_tds_snapshot(&snap);
+    return snap.tds_backup;
+}
+
+void bsp_sensor_set_sample_interval(uint32_t interval_ms) {
+    if (interval_ms == 0) interval_ms = TDS_SAMPLE_IDLE_MS;
+    if (interval_ms < TDS_SAMPLE_MIN_MS) interval_ms = TDS_SAMPLE_MIN_MS;
+    if (interval_ms == s_tds_interval_ms) return;
+    s_tds_interval_ms = interval_ms;
+    if (s_tds_task) xTaskNotifyGive(s_tds_task);
+}
+
+void bsp_sensor_request_sample(void) {
+    if (s_tds_task) xTaskNotifyGive(s_tds_task);
 }
 
 uint32_t bsp_sensor_get_flow_pulses(void) {
@@ -0,0 +1,60 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 指令链路上的打点 (按顺序，前一个点未记录时后面的点忽略)
+typedef enum {
+    CMD_STAGE_RX = 0,    // MQTT 事件任务收到消息
+    CMD_STAGE_QUEUED,    // 解析完成并入队
+    CMD_STAGE_START,     // 指令任务开始执行
+    CMD_STAGE_STORED,    // 参数已写入 NVS，通知状态机
+    CMD_STAGE_EVALUATE,  // 状态机收到 APP_EVENT_CMD_EVALUATE
+    CMD_STAGE_WATER_EVAL,// 状态机开始处理 WATER_EV_EVALUATE
+    CMD_STAGE_ACTUATED,  // 状态评估完成 (阀/泵已按新状态驱动，或无需动作)
+    CMD_STAGE_MAX
+} cmd_stage_t;
+
+// 一次指令的测量结果 (随回执上报；执行延迟只计入直方图，随发布指标上报)
+typedef struct {
+    bool has_cloud;      // 已对时且指令带时间戳
+    int32_t cloud_ms;    // 云端下发时间戳到设备收到消息的差值 (含两端时钟偏差)
+} cmd_trace_result_t;
+
+/**
+ * @brief 初始化 (在指令任务启动之前调用)
+ */
+esp_err_t cmd_trace_init(void);
+
+/**
+ * @brief 指令任务开始执行一条指令时调用，同时记录 RX/QUEUED/START 三个点
+ * @param rx_us      收到消息的时刻 (esp_timer_get_time)
+ * @param queued_us  入队时刻
+ * @param cloud_ts_ms 指令中的云端时间戳 (毫秒)，0 表示未带
+ */
+void cmd_trace_begin(int64_t rx_us, int64_t queued_us, long long cloud_ts_ms);
+
+/**
+ * @brief 记录一个打点 (任意任务可调用；没有进行中的测量时直接返回)
+ */
+void cmd_trace_mark(cmd_stage_t stage);
+
+/**
+ * @brief 指令任务处理完一条指令时调用 (不等待)
+ * 已走到 STORED 的指令在状态机打 ACTUATED 点时才计入直方图，下一条指令开始时仍未执行的按已有打点计入
+ */
+void cmd_trace_end(cmd_trace_result_t *out);
+
+/**
+ * @brief 读取各阶段延迟统计 (返回条数)
+ */
+int cmd_trace_get_stats(metrics_cmd_stage_t *out, int max);
+
+#ifdef __cplusplus
+}
+#endif
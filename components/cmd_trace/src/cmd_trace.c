@@ -0,0 +1,145 @@
+// cmd_trace.c 指令执行延迟测量
+// 同一时刻只有一条指令在执行 (指令任务串行处理)，因此只保留一组打点：
+// 指令任务开始测量，状态机在事件回调中打点；控制类指令在状态机打 ACTUATED 点时完成，
+// 不阻塞指令任务。完成时按相邻打点计入各阶段直方图，随下一次发布指标上报
+#include "cmd_trace.h"
+#include <string.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "CMD_TRACE";
+
+#define TIME_VALID_THRESHOLD  1700000000 // 早于该时间说明尚未对时
+
+// 统计行：相邻打点之间的各阶段，最后一行为端到端
+typedef enum {
+    ROW_PARSE = 0,   // RX -> QUEUED      解析入队
+    ROW_QUEUE,       // QUEUED -> START   队列等待
+    ROW_STORE,       // START -> STORED   校验与 NVS 写入
+    ROW_POST,        // STORED -> EVALUATE 事件循环投递
+    ROW_DISPATCH,    // EVALUATE -> WATER_EVAL 状态机内部事件投递
+    ROW_ACTUATE,     // WATER_EVAL -> ACTUATED 状态评估与 GPIO 驱动
+    ROW_E2E,         // RX -> ACTUATED
+    ROW_MAX
+} trace_row_t;
+
+_Static_assert(ROW_MAX <= METRICS_CMD_STAGES, "metrics_report_t.cmd_stages too small");
+
+static const char *const s_row_names[ROW_MAX] = {
+    "parse", "queue", "store", "post", "dispatch", "actuate", "e2e",
+};
+
+static const uint32_t s_bounds_us[METRICS_HIST_BUCKETS - 1] = {500, 1000, 5000, 10000, 50000, 100000, 500000};
+
+static SemaphoreHandle_t s_lock = NULL;
+static volatile bool s_active = false;     // 测量进行中 (指令任务已结束但等待状态机执行时仍为 true)
+static bool s_ended = false;               // 指令任务已处理完 (cmd_trace_end 已调用)
+static int64_t s_t[CMD_STAGE_MAX];         // 各打点时刻，0 = 未记录
+static long long s_cloud_ts_ms = 0;
+
+static metrics_cmd_stage_t s_rows[ROW_MAX];
+static uint64_t s_row_sum_us[ROW_MAX];
+
+esp_err_t cmd_trace_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    if (!s_lock) return ESP_ERR_NO_MEM;
+    for (int i = 0; i < ROW_MAX; i++) s_rows[i].name = s_row_names[i];
+    return ESP_OK;
+}
+
+static void record_row(int row, int64_t us) {
+    if (us < 0) us = 0;
+    uint32_t v = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+    metrics_cmd_stage_t *r = &s_rows[row];
+    int b = 0;
+    while (b < METRICS_HIST_BUCKETS - 1 && v >= s_bounds_us[b]) b++;
+    r->hist[b]++;
+    r->n++;
+    s_row_sum_us[row] += v;
+    r->avg_us = (uint32_t)(s_row_sum_us[row] / r->n);
+    if (v > r->max_us) r->max_us = v;
+}
+
+// 按已有打点计入直方图并结束测量 (持锁调用)
+static void finish_locked(void) {
+    s_active = false;
+    for (int s = CMD_STAGE_QUEUED; s < CMD_STAGE_MAX; s++) {
+        if (s_t[s] == 0) break;
+        record_row(s - 1, s_t[s] - s_t[s - 1]);
+    }
+    if (s_t[CMD_STAGE_ACTUATED] != 0) {
+        int64_t e2e = s_t[CMD_STAGE_ACTUATED] - s_t[CMD_STAGE_RX];
+        record_row(ROW_E2E, e2e);
+        ESP_LOGI(TAG, "Command actuated, e2e %ldus", (long)e2e);
+    } else if (s_t[CMD_STAGE_STORED] != 0) {
+        ESP_LOGW(TAG, "Actuation not observed before the next command");
+    }
+}
+
+void cmd_trace_begin(int64_t rx_us, int64_t queued_us, long long cloud_ts_ms) {
+    if (!s_lock) return;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_active) finish_locked(); // 上一条指令的执行未被观察到，按已有打点结束
+    memset(s_t, 0, sizeof(s_t));
+    s_t[CMD_STAGE_RX] = rx_us;
+    s_t[CMD_STAGE_QUEUED] = queued_us;
+    s_t[CMD_STAGE_START] = esp_timer_get_time();
+    s_cloud_ts_ms = cloud_ts_ms;
+    s_ended = false;
+    s_active = true;
+    xSemaphoreGive(s_lock);
+}
+
+void cmd_trace_mark(cmd_stage_t stage) {
+    if (!s_active || stage <= CMD_STAGE_START || stage >= CMD_STAGE_MAX) return;
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    // 其他来源触发的评估 (传感器/定时器) 不会先经过前一个打点，自然被忽略
+    if (s_active && s_t[stage - 1] != 0 && s_t[stage] == 0) {
+        s_t[stage] = now;
+        if (stage == CMD_STAGE_ACTUATED && s_ended) finish_locked();
+    }
+    xSemaphoreGive(s_lock);
+}
+
+void cmd_trace_end(cmd_trace_result_t *out) {
+    cmd_trace_result_t res = {0};
+    if (!s_lock) {
+        if (out) *out = res;
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_ended = true;
+    // 已通知状态机但尚未执行的，留到 ACTUATED 打点时结束
+    bool pending = s_t[CMD_STAGE_STORED] != 0 && s_t[CMD_STAGE_ACTUATED] == 0;
+    if (s_active && !pending) finish_locked();
+
+    // 云端到设备：收到消息时的墙上时间 - 指令时间戳
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    if (s_cloud_ts_ms > 0 && tv.tv_sec >= TIME_VALID_THRESHOLD) {
+        int64_t now_ms = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+        int64_t rx_ms = now_ms - (esp_timer_get_time() - s_t[CMD_STAGE_RX]) / 1000;
+        int64_t delta = rx_ms - s_cloud_ts_ms;
+        if (delta > INT32_MAX) delta = INT32_MAX;
+        if (delta < INT32_MIN) delta = INT32_MIN;
+        res.has_cloud = true;
+        res.cloud_ms = (int32_t)delta;
+    }
+    xSemaphoreGive(s_lock);
+
+    if (out) *out = res;
+}
+
+int cmd_trace_get_stats(metrics_cmd_stage_t *out, int max) {
+    if (!out || !s_lock) return 0;
+    int n = (max < ROW_MAX) ? max : ROW_MAX;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    memcpy(out, s_rows, sizeof(s_rows[0]) * n);
+    xSemaphoreGive(s_lock);
+    return n;
+}
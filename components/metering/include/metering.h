@@ -0,0 +1,55 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief 加载账本与未结账累加器 (在 app_storage_init 与默认事件循环创建之后调用)
+ * MQTT 连上后自动补发未确认的账本记录
+ */
+esp_err_t metering_init(void);
+
+/**
+ * @brief 累加一段制水量 (毫升)
+ * @return 本次凑满、需要从套餐/滤芯扣减的整升数 (零头每累计 100 mL 落盘一次)
+ */
+int metering_add_ml(uint32_t ml);
+
+/**
+ * @brief 关闭当前账本记录 (一次制水结束时调用)，同步交给 MQTT 管理任务
+ * 未确认记录已占满环形账本时不关闭，继续累加到当前记录
+ */
+void metering_close_entry(void);
+
+/**
+ * @brief 未结账累加器立即落盘 (计划重启前调用，平时按 100 mL 步长保存)
+ */
+void metering_flush(void);
+
+/**
+ * @brief 云端确认账本 (seq 及之前的记录均已入账)
+ */
+esp_err_t metering_ack(uint32_t seq);
+
+/**
+ * @brief 发布所有未确认的账本记录 (离线时直接返回)
+ * 在调用者任务中发布 QoS1；事件循环与状态机中经 mqtt_manager_request_sync 转交
+ */
+void metering_sync(void);
+
+/**
+ * @brief 尚未从套餐扣减的零头 (毫升)，用于显示
+ */
+uint32_t metering_get_unbilled_ml(void);
+
+/**
+ * @brief 未确认的账本记录条数
+ */
+uint32_t metering_get_unacked(void);
+
+#ifdef __cplusplus
+}
+#endif
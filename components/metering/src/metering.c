@@ -0,0 +1,181 @@
+// metering.c 计量账本
+// 制水量按序号记账 (seq, ml, ts)，云端按 seq 确认；未确认记录保存在 NVS 环形账本中，
+// 连上 MQTT 或新记录关闭时只补发未确认部分，云端按 seq 去重即可精确入账
+#include "metering.h"
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_event.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "app_storage.h"
+#include "app_events.h"
+#include "protocol.h"
+#include "mqtt_manager.h"
+
+static const char *TAG = "METER";
+
+#define TIME_VALID_THRESHOLD 1700000000 // 早于该时间说明尚未对时
+#define ACC_SAVE_STEP_ML     100        // 制水期间累加器落盘步长 (断电最多丢失该水量)
+
+static SemaphoreHandle_t s_lock = NULL;
+static ledger_store_t s_ledger;
+static meter_acc_t s_acc;
+static uint32_t s_unsaved_ml = 0;  // 上次落盘后累加的水量
+
+static uint32_t now_ts(void) {
+    time_t now = time(NULL);
+    if (now >= TIME_VALID_THRESHOLD) return (uint32_t)now;
+    return (uint32_t)(esp_timer_get_time() / 1000000);
+}
+
+// 持锁调用
+static void save_acc_locked(void) {
+    app_storage_save_meter_acc(&s_acc);
+    s_unsaved_ml = 0;
+}
+
+static uint32_t unacked_count(void) {
+    return s_ledger.next_seq - 1 - s_ledger.acked_seq;
+}
+
+static void on_mqtt_connected(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+    mqtt_manager_request_sync(metering_sync); // 事件循环中不直接发布 QoS1
+}
+
+esp_err_t metering_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    if (!s_lock) return ESP_ERR_NO_MEM;
+
+    if (app_storage_load_ledger(&s_ledger) != ESP_OK || s_ledger.next_seq == 0) {
+        memset(&s_ledger, 0, sizeof(s_ledger));
+        s_ledger.next_seq = 1;
+    }
+    if (app_storage_load_meter_acc(&s_acc) != ESP_OK) {
+        memset(&s_acc, 0, sizeof(s_acc));
+        s_acc.open_seq = s_ledger.next_seq;
+    }
+    // 关闭记录时先写账本再写累加器，两次写之间掉电时累加器里的水量已经入账
+    if (s_acc.open_seq != s_ledger.next_seq) {
+        ESP_LOGW(TAG, "Open entry already recorded as seq %lu, reset accumulator", (unsigned long)s_acc.open_seq);
+        s_acc.open_seq = s_ledger.next_seq;
+        s_acc.open_ml = 0;
+        save_acc_locked();
+    }
+
+    ESP_LOGI(TAG, "Ledger next=%lu acked=%lu unacked=%lu, open %lumL, unbilled %lumL",
+             (unsigned long)s_ledger.next_seq, (unsigned long)s_ledger.acked_seq, (unsigned long)unacked_count(),
+             (unsigned long)s_acc.open_ml, (unsigned long)s_acc.unbilled_ml);
+
+    return esp_event_handler_register(APP_EVENTS, APP_EVENT_MQTT_CONNECTED, on_mqtt_connected, NULL);
+}
+
+int metering_add_ml(uint32_t ml) {
+    if (!s_lock || ml == 0) return 0;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_acc.open_ml += ml;
+    s_acc.unbilled_ml += ml;
+    s_unsaved_ml += ml;
+    int liters = (int)(s_acc.unbilled_ml / 1000);
+    if (liters > 0) {
+        s_acc.unbilled_ml %= 1000;
+    }
+    // 凑满整升时与套餐扣减同步落盘，其余按步长落盘，断电最多丢失 ACC_SAVE_STEP_ML
+    if (liters > 0 || s_unsaved_ml >= ACC_SAVE_STEP_ML) {
+        save_acc_locked();
+    }
+    xSemaphoreGive(s_lock);
+    return liters;
+}
+
+void metering_close_entry(void) {
+    if (!s_lock) return;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_acc.open_ml == 0) {
+        xSemaphoreGive(s_lock);
+        return;
+    }
+    if (unacked_count() >= LEDGER_RING_LEN) {
+        // 账本已满 (长期离线)：不覆盖未确认记录，继续累加到当前记录
+        ESP_LOGW(TAG, "Ledger full, fold %lumL into open entry", (unsigned long)s_acc.open_ml);
+        save_acc_locked();
+        xSemaphoreGive(s_lock);
+        return;
+    }
+
+    uint32_t seq = s_ledger.next_seq;
+    ledger_entry_t *e = &s_ledger.entries[seq % LEDGER_RING_LEN];
+    e->seq = seq;
+    e->ml = s_acc.open_ml;
+    e->ts = now_ts();
+    s_ledger.next_seq++;
+    app_storage_save_ledger(&s_ledger);
+
+    s_acc.open_seq = s_ledger.next_seq;
+    s_acc.open_ml = 0;
+    save_acc_locked();
+    ESP_LOGI(TAG, "Ledger entry seq=%lu %lumL", (unsigned long)seq, (unsigned long)e->ml);
+    xSemaphoreGive(s_lock);
+
+    mqtt_manager_request_sync(metering_sync); // 由状态机转移调用，交给 MQTT 管理任务发布
+}
+
+esp_err_t metering_ack(uint32_t seq) {
+    if (!s_lock) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (seq >= s_ledger.next_seq) {
+        xSemaphoreGive(s_lock);
+        ESP_LOGW(TAG, "Ack seq %lu beyond last entry %lu", (unsigned long)seq, (unsigned long)(s_ledger.next_seq - 1));
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (seq > s_ledger.acked_seq) {
+        s_ledger.acked_seq = seq;
+        app_storage_save_ledger(&s_ledger);
+        ESP_LOGI(TAG, "Ledger acked up to seq %lu", (unsigned long)seq);
+    }
+    xSemaphoreGive(s_lock);
+    return ESP_OK;
+}
+
+void metering_sync(void) {
+    if (!s_lock) return;
+    ledger_report_t *report = calloc(1, sizeof(ledger_report_t)); // 结构体较大，不占用调用者的任务栈
+    if (!report) return;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    report->acked_seq = s_ledger.acked_seq;
+    for (uint32_t seq = s_ledger.acked_seq + 1; seq < s_ledger.next_seq && report->count < LEDGER_REPORT_MAX; seq++) {
+        const ledger_entry_t *e = &s_ledger.entries[seq % LEDGER_RING_LEN];
+        report->entries[report->count].seq = e->seq;
+        report->entries[report->count].ml = e->ml;
+        report->entries[report->count].ts = e->ts;
+        report->count++;
+    }
+    xSemaphoreGive(s_lock);
+
+    if (report->count > 0 && mqtt_manager_publish_ledger(report) == ESP_OK) {
+        ESP_LOGI(TAG, "Ledger sync: %d entries", report->count);
+    }
+    free(report);
+}
+
+void metering_flush(void) {
+    if (!s_lock) return;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    save_acc_locked();
+    xSemaphoreGive(s_lock);
+}
+
+uint32_t metering_get_unbilled_ml(void) {
+    return s_acc.unbilled_ml;
+}
+
+uint32_t metering_get_unacked(void) {
+    if (!s_lock) return 0;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    uint32_t n = unacked_count();
+    xSemaphoreGive(s_lock);
+    return n;
+}
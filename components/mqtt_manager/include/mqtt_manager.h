@@ -2,6 +2,7 @@
 #include "esp_err.h"
 #include <stdbool.h>
 #include "protocol.h"
+#include "app_storage.h"
 
 /**
  * @brief 初始化 MQTT (读取配置并配置客户端，但暂不连接)
@@ -18,9 +19,71 @@ void mqtt_manager_start(void);
  */
 void mqtt_manager_stop(void);
 
+/**
+ * @brief 切换分组指令订阅 (分组已由调用者写入 NVS)，空字符串表示退出分组
+ * 分组名不合法 (见 protocol_group_is_valid) 时保持原订阅不变
+ */
+void mqtt_manager_set_group(const char *group);
+
+/**
+ * @brief 更新 Broker 接入点列表 (按优先级排序) 并写入 NVS
+ * 当前接入点仍在列表中时保持连接，否则触发重连
+ */
+esp_err_t mqtt_manager_set_brokers(const char urls[][BROKER_URL_LEN], int count);
+
+/**
+ * @brief 当前连接使用的 MQTT 心跳 (秒)，按联网方式自适应探测，未启动时为 0
+ */
+int mqtt_manager_get_keepalive(void);
+
+// 云端指令队列统计 (指令在独立任务中执行，MQTT 事件任务只负责解析入队)
+typedef struct {
+    uint32_t received;        // 入队成功的指令数
+    uint32_t dropped;         // 队列满被拒绝的指令数 (已回执 BUSY)
+    uint32_t max_depth;       // 队列最大堆积深度
+    uint32_t last_wait_ms;    // 最近一条指令的排队时长
+    uint32_t max_wait_ms;     // 最大排队时长
+    uint32_t avg_wait_ms;     // 平均排队时长
+    uint32_t max_exec_ms;     // 最长执行时长
+} mqtt_cmd_stats_t;
+
+void mqtt_manager_get_cmd_stats(mqtt_cmd_stats_t *out);
+
+/**
+ * @brief 发布指标快照 (按消息类别的入队到 PUBACK 延迟直方图、收发字节、重传与断线原因)
+ *        同样的数据每 5 分钟自动发布到 {product}/{device}/metrics
+ */
+void mqtt_manager_get_metrics(metrics_report_t *out);
+
 esp_err_t mqtt_manager_publish_status(const status_report_t *data);
 
 esp_err_t mqtt_manager_publish_log(const log_report_t *data);
 
 esp_err_t mqtt_manager_publish_alert(const alert_report_t *data);
+// 告警批量变化 (仅在已连接时发布，离线期间由告警管理器保留待上报的变化)
+esp_err_t mqtt_manager_publish_alert_batch(const alert_batch_t *data);
+esp_err_t mqtt_manager_publish_receipt(const cmd_receipt_t *data);
+// 计量账本 (仅在已连接时发布，离线期间由账本自身保留未确认记录)
+esp_err_t mqtt_manager_publish_ledger(const ledger_report_t *data);
+// 制水会话记录 (每次制水结束一条)
+esp_err_t mqtt_manager_publish_session(const session_report_t *data);
+
+/**
+ * @brief 制水会话记录入队，由 MQTT 管理任务发布 (供状态机转移中调用)
+ * @return 队列满时返回 ESP_ERR_NO_MEM
+ */
+esp_err_t mqtt_manager_queue_session(const session_report_t *data);
+
+typedef void (*mqtt_sync_fn_t)(void);
+
+/**
+ * @brief 在 MQTT 管理任务中执行一次同步 (如 metering_sync / usage_stats_sync_digest)
+ * QoS1 发布会等待客户端锁，不能在事件循环回调、状态机转移或水机监控任务中直接调用；
+ * 队列满时丢弃，由调用方的周期重发或下次连接兜底
+ */
+esp_err_t mqtt_manager_request_sync(mqtt_sync_fn_t fn);
+// 使用统计 (日摘要/历史查询结果，仅在已连接时发布)
+esp_err_t mqtt_manager_publish_usage(const usage_report_t *data);
+// 运行参数查询结果 (仅在已连接时发布)
+esp_err_t mqtt_manager_publish_config(const config_report_t *data);
 esp_err_t mqtt_manager_publish(const char *topic, const char *payload);
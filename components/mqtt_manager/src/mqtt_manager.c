@@ -1,16 +1,27 @@
 #include "mqtt_manager.h"
 #include "mqtt_client.h"
 #include <string.h>
+#include <stdio.h>
+#include <errno.h>
 #include "esp_log.h"
+#include "esp_tls_errors.h"
 #include "app_storage.h"
 #include "protocol.h"
 
 #include "app_events.h"
 #include "esp_event.h"
 #include "esp_netif.h"
-#include "esp_crt_bundle.h"
+#include "trust_store.h"
+#include "cmd_trace.h"
+#include "tou_schedule.h"
 
 #include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
 
 
 static const char *TAG = "MQTT_MGR";
@@ -26,6 +37,168 @@ static char s_topic_cmd[64];
 static char s_topic_status[64];
 static char s_topic_log[64];
 static char s_topic_alert[64];
+static char s_topic_receipt[64];
+static char s_topic_metrics[64];
+static char s_topic_online[64];
+static char s_topic_ledger[64];
+static char s_topic_usage[64];
+static char s_topic_session[64];
+static char s_topic_config[64];
+static char s_topic_all_cmd[64];   // 全量指令 (所有设备)
+static char s_topic_group_cmd[64]; // 分组指令，未设置分组时为空
+
+// --- 在线状态 ---
+// 遗嘱与上线消息都发布到保留的 .../online，云端订阅即可得到在线状态，无需轮询 QUERY_STATUS
+// 最近一次完整 Status 同样以保留消息发布，作为最后已知状态
+#define LWT_PAYLOAD        "{\"online\":0}"
+#define STATUS_RETAIN      1
+
+// 客户端配置副本 (esp_mqtt_set_config 运行时改参数需要完整配置，字符串指向 s_net_cfg)
+static net_config_t s_net_cfg;
+static esp_mqtt_client_config_t s_mqtt_cfg;
+static SemaphoreHandle_t s_lock = NULL;   // 保护 s_client 的创建/销毁与后台维护
+static SemaphoreHandle_t s_pub_lock = NULL; // 串行化发布 (MQTT5 发布属性是客户端全局状态，设置与发布需原子)
+static TaskHandle_t s_mgr_task = NULL;
+static bool s_on_connect_pending = false; // 连接建立后需要发布的消息交给后台任务发送
+static QueueHandle_t s_receipt_queue = NULL; // 事件任务中产生的回执 (BUSY) 由后台任务发送
+static QueueHandle_t s_sync_queue = NULL;    // 其他模块转交的同步请求 (mqtt_sync_fn_t)
+static QueueHandle_t s_session_queue = NULL; // 状态机转移中产生的制水会话记录
+static bool s_connected = false;
+static int64_t s_connected_since_us = 0;
+
+// --- 消息类别 (Topic Alias / 发布属性按类别区分) ---
+typedef enum {
+    MSG_CLASS_INIT = 0,
+    MSG_CLASS_STATUS,
+    MSG_CLASS_LOG,
+    MSG_CLASS_ALERT,
+    MSG_CLASS_RECEIPT,
+    MSG_CLASS_RAW,
+    MSG_CLASS_METRICS,
+    MSG_CLASS_PRESENCE,
+    MSG_CLASS_LEDGER,
+    MSG_CLASS_USAGE,
+    MSG_CLASS_SESSION,
+    MSG_CLASS_CONFIG,
+    MSG_CLASS_MAX,
+} msg_class_t;
+
+_Static_assert(MSG_CLASS_MAX <= METRICS_CLASS_MAX, "metrics_report_t.classes too small");
+
+static const char *const s_class_names[MSG_CLASS_MAX] = {
+    "init", "status", "log", "alert", "receipt", "raw", "metrics", "online", "ledger", "usage", "session", "config",
+};
+
+// --- 发布指标 ---
+// 发布时记录 msg_id 与入队时间，MQTT_EVENT_PUBLISHED 按 msg_id 匹配得到入队到 PUBACK 的延迟
+// 指标锁只保护统计数据，持锁期间不调用任何 MQTT 接口 (事件回调中也可以安全使用)
+#define METRICS_PENDING_MAX       16
+#define METRICS_REPORT_INTERVAL_S 300
+
+typedef enum {
+    PENDING_FREE = 0,
+    PENDING_SENT,        // 已发布等待确认
+    PENDING_ACKED_EARLY, // 确认先于登记到达 (事件任务优先级更高)
+} pending_state_t;
+
+typedef struct {
+    int msg_id;
+    uint8_t cls;
+    uint8_t state;
+    int64_t t_us;        // SENT: 入队时间; ACKED_EARLY: 确认时间
+} pending_msg_t;
+
+static const uint32_t s_hist_bounds_ms[METRICS_HIST_BUCKETS - 1] = {50, 100, 250, 500, 1000, 2500, 5000};
+
+static SemaphoreHandle_t s_metrics_lock = NULL;
+static pending_msg_t s_pending[METRICS_PENDING_MAX];
+static metrics_class_t s_class_metrics[MSG_CLASS_MAX];
+static uint64_t s_class_lat_sum_ms[MSG_CLASS_MAX];
+static metrics_report_t s_metrics; // 非类别字段 (收包/重传/断线) 直接累加在这里
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+// --- MQTT 5 ---
+// 连接时优先使用 v5，Broker 拒绝协议版本 (或 v5 下 CONNACK 连续被拒) 时本次上电回退到 3.1.1
+#define MQTT5_LOG_EXPIRY_SEC     600   // 日志过期时间：离线期间堆积在 Broker 的旧日志不再投递
+#define MQTT5_FALLBACK_FAILS     3
+
+static bool s_mqtt5_active = false;     // 当前连接是否为 v5
+static bool s_mqtt5_ever_connected = false;
+static int s_mqtt5_connect_fails = 0;
+static bool s_mqtt5_unsupported = false; // 已回退 3.1.1，本次上电内不再尝试 v5
+static bool s_alias_ready[MSG_CLASS_MAX]; // 本次连接中该类别的别名映射是否已建立
+static bool s_alias_disabled = false;     // Broker 的 Topic Alias Maximum 不足时本次连接停用
+#endif
+
+// --- 重连退避 (Decorrelated Jitter) ---
+// Broker 重启后全网设备同时断线，固定间隔重连会形成同步冲击。
+// 断线后的第一次重连在 [BASE, FIRST_MAX] 内均匀分散 (连接建立时就预置)，
+// 之后每次失败取 [BASE, 上次*3] 内的随机值 (封顶 CAP)；切换接入点后取 [BASE, BASE*3] 尽快尝试。
+// 参数变化时用 tools/reconnect_sim.py 评估全网同时断线后的重连冲击
+#define RECONNECT_BASE_MS       2000
+#define RECONNECT_FIRST_MAX_MS  30000
+#define RECONNECT_CAP_MS        300000
+
+static uint32_t s_backoff_ms = RECONNECT_BASE_MS;
+
+// --- 多 Broker 接入点 ---
+// 按列表顺序优先 (云端下发时已按优先级排序)；当前接入点连续 BROKER_FAILOVER_N 次连不上时
+// 切换到列表中最靠前的其余健康接入点。设备只能测到已连上的接入点的建连耗时，不按耗时择优。
+// 切换后保持 (粘滞)，原接入点恢复也不主动切回，避免来回抖动
+#define BROKER_FAILOVER_N   3
+
+static broker_list_t s_brokers;
+static uint8_t s_ep_fails[BROKER_MAX];     // 连续连接失败次数
+static int64_t s_connect_start_us = 0;
+static bool s_net_ready = false;           // 本地网络可用 (APP_EVENT_NET_READY/NET_LOST)
+static bool s_attempt_reached = false;     // 本次连接尝试已到达 Broker (TCP 建连/TLS/CONNACK 阶段失败)
+
+// --- 全量/分组指令 ---
+// 按 DeviceID 哈希在窗口内错峰执行，避免成千上万台设备同时执行并回执冲击 Broker
+#define GROUP_JITTER_DEFAULT_SEC  30
+#define GROUP_JITTER_MAX_SEC      600
+#define DEFER_SLOTS               4
+
+typedef struct {
+    bool used;
+    server_cmd_t cmd;
+    int64_t due_us;
+} deferred_cmd_t;
+
+static SemaphoreHandle_t s_defer_lock = NULL;
+static deferred_cmd_t s_deferred[DEFER_SLOTS];
+static uint32_t s_dev_hash = 0;
+
+// --- 云端指令队列 ---
+// MQTT 事件任务只解析入队，NVS 读写/TDS 采样/状态上报全部放到指令任务，避免阻塞 PUBACK 与心跳
+#define CMD_QUEUE_LEN 6
+
+typedef struct {
+    server_cmd_t cmd;
+    int64_t rx_us;       // 收到消息的时刻 (延迟指令为到期放行的时刻，不计入错峰等待)
+    int64_t enqueue_us;
+} cmd_item_t;
+
+extern esp_err_t app_logic_handle_cmd(server_cmd_t *cmd);
+
+static QueueHandle_t s_cmd_queue = NULL;
+static mqtt_cmd_stats_t s_cmd_stats;
+static uint64_t s_cmd_wait_sum_ms = 0;
+static uint32_t s_cmd_done = 0;
+
+// --- 心跳自适应 (探测 NAT 空闲超时) ---
+// 连接在当前心跳下稳定 KA_STABLE_PINGS 个周期即记为可用，再放大一档重连验证；
+// 验证期间因心跳超时断线则回退到上一个可用值，并把该值记为上限
+#define KA_DEFAULT_WIFI_SEC   120
+#define KA_DEFAULT_PPP_SEC    60     // 运营商 NAT 普遍较短，从保守值起步
+#define KA_MAX_SEC            1200
+#define KA_MIN_STEP_SEC       15     // 两次探测差距小于该值视为收敛
+#define KA_STABLE_PINGS       3
+
+static keepalive_record_t s_ka_rec;
+static int s_ka_current = 0;          // 当前连接使用的心跳 (秒)
+static bool s_ka_probing = false;     // 当前心跳是否为待验证的探测值
+static bool s_ka_reconnecting = false;// 主动重连以应用新心跳，断线不计为失败
 
 
 // 生成所有 Topic
@@ -41,12 +214,617 @@ static void generate_topics(void) {
     snprintf(s_topic_status, sizeof(s_topic_status), "%s/%s/status", PRODUCT_ID, dev_id);
     snprintf(s_topic_log, sizeof(s_topic_log), "%s/%s/log", PRODUCT_ID, dev_id);
     snprintf(s_topic_alert, sizeof(s_topic_alert), "%s/%s/alert", PRODUCT_ID, dev_id);
+    snprintf(s_topic_receipt, sizeof(s_topic_receipt), "%s/%s/receipt", PRODUCT_ID, dev_id);
+    snprintf(s_topic_metrics, sizeof(s_topic_metrics), "%s/%s/metrics", PRODUCT_ID, dev_id);
+    snprintf(s_topic_online, sizeof(s_topic_online), "%s/%s/online", PRODUCT_ID, dev_id);
+    snprintf(s_topic_ledger, sizeof(s_topic_ledger), "%s/%s/ledger", PRODUCT_ID, dev_id);
+    snprintf(s_topic_usage, sizeof(s_topic_usage), "%s/%s/usage", PRODUCT_ID, dev_id);
+    snprintf(s_topic_session, sizeof(s_topic_session), "%s/%s/session", PRODUCT_ID, dev_id);
+    snprintf(s_topic_config, sizeof(s_topic_config), "%s/%s/config", PRODUCT_ID, dev_id);
+    snprintf(s_topic_all_cmd, sizeof(s_topic_all_cmd), "%s/all/cmd", PRODUCT_ID);
+
+    char group[24];
+    s_topic_group_cmd[0] = '\0';
+    if (app_storage_get_group(group, sizeof(group)) == ESP_OK && group[0] && protocol_group_is_valid(group)) {
+        snprintf(s_topic_group_cmd, sizeof(s_topic_group_cmd), "%s/group/%s/cmd", PRODUCT_ID, group);
+    }
+    s_dev_hash = protocol_device_hash();
 
     ESP_LOGI(TAG, "Init Topic: %s", s_topic_init);
     ESP_LOGI(TAG, "Cmd  Topic: %s", s_topic_cmd);
     ESP_LOGI(TAG, "Status Topic: %s", s_topic_status);
     ESP_LOGI(TAG, "Log   Topic: %s", s_topic_log);
     ESP_LOGI(TAG, "Alert Topic: %s", s_topic_alert);
+    ESP_LOGI(TAG, "Group Topic: %s", s_topic_group_cmd[0] ? s_topic_group_cmd : "(none)");
+}
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+static uint16_t class_topic_alias(msg_class_t cls) {
+    switch (cls) {
+        case MSG_CLASS_STATUS: return 1;
+        case MSG_CLASS_LOG:    return 2;
+        case MSG_CLASS_ALERT:  return 3;
+        default: return 0;
+    }
+}
+#endif
+
+static void metrics_record_latency(int cls, int64_t lat_us) {
+    uint32_t ms = (lat_us > 0) ? (uint32_t)(lat_us / 1000) : 0;
+    metrics_class_t *m = &s_class_metrics[cls];
+    int b = 0;
+    while (b < METRICS_HIST_BUCKETS - 1 && ms >= s_hist_bounds_ms[b]) b++;
+    m->hist[b]++;
+    m->acked++;
+    s_class_lat_sum_ms[cls] += ms;
+    m->avg_ms = (uint32_t)(s_class_lat_sum_ms[cls] / m->acked);
+    if (ms > m->max_ms) m->max_ms = ms;
+}
+
+static void metrics_on_publish(msg_class_t cls, int msg_id, int bytes, int qos, int64_t t0_us) {
+    if (!s_metrics_lock) return;
+    xSemaphoreTake(s_metrics_lock, portMAX_DELAY);
+    metrics_class_t *m = &s_class_metrics[cls];
+    if (msg_id < 0) {
+        m->failed++;
+        xSemaphoreGive(s_metrics_lock);
+        return;
+    }
+    m->sent++;
+    m->bytes += (uint32_t)bytes;
+
+    if (qos > 0 && msg_id > 0) {
+        pending_msg_t *slot = NULL;
+        for (int i = 0; i < METRICS_PENDING_MAX; i++) {
+            pending_msg_t *p = &s_pending[i];
+            if (p->state == PENDING_ACKED_EARLY && p->msg_id == msg_id) {
+                metrics_record_latency(cls, p->t_us - t0_us);
+                p->state = PENDING_FREE;
+                xSemaphoreGive(s_metrics_lock);
+                return;
+            }
+            if (!slot && p->state == PENDING_FREE) slot = p;
+        }
+        if (slot) {
+            *slot = (pending_msg_t){ .msg_id = msg_id, .cls = (uint8_t)cls, .state = PENDING_SENT, .t_us = t0_us };
+        } else {
+            s_metrics.untracked++;
+        }
+    }
+    xSemaphoreGive(s_metrics_lock);
+}
+
+// MQTT_EVENT_PUBLISHED (事件任务)
+static void metrics_on_acked(int msg_id) {
+    if (!s_metrics_lock) return;
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(s_metrics_lock, portMAX_DELAY);
+    pending_msg_t *slot = NULL;
+    for (int i = 0; i < METRICS_PENDING_MAX; i++) {
+        pending_msg_t *p = &s_pending[i];
+        if (p->state == PENDING_SENT && p->msg_id == msg_id) {
+            metrics_record_latency(p->cls, now - p->t_us);
+            p->state = PENDING_FREE;
+            xSemaphoreGive(s_metrics_lock);
+            return;
+        }
+        if (!slot && p->state == PENDING_FREE) slot = p;
+    }
+    if (slot) {
+        *slot = (pending_msg_t){ .msg_id = msg_id, .state = PENDING_ACKED_EARLY, .t_us = now };
+    }
+    xSemaphoreGive(s_metrics_lock);
+}
+
+// MQTT_EVENT_DELETED：outbox 超时丢弃
+static void metrics_on_deleted(int msg_id) {
+    if (!s_metrics_lock) return;
+    xSemaphoreTake(s_metrics_lock, portMAX_DELAY);
+    s_metrics.expired++;
+    for (int i = 0; i < METRICS_PENDING_MAX; i++) {
+        if (s_pending[i].state != PENDING_FREE && s_pending[i].msg_id == msg_id) {
+            s_pending[i].state = PENDING_FREE;
+        }
+    }
+    xSemaphoreGive(s_metrics_lock);
+}
+
+// 重连成功：仍未确认的 QoS>0 消息会由 outbox 重发，计为重传；
+// 残留的提前确认记录已无法匹配，直接释放
+static void metrics_on_connected(void) {
+    if (!s_metrics_lock) return;
+    xSemaphoreTake(s_metrics_lock, portMAX_DELAY);
+    for (int i = 0; i < METRICS_PENDING_MAX; i++) {
+        if (s_pending[i].state == PENDING_SENT) s_metrics.retransmits++;
+        else if (s_pending[i].state == PENDING_ACKED_EARLY) s_pending[i].state = PENDING_FREE;
+    }
+    xSemaphoreGive(s_metrics_lock);
+}
+
+// 客户端销毁：outbox 随之释放，未确认的消息不会再重发，也不会再收到确认；
+// 清空跟踪表，避免旧记录在下次连接时被计为重传或与新客户端复用的 msg_id 混淆
+static void metrics_on_stopped(void) {
+    if (!s_metrics_lock) return;
+    xSemaphoreTake(s_metrics_lock, portMAX_DELAY);
+    memset(s_pending, 0, sizeof(s_pending));
+    xSemaphoreGive(s_metrics_lock);
+}
+
+static void metrics_on_error(const esp_mqtt_error_codes_t *err) {
+    if (!s_metrics_lock || !err) return;
+    xSemaphoreTake(s_metrics_lock, portMAX_DELAY);
+    if (err->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
+        s_metrics.err_tcp++;
+        s_metrics.last_sock_errno = err->esp_transport_sock_errno;
+    } else if (err->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
+        s_metrics.err_refused++;
+        s_metrics.last_refuse_code = err->connect_return_code;
+    } else {
+        s_metrics.err_other++;
+    }
+    xSemaphoreGive(s_metrics_lock);
+}
+
+void mqtt_manager_get_metrics(metrics_report_t *out) {
+    if (!out || !s_metrics_lock) return;
+    xSemaphoreTake(s_metrics_lock, portMAX_DELAY);
+    *out = s_metrics;
+    out->class_count = MSG_CLASS_MAX;
+    for (int i = 0; i < MSG_CLASS_MAX; i++) {
+        out->classes[i] = s_class_metrics[i];
+        out->classes[i].name = s_class_names[i];
+    }
+    xSemaphoreGive(s_metrics_lock);
+
+    out->timestamp = 0;
+    out->uptime_sec = (uint32_t)(esp_timer_get_time() / 1000000);
+    out->cmd_received = s_cmd_stats.received;
+    out->cmd_dropped = s_cmd_stats.dropped;
+    out->cmd_max_wait_ms = s_cmd_stats.max_wait_ms;
+    out->cmd_max_exec_ms = s_cmd_stats.max_exec_ms;
+    out->cmd_stage_count = cmd_trace_get_stats(out->cmd_stages, METRICS_CMD_STAGES);
+    tou_schedule_get_metrics(out);
+}
+
+// 统一发布入口：所有发布串行化，v5 连接下附加 Topic Alias / 过期时间 / 关联数据
+// 注意：不能在 MQTT 事件回调中调用 (事件任务持有客户端锁，会与等待 s_pub_lock 的任务互锁)
+static int publish_msg(msg_class_t cls, const char *topic, const char *payload, int qos, int retain, const char *corr_id) {
+    if (!s_client || !topic || !topic[0]) return -1;
+
+    int64_t t0_us = esp_timer_get_time();
+    int bytes = (int)strlen(topic) + (payload ? (int)strlen(payload) : 0);
+    xSemaphoreTake(s_pub_lock, portMAX_DELAY);
+    int msg_id;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (s_mqtt5_active) {
+        esp_mqtt5_publish_property_config_t prop = {0};
+        const char *pub_topic = topic;
+        uint16_t alias = s_alias_disabled ? 0 : class_topic_alias(cls);
+        if (alias) {
+            prop.topic_alias = alias;
+            // 别名映射只在本次连接内有效，QoS1 消息断线后会由 outbox 重发，
+            // 因此只有 QoS0 消息省略 Topic，QoS1 消息始终携带完整 Topic
+            if (s_alias_ready[cls] && qos == 0) pub_topic = "";
+        }
+        if (cls == MSG_CLASS_LOG) {
+            prop.message_expiry_interval = MQTT5_LOG_EXPIRY_SEC;
+        }
+        if (corr_id && corr_id[0]) {
+            prop.correlation_data = corr_id;
+            prop.correlation_data_len = (uint16_t)strlen(corr_id);
+        }
+        esp_mqtt5_client_set_publish_property(s_client, &prop);
+        msg_id = esp_mqtt_client_publish(s_client, pub_topic, payload, 0, qos, retain);
+        if (msg_id == -1 && alias && s_connected) {
+            // -1 也可能是内存不足等通用错误 (-2 为 outbox 已满，不重试)：去掉别名重试一次，
+            // 只有重试成功才说明是别名超出 Broker 的 Topic Alias Maximum
+            prop.topic_alias = 0;
+            esp_mqtt5_client_set_publish_property(s_client, &prop);
+            pub_topic = topic;
+            msg_id = esp_mqtt_client_publish(s_client, topic, payload, 0, qos, retain);
+            if (msg_id >= 0) {
+                ESP_LOGW(TAG, "Topic Alias 被拒绝，本次连接停用别名");
+                s_alias_disabled = true;
+            }
+        } else if (msg_id >= 0 && alias) {
+            s_alias_ready[cls] = true;
+        }
+        if (pub_topic[0] == '\0') bytes -= (int)strlen(topic); // 仅发送别名
+        metrics_on_publish(cls, msg_id, bytes, qos, t0_us);
+        xSemaphoreGive(s_pub_lock);
+        return msg_id;
+    }
+#else
+    (void)corr_id;
+#endif
+    msg_id = esp_mqtt_client_publish(s_client, topic, payload, 0, qos, retain);
+    metrics_on_publish(cls, msg_id, bytes, qos, t0_us);
+    xSemaphoreGive(s_pub_lock);
+    return msg_id;
+}
+
+static int ka_default_sec(int net_mode) {
+    return (net_mode == 1) ? KA_DEFAULT_PPP_SEC : KA_DEFAULT_WIFI_SEC;
+}
+
+// 计算下一档探测值，返回 0 表示已收敛无需探测
+static int ka_next_probe(void) {
+    int next = s_ka_current * 3 / 2;
+    if (next > KA_MAX_SEC) next = KA_MAX_SEC;
+    if (s_ka_rec.ceil_sec != 0 && next >= s_ka_rec.ceil_sec) {
+        next = (s_ka_current + s_ka_rec.ceil_sec) / 2; // 已知上限时二分逼近
+    }
+    return (next - s_ka_current >= KA_MIN_STEP_SEC) ? next : 0;
+}
+
+static bool url_is_tls(const char *url) {
+    return strncmp(url, "mqtts://", 8) == 0 || strncmp(url, "wss://", 6) == 0;
+}
+
+static void broker_apply(int idx) {
+    s_brokers.active = (uint8_t)idx;
+    const char *url = s_brokers.urls[idx];
+    s_mqtt_cfg.broker.address.uri = url;
+    // 已预置私有 CA 时只信任该 CA (可选 SPKI 指纹)，否则回退到完整证书包
+    s_mqtt_cfg.broker.verification.crt_bundle_attach = url_is_tls(url) ? trust_store_attach : NULL;
+    if (s_client) {
+        esp_mqtt_set_config(s_client, &s_mqtt_cfg); // 下一次重连生效
+    }
+}
+
+// 选择下一个接入点：列表中最靠前的健康 (失败次数未达阈值) 接入点
+static int broker_pick_next(void) {
+    int cur = s_brokers.active;
+    int best = -1;
+    for (int i = 0; i < s_brokers.count; i++) {
+        if (i == cur || s_ep_fails[i] >= BROKER_FAILOVER_N) continue;
+        best = i;
+        break;
+    }
+    if (best < 0) {
+        // 全部不健康：清零计数，按顺序轮询
+        memset(s_ep_fails, 0, sizeof(s_ep_fails));
+        best = (cur + 1) % s_brokers.count;
+    }
+    return best;
+}
+
+static void broker_on_connected(void) {
+    int idx = s_brokers.active;
+    uint32_t took_ms = (uint32_t)((esp_timer_get_time() - s_connect_start_us) / 1000);
+    s_ep_fails[idx] = 0;
+    ESP_LOGI(TAG, "Broker[%d] connected in %lums", idx, (unsigned long)took_ms);
+
+    // 粘滞：记住当前可用的接入点，重启后直接使用
+    broker_list_t saved;
+    if (app_storage_load_broker_list(&saved) == ESP_OK && saved.count == s_brokers.count && saved.active != idx) {
+        saved.active = (uint8_t)idx;
+        app_storage_save_broker_list(&saved);
+    }
+}
+
+// 记录错误是否发生在到达 Broker 之后 (MQTT_EVENT_ERROR 先于 MQTT_EVENT_DISCONNECTED 投递)
+static void broker_on_error(const esp_mqtt_error_codes_t *err) {
+    if (!err) return;
+    if (err->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
+        s_attempt_reached = true;
+    } else if (err->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
+        s_attempt_reached = err->esp_tls_last_esp_err != ESP_ERR_ESP_TLS_CANNOT_RESOLVE_HOSTNAME &&
+                            err->esp_tls_last_esp_err != ESP_ERR_ESP_TLS_CANNOT_CREATE_SOCKET &&
+                            err->esp_transport_sock_errno != ENETUNREACH;
+    }
+}
+
+// 连接尝试失败 (未进入 CONNECTED 即断开)
+// 只统计本地网络可用且已到达 Broker 的失败；断网、DNS 解析、本地无路由与接入点无关，不计入切换
+static void broker_on_connect_failed(void) {
+    bool reached = s_attempt_reached;
+    s_attempt_reached = false;
+    if (!s_net_ready || !reached) return;
+    int idx = s_brokers.active;
+    if (s_ep_fails[idx] < UINT8_MAX) s_ep_fails[idx]++;
+    if (s_brokers.count < 2 || s_ep_fails[idx] < BROKER_FAILOVER_N) return;
+
+    int next = broker_pick_next();
+    ESP_LOGW(TAG, "Broker[%d] %s 连续失败 %d 次，切换到 Broker[%d] %s",
+             idx, s_brokers.urls[idx], s_ep_fails[idx], next, s_brokers.urls[next]);
+    broker_apply(next);
+}
+
+// 下一次重连等待取 [BASE, hi] 内的随机值
+static void backoff_apply(uint32_t hi) {
+    if (hi > RECONNECT_CAP_MS) hi = RECONNECT_CAP_MS;
+    s_backoff_ms = RECONNECT_BASE_MS + esp_random() % (hi - RECONNECT_BASE_MS + 1);
+    s_mqtt_cfg.network.reconnect_timeout_ms = (int)s_backoff_ms;
+    if (s_client) {
+        esp_mqtt_set_config(s_client, &s_mqtt_cfg); // 下一次自动重连生效
+    }
+}
+
+static void ka_apply(int sec) {
+    s_ka_current = sec;
+    s_mqtt_cfg.session.keepalive = sec;
+    if (s_client) {
+        esp_mqtt_set_config(s_client, &s_mqtt_cfg); // 下一次 CONNECT 生效
+    }
+}
+
+// 断线时判断探测是否失败：至少空闲过一个心跳周期才断开，才认为是 NAT 回收了映射
+static void ka_on_disconnected(int64_t connected_us) {
+    if (s_ka_reconnecting) {
+        s_ka_reconnecting = false;
+        return;
+    }
+    if (!s_ka_probing || connected_us < (int64_t)s_ka_current * 1000000LL) return;
+
+    ESP_LOGW(TAG, "Keepalive %ds 探测失败，回退到 %ds", s_ka_current, s_ka_rec.good_sec);
+    s_ka_rec.ceil_sec = (uint16_t)s_ka_current;
+    s_ka_probing = false;
+    app_storage_save_keepalive(s_net_cfg.mode, &s_ka_rec);
+    ka_apply(s_ka_rec.good_sec);
+}
+
+// 后台周期检查：当前心跳已稳定则固化，并尝试放大一档
+static void ka_check_stable(void) {
+    if (!s_client || !s_connected) return;
+    int64_t up_us = esp_timer_get_time() - s_connected_since_us;
+    if (up_us < (int64_t)s_ka_current * KA_STABLE_PINGS * 1000000LL) return;
+
+    if (s_ka_probing || s_ka_rec.good_sec != s_ka_current) {
+        s_ka_probing = false;
+        s_ka_rec.good_sec = (uint16_t)s_ka_current;
+        app_storage_save_keepalive(s_net_cfg.mode, &s_ka_rec);
+        ESP_LOGI(TAG, "Keepalive %ds 已验证稳定 (net=%s)", s_ka_current, s_net_cfg.mode == 1 ? "4G" : "WIFI");
+    }
+
+    int next = ka_next_probe();
+    if (next == 0) return;
+
+    ESP_LOGI(TAG, "Keepalive 探测: %ds -> %ds，主动重连", s_ka_current, next);
+    ka_apply(next);
+    s_ka_probing = true;
+    s_ka_reconnecting = true;
+    esp_mqtt_client_disconnect(s_client);
+    esp_mqtt_client_reconnect(s_client);
+}
+
+static void send_receipt(const server_cmd_t *cmd, int result, const cmd_trace_result_t *lat) {
+    cmd_receipt_t receipt = {
+        .timestamp = 0,
+        .method = cmd->method,
+        .result = result,
+        .has_cloud = lat->has_cloud,
+        .cloud_ms = lat->cloud_ms,
+    };
+    strncpy(receipt.cmd_id, cmd->cmd_id, sizeof(receipt.cmd_id) - 1);
+    if (result != CMD_RESULT_OK) strncpy(receipt.reason, cmd->reason, sizeof(receipt.reason) - 1);
+    mqtt_manager_publish_receipt(&receipt);
+}
+
+// 解析后的指令入队 (非阻塞)，队列满时直接回执 BUSY，由云端决定是否重发
+static void cmd_enqueue(const server_cmd_t *cmd, int64_t rx_us) {
+    cmd_item_t item = {
+        .cmd = *cmd,
+        .rx_us = rx_us,
+        .enqueue_us = esp_timer_get_time(),
+    };
+    if (!s_cmd_queue || xQueueSend(s_cmd_queue, &item, 0) != pdTRUE) {
+        s_cmd_stats.dropped++;
+        ESP_LOGW(TAG, "CMD queue full, reject method=%d cmdId=%s (dropped=%lu)",
+                 cmd->method, cmd->cmd_id, (unsigned long)s_cmd_stats.dropped);
+        if (cmd->broadcast) return; // 批量指令不回执 BUSY，避免全网同时回执
+        // 事件任务中不直接发布，交给后台任务回执
+        cmd_receipt_t receipt = {
+            .timestamp = 0,
+            .method = cmd->method,
+            .result = CMD_RESULT_BUSY,
+        };
+        strncpy(receipt.cmd_id, cmd->cmd_id, sizeof(receipt.cmd_id) - 1);
+        if (s_receipt_queue && xQueueSend(s_receipt_queue, &receipt, 0) == pdTRUE) {
+            xTaskNotifyGive(s_mgr_task);
+        }
+        return;
+    }
+    s_cmd_stats.received++;
+    uint32_t depth = (uint32_t)uxQueueMessagesWaiting(s_cmd_queue);
+    if (depth > s_cmd_stats.max_depth) s_cmd_stats.max_depth = depth;
+}
+
+// 白名单：只允许对所有设备含义相同的方法；套餐/账本确认/接入点/规则/计划/升级等
+// 针对单台设备的指令只接受单播 Topic，避免一条广播改写全网数据
+static bool broadcast_allowed(int method) {
+    switch (method) {
+        case CMD_METHOD_POWER:
+        case CMD_METHOD_SET_WASH:
+        case CMD_METHOD_QUERY_STATUS:
+        case CMD_METHOD_SET_CONFIG:
+        case CMD_METHOD_GET_CONFIG:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// 全量/分组指令：拒绝白名单以外的方法，其余按哈希延迟后入队 (事件任务)
+static void cmd_defer(server_cmd_t *cmd) {
+    if (!broadcast_allowed(cmd->method)) {
+        ESP_LOGW(TAG, "Broadcast method=%d not allowed, ignored (cmdId=%s)", cmd->method, cmd->cmd_id);
+        return;
+    }
+    int window_sec = (cmd->param.jitter_sec > 0) ? cmd->param.jitter_sec : GROUP_JITTER_DEFAULT_SEC;
+    if (window_sec > GROUP_JITTER_MAX_SEC) window_sec = GROUP_JITTER_MAX_SEC;
+    uint32_t delay_ms = s_dev_hash % ((uint32_t)window_sec * 1000);
+
+    xSemaphoreTake(s_defer_lock, portMAX_DELAY);
+    for (int i = 0; i < DEFER_SLOTS; i++) {
+        if (!s_deferred[i].used) {
+            s_deferred[i].used = true;
+            s_deferred[i].cmd = *cmd;
+            s_deferred[i].due_us = esp_timer_get_time() + (int64_t)delay_ms * 1000;
+            xSemaphoreGive(s_defer_lock);
+            ESP_LOGI(TAG, "Broadcast method=%d deferred %lums", cmd->method, (unsigned long)delay_ms);
+            return;
+        }
+    }
+    xSemaphoreGive(s_defer_lock);
+    // 批量指令不回执 BUSY，避免全网同时回执
+    s_cmd_stats.dropped++;
+    ESP_LOGW(TAG, "Deferred slots full, broadcast method=%d dropped", cmd->method);
+}
+
+// 后台任务周期调用：到期的延迟指令放入执行队列
+static void cmd_release_deferred(void) {
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(s_defer_lock, portMAX_DELAY);
+    for (int i = 0; i < DEFER_SLOTS; i++) {
+        if (s_deferred[i].used && now >= s_deferred[i].due_us) {
+            s_deferred[i].used = false;
+            cmd_enqueue(&s_deferred[i].cmd, now);
+        }
+    }
+    xSemaphoreGive(s_defer_lock);
+}
+
+// 指令执行任务
+static void cmd_worker_task(void *pvParameters) {
+    cmd_item_t item;
+    while (1) {
+        if (xQueueReceive(s_cmd_queue, &item, portMAX_DELAY) != pdTRUE) continue;
+
+        int64_t start_us = esp_timer_get_time();
+        uint32_t wait_ms = (uint32_t)((start_us - item.enqueue_us) / 1000);
+        // 延迟指令的收到时刻已替换为放行时刻，不计算云端到设备的差值
+        cmd_trace_begin(item.rx_us, item.enqueue_us, item.cmd.broadcast ? 0 : item.cmd.timestamp);
+        esp_err_t ret = ESP_ERR_INVALID_ARG;
+        if (item.cmd.reason[0]) {
+            ESP_LOGW(TAG, "CMD method=%d rejected: %s", item.cmd.method, item.cmd.reason);
+        } else {
+            ret = app_logic_handle_cmd(&item.cmd);
+        }
+        uint32_t exec_ms = (uint32_t)((esp_timer_get_time() - start_us) / 1000);
+        cmd_trace_result_t lat;
+        cmd_trace_end(&lat); // 控制类指令的执行延迟由状态机打点异步计入，随下一次发布指标上报
+
+        s_cmd_done++;
+        s_cmd_wait_sum_ms += wait_ms;
+        s_cmd_stats.last_wait_ms = wait_ms;
+        s_cmd_stats.avg_wait_ms = (uint32_t)(s_cmd_wait_sum_ms / s_cmd_done);
+        if (wait_ms > s_cmd_stats.max_wait_ms) s_cmd_stats.max_wait_ms = wait_ms;
+        if (exec_ms > s_cmd_stats.max_exec_ms) s_cmd_stats.max_exec_ms = exec_ms;
+        ESP_LOGI(TAG, "CMD method=%d done: wait %lums, exec %lums",
+                 item.cmd.method, (unsigned long)wait_ms, (unsigned long)exec_ms);
+
+        int result = CMD_RESULT_FAILED;
+        if (ret == ESP_OK) result = CMD_RESULT_OK;
+        else if (ret == ESP_ERR_INVALID_VERSION) result = CMD_RESULT_STALE;
+        send_receipt(&item.cmd, result, &lat);
+    }
+}
+
+void mqtt_manager_get_cmd_stats(mqtt_cmd_stats_t *out) {
+    if (!out) return;
+    *out = s_cmd_stats;
+}
+
+static void fill_net_mode(char *out, size_t len) {
+    strncpy(out, (s_net_cfg.mode == 1) ? "4G" : "WIFI", len - 1);
+    out[len - 1] = '\0';
+}
+
+static void publish_presence(bool online) {
+    device_status_t status;
+    app_storage_load_status(&status);
+    presence_report_t presence = {
+        .plan_ver = app_storage_plan_is_valid() ? status.plan_ver : 0, // 未确认的缓存套餐请云端补发
+        .broker = s_brokers.active,
+        .online = online,
+        .fw_version = FW_VERSION,
+        .uptime_sec = (uint32_t)(esp_timer_get_time() / 1000000),
+    };
+    fill_net_mode(presence.net_mode, sizeof(presence.net_mode));
+
+    char *json = protocol_pack_presence(&presence);
+    if (!json) return;
+    publish_msg(MSG_CLASS_PRESENCE, s_topic_online, json, 1, 1, NULL);
+    free(json);
+}
+
+// 连接建立后的发布 (上线消息、Init 包)，由后台任务执行
+static void publish_on_connect(void) {
+    publish_presence(true);
+
+    if (!s_waiting_for_plan) return;
+    ESP_LOGI(TAG, "Pending Init flag is 1, sending Init packet...");
+
+    init_data_t init_d = {
+        .fw_version = FW_VERSION,
+        .hw_version = "1.0",
+        .net_mode = {0}
+    };
+    fill_net_mode(init_d.net_mode, sizeof(init_d.net_mode));
+    protocol_get_mac_str(init_d.mac_str, sizeof(init_d.mac_str));
+
+    char *json = protocol_pack_init(&init_d);
+    if (json) {
+        ESP_LOGI(TAG, "Sending Init: %s", json);
+        s_init_msg_id = publish_msg(MSG_CLASS_INIT, s_topic_init, json, 2, 0, NULL);
+        free(json);
+    }
+}
+
+static void publish_metrics(void) {
+    metrics_report_t *report = malloc(sizeof(metrics_report_t)); // 结构体较大，不占用任务栈
+    if (!report) return;
+    mqtt_manager_get_metrics(report);
+    char *json = protocol_pack_metrics(report);
+    free(report);
+    if (!json) return;
+    publish_msg(MSG_CLASS_METRICS, s_topic_metrics, json, 0, 0, NULL);
+    free(json);
+}
+
+// MQTT 后台维护任务 (1 秒周期，事件回调可通过任务通知立即唤醒)
+static void mqtt_manager_task(void *pvParameters) {
+    // 指标上报相位按 DeviceID 哈希错开 (s_dev_hash 在首次连接前可能未生成，直接取一次)
+    int64_t last_metrics_us = esp_timer_get_time() -
+        (int64_t)(protocol_device_hash() % METRICS_REPORT_INTERVAL_S) * 1000000LL;
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        if (s_on_connect_pending && s_connected) {
+            s_on_connect_pending = false;
+            publish_on_connect();
+        }
+        cmd_receipt_t receipt;
+        while (s_receipt_queue && xQueueReceive(s_receipt_queue, &receipt, 0) == pdTRUE) {
+            mqtt_manager_publish_receipt(&receipt);
+        }
+        cmd_release_deferred();
+        ka_check_stable();
+
+        int64_t now = esp_timer_get_time();
+        if (s_connected && now - last_metrics_us >= (int64_t)METRICS_REPORT_INTERVAL_S * 1000000LL) {
+            last_metrics_us = now;
+            publish_metrics();
+        }
+        xSemaphoreGive(s_lock);
+
+        // 转交的 QoS1 发布 (不持 s_lock，同步函数内部自行加锁)
+        mqtt_sync_fn_t fn;
+        while (s_sync_queue && xQueueReceive(s_sync_queue, &fn, 0) == pdTRUE) {
+            fn();
+        }
+        session_report_t session;
+        while (s_session_queue && xQueueReceive(s_session_queue, &session, 0) == pdTRUE) {
+            mqtt_manager_publish_session(&session);
+        }
+    }
+}
+
+static bool topic_equals(const esp_mqtt_event_t *event, const char *topic) {
+    size_t len = strlen(topic);
+    return len > 0 && event->topic_len == (int)len && strncmp(event->topic, topic, len) == 0;
 }
 
 // MQTT 事件处理
@@ -55,48 +833,49 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     
     switch ((esp_mqtt_event_id_t)event_id) {
     case MQTT_EVENT_CONNECTED:
-        ESP_LOGI(TAG, "MQTT Connected");
-        generate_topics();
+        ESP_LOGI(TAG, "MQTT Connected (keepalive %ds%s)", s_ka_current, s_ka_probing ? ", probing" : "");
+        s_connected = true;
+        s_connected_since_us = esp_timer_get_time();
+        broker_on_connected();
+        backoff_apply(RECONNECT_FIRST_MAX_MS);
+        metrics_on_connected();
         
         // 如果是 OTA 更新后的第一次成功连接，确认固件有效，取消回滚！
         esp_ota_mark_app_valid_cancel_rollback();
         ESP_LOGI(TAG, "APP ROLLBACK 取消，当前固件标记为稳定运行版本");
 
 
-        // 订阅指令
+        // 订阅指令 (单播 + 全量 + 分组)
         esp_mqtt_client_subscribe(s_client, s_topic_cmd, 1);
+        esp_mqtt_client_subscribe(s_client, s_topic_all_cmd, 1);
+        if (s_topic_group_cmd[0]) {
+            esp_mqtt_client_subscribe(s_client, s_topic_group_cmd, 1);
+        }
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+        s_mqtt5_active = (s_mqtt_cfg.session.protocol_ver == MQTT_PROTOCOL_V_5);
+        if (s_mqtt5_active) s_mqtt5_ever_connected = true;
+        s_mqtt5_connect_fails = 0;
+        memset(s_alias_ready, 0, sizeof(s_alias_ready));
+        s_alias_disabled = false;
+        ESP_LOGI(TAG, "MQTT protocol: %s", s_mqtt5_active ? "5.0" : "3.1.1");
+#endif
         
         if (app_storage_get_pending_init() == 1) {
-            ESP_LOGI(TAG, "Pending Init flag is 1, sending Init packet...");
-
-            // ... (这里是原有的构建 init_d 代码) ...
-            net_config_t cfg;
-            if (app_storage_load_net_config(&cfg) != ESP_OK) { cfg.mode = 0; }
-            init_data_t init_d = {
-                .fw_version = "1.0.0",
-                .hw_version = "1.0",
-                .net_mode = {0}
-            };
-            if (cfg.mode == 1) strncpy(init_d.net_mode, "4G", sizeof(init_d.net_mode) - 1);
-            else strncpy(init_d.net_mode, "WIFI", sizeof(init_d.net_mode) - 1);
-            protocol_get_mac_str(init_d.mac_str, sizeof(init_d.mac_str));
-
-            char *json = protocol_pack_init(&init_d);
-            if (json) {
-                ESP_LOGI(TAG, "Sending Init: %s", json);
-                s_init_msg_id = esp_mqtt_client_publish(s_client, s_topic_init, json, 0, 2, 0);
-                free(json);
-                s_waiting_for_plan = true;
-            }
+            // Init 包由后台任务发送 (事件任务内不发布)
+            s_waiting_for_plan = true;
         } else {
             ESP_LOGI(TAG, "Pending Init flag is 0. Skip sending Init.");
             // 如果不需要发 Init，也不用等待套餐下发，直接可以开始工作（或者主动查一下状态）
             // s_waiting_for_plan = false; 
         }
+        s_on_connect_pending = true;
+        if (s_mgr_task) xTaskNotifyGive(s_mgr_task);
         app_events_post_mqtt_connected();
         break;
         
     case MQTT_EVENT_PUBLISHED:
+        metrics_on_acked(event->msg_id);
         if (event->msg_id == s_init_msg_id) {
             ESP_LOGI(TAG, "Init Published. Waiting for Cloud CMD (Plan Info)...");
             // 发送成功，清除标志位 (下次重启就不发了)
@@ -106,8 +885,15 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         }
         break;
 
-    case MQTT_EVENT_DATA:
-        if (strncmp(event->topic, s_topic_cmd, event->topic_len) == 0) {
+    case MQTT_EVENT_DATA: {
+        int64_t rx_us = esp_timer_get_time();
+        if (s_metrics_lock) {
+            xSemaphoreTake(s_metrics_lock, portMAX_DELAY);
+            s_metrics.rx_msgs++;
+            s_metrics.rx_bytes += (uint32_t)(event->topic_len + event->data_len);
+            xSemaphoreGive(s_metrics_lock);
+        }
+        if (topic_equals(event, s_topic_cmd)) {
             // 处理指令
             server_cmd_t cmd;
             if (protocol_parse_cmd(event->data, event->data_len, &cmd) == ESP_OK) {
@@ -117,20 +903,69 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
                     s_waiting_for_plan = false;
                 }
 
-                // 转发业务逻辑
-                extern void app_logic_handle_cmd(server_cmd_t *cmd);
-                app_logic_handle_cmd(&cmd);
+                // 转发业务逻辑 (交给指令任务执行)
+                cmd_enqueue(&cmd, rx_us);
+            }
+        } else if (topic_equals(event, s_topic_all_cmd) || topic_equals(event, s_topic_group_cmd)) {
+            server_cmd_t cmd;
+            if (protocol_parse_cmd(event->data, event->data_len, &cmd) == ESP_OK) {
+                cmd.broadcast = true;
+                cmd_defer(&cmd);
             }
         }
         break;
+    }
     case MQTT_EVENT_ERROR:
         ESP_LOGE(TAG, "MQTT Error");
+        metrics_on_error(event->error_handle);
+        if (!s_connected) broker_on_error(event->error_handle);
         // 可选：如果断开，可通过独立钩子通知上层状态
+#ifdef CONFIG_MQTT_PROTOCOL_5
+        // v5 协商失败回退 3.1.1：Broker 明确拒绝协议版本，或从未以 v5 连上且 CONNACK 连续拒绝
+        // (只统计 Broker 的 CONNACK 拒绝；断网、DNS、TLS 等传输层失败与协议版本无关，不计数)
+        if (s_mqtt_cfg.session.protocol_ver == MQTT_PROTOCOL_V_5 && !s_mqtt5_ever_connected && event->error_handle &&
+            event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
+            int rc = event->error_handle->connect_return_code;
+            bool refused = (rc == MQTT_CONNECTION_REFUSE_PROTOCOL || rc == 0x84); // 0x84: v5 Unsupported Protocol Version
+            if (refused || ++s_mqtt5_connect_fails >= MQTT5_FALLBACK_FAILS) {
+                ESP_LOGW(TAG, "Broker 不支持 MQTT 5，回退到 3.1.1");
+                s_mqtt5_unsupported = true;
+                s_mqtt_cfg.session.protocol_ver = MQTT_PROTOCOL_V_3_1_1;
+                esp_mqtt_set_config(s_client, &s_mqtt_cfg); // 下次重连生效
+            }
+        }
+#endif
         break;
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGW(TAG, "MQTT Disconnected");
+        if (s_metrics_lock) {
+            xSemaphoreTake(s_metrics_lock, portMAX_DELAY);
+            s_metrics.disconnects++;
+            xSemaphoreGive(s_metrics_lock);
+        }
+        if (s_connected) {
+            s_connected = false;
+            ka_on_disconnected(esp_timer_get_time() - s_connected_since_us);
+            backoff_apply(RECONNECT_FIRST_MAX_MS); // 第一次重连：全网在窗口内均匀分散
+        } else {
+            int prev = s_brokers.active;
+            broker_on_connect_failed();
+            // 切换接入点后尽快尝试，否则在上次等待的基础上退避
+            backoff_apply((s_brokers.active != prev) ? RECONNECT_BASE_MS * 3 : s_backoff_ms * 3);
+        }
+        ESP_LOGI(TAG, "Next reconnect in %lums", (unsigned long)s_backoff_ms);
         app_events_post_mqtt_disconnected();
         break;
+
+    case MQTT_EVENT_BEFORE_CONNECT:
+        s_connect_start_us = esp_timer_get_time();
+        s_attempt_reached = false;
+        break;
+
+    case MQTT_EVENT_DELETED:
+        ESP_LOGW(TAG, "Outbox 消息超时丢弃 msg_id=%d", event->msg_id);
+        metrics_on_deleted(event->msg_id);
+        break;
         
     default: break;
     }
@@ -141,7 +976,9 @@ esp_err_t mqtt_manager_publish_status(const status_report_t *data) {
     if (!s_client) return ESP_FAIL;
     char *json = protocol_pack_status(data);
     if (!json) return ESP_FAIL;
-    int msg_id = esp_mqtt_client_publish(s_client, s_topic_status, json, 0, 1, 0);
+    // 只保留完整上报，增量上报不覆盖保留消息
+    bool full = (data->sections == 0 || data->sections == STATUS_SECTION_ALL);
+    int msg_id = publish_msg(MSG_CLASS_STATUS, s_topic_status, json, 1, full ? STATUS_RETAIN : 0, NULL);
     free(json);
     return (msg_id >= 0) ? ESP_OK : ESP_FAIL;
 }
@@ -150,7 +987,7 @@ esp_err_t mqtt_manager_publish_log(const log_report_t *data) {
     if (!s_client) return ESP_FAIL;
     char *json = protocol_pack_log(data);
     if (!json) return ESP_FAIL;
-    int msg_id = esp_mqtt_client_publish(s_client, s_topic_log, json, 0, 0, 0);
+    int msg_id = publish_msg(MSG_CLASS_LOG, s_topic_log, json, 0, 0, NULL);
     free(json);
     return (msg_id >= 0) ? ESP_OK : ESP_FAIL;
 }
@@ -159,10 +996,83 @@ esp_err_t mqtt_manager_publish_alert(const alert_report_t *data) {
     if (!s_client) return ESP_FAIL;
     char *json = protocol_pack_alert(data);
     if (!json) return ESP_FAIL;
-    int msg_id = esp_mqtt_client_publish(s_client, s_topic_alert, json, 0, 1, 0);
+    int msg_id = publish_msg(MSG_CLASS_ALERT, s_topic_alert, json, 1, 0, NULL);
+    free(json);
+    return (msg_id >= 0) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t mqtt_manager_publish_alert_batch(const alert_batch_t *data) {
+    if (!s_client || !s_connected) return ESP_FAIL;
+    char *json = protocol_pack_alert_batch(data);
+    if (!json) return ESP_FAIL;
+    int msg_id = publish_msg(MSG_CLASS_ALERT, s_topic_alert, json, 1, 0, NULL);
     free(json);
     return (msg_id >= 0) ? ESP_OK : ESP_FAIL;
 }
+
+esp_err_t mqtt_manager_publish_receipt(const cmd_receipt_t *data) {
+    if (!s_client) return ESP_FAIL;
+    char *json = protocol_pack_receipt(data);
+    if (!json) return ESP_FAIL;
+    // v5 下 cmdId 同时作为 Correlation Data，云端无需解析负载即可关联请求
+    int msg_id = publish_msg(MSG_CLASS_RECEIPT, s_topic_receipt, json, 1, 0, data->cmd_id);
+    free(json);
+    return (msg_id >= 0) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t mqtt_manager_publish_ledger(const ledger_report_t *data) {
+    if (!s_client || !s_connected) return ESP_FAIL;
+    char *json = protocol_pack_ledger(data);
+    if (!json) return ESP_FAIL;
+    int msg_id = publish_msg(MSG_CLASS_LEDGER, s_topic_ledger, json, 1, 0, NULL);
+    free(json);
+    return (msg_id >= 0) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t mqtt_manager_publish_session(const session_report_t *data) {
+    if (!s_client) return ESP_FAIL;
+    char *json = protocol_pack_session(data);
+    if (!json) return ESP_FAIL;
+    int msg_id = publish_msg(MSG_CLASS_SESSION, s_topic_session, json, 1, 0, NULL);
+    free(json);
+    return (msg_id >= 0) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t mqtt_manager_queue_session(const session_report_t *data) {
+    if (!data || !s_session_queue) return ESP_ERR_INVALID_STATE;
+    if (xQueueSend(s_session_queue, data, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Session queue full, record dropped");
+        return ESP_ERR_NO_MEM;
+    }
+    xTaskNotifyGive(s_mgr_task);
+    return ESP_OK;
+}
+
+esp_err_t mqtt_manager_request_sync(mqtt_sync_fn_t fn) {
+    if (!fn || !s_sync_queue) return ESP_ERR_INVALID_STATE;
+    if (xQueueSend(s_sync_queue, &fn, 0) != pdTRUE) return ESP_ERR_NO_MEM;
+    xTaskNotifyGive(s_mgr_task);
+    return ESP_OK;
+}
+
+esp_err_t mqtt_manager_publish_usage(const usage_report_t *data) {
+    if (!s_client || !s_connected) return ESP_FAIL;
+    char *json = protocol_pack_usage(data);
+    if (!json) return ESP_FAIL;
+    int msg_id = publish_msg(MSG_CLASS_USAGE, s_topic_usage, json, 1, 0, data->cmd_id);
+    free(json);
+    return (msg_id >= 0) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t mqtt_manager_publish_config(const config_report_t *data) {
+    if (!s_client || !s_connected) return ESP_FAIL;
+    char *json = protocol_pack_config(data);
+    if (!json) return ESP_FAIL;
+    int msg_id = publish_msg(MSG_CLASS_CONFIG, s_topic_config, json, 1, 0, data->cmd_id);
+    free(json);
+    return (msg_id >= 0) ? ESP_OK : ESP_FAIL;
+}
+
 esp_err_t mqtt_manager_publish(const char *topic, const char *payload) {
     if (!s_client) {
         ESP_LOGE(TAG, "MQTT not connected, cannot publish raw data");
@@ -177,11 +1087,114 @@ esp_err_t mqtt_manager_publish(const char *topic, const char *payload) {
          return ESP_FAIL;
     }
 
-    int msg_id = esp_mqtt_client_publish(s_client, target_topic, payload, 0, 1, 0);
+    int msg_id = publish_msg(MSG_CLASS_RAW, target_topic, payload, 1, 0, NULL);
     return (msg_id >= 0) ? ESP_OK : ESP_FAIL;
 }
 
+void mqtt_manager_set_group(const char *group) {
+    if (!s_lock || !group) return;
+    if (!protocol_group_is_valid(group)) {
+        ESP_LOGE(TAG, "Invalid group name, subscription unchanged");
+        return;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_client && s_connected && s_topic_group_cmd[0]) {
+        esp_mqtt_client_unsubscribe(s_client, s_topic_group_cmd);
+    }
+    s_topic_group_cmd[0] = '\0';
+    if (group[0]) {
+        snprintf(s_topic_group_cmd, sizeof(s_topic_group_cmd), "%s/group/%s/cmd", PRODUCT_ID, group);
+        if (s_client && s_connected) {
+            esp_mqtt_client_subscribe(s_client, s_topic_group_cmd, 1);
+        }
+    }
+    ESP_LOGI(TAG, "Group Topic: %s", s_topic_group_cmd[0] ? s_topic_group_cmd : "(none)");
+    xSemaphoreGive(s_lock);
+}
+
+// 列表首个接入点同步写回配网配置 (full_url 及 host/port 与列表第一个保持一致，持锁调用)
+static esp_err_t net_config_set_primary(const char *url) {
+    net_config_t cfg;
+    if (app_storage_load_net_config(&cfg) != ESP_OK) return ESP_OK; // 未配网，启动时由列表提供
+    if (strcmp(cfg.full_url, url) == 0) return ESP_OK;
+
+    strncpy(cfg.full_url, url, sizeof(cfg.full_url) - 1);
+    cfg.full_url[sizeof(cfg.full_url) - 1] = '\0';
+    char host[sizeof(cfg.mqtt_host)] = {0};
+    int port = 0;
+    const char *p = strstr(url, "://");
+    int n = p ? sscanf(p + 3, "%63[^:/]:%d", host, &port) : 0;
+    if (n >= 1) {
+        memcpy(cfg.mqtt_host, host, sizeof(cfg.mqtt_host));
+        cfg.mqtt_port = (n == 2) ? port : (url_is_tls(url) ? 8883 : 1883);
+    }
+    esp_err_t err = app_storage_save_net_config(&cfg);
+    if (err == ESP_OK) s_net_cfg = cfg;
+    return err;
+}
+
+esp_err_t mqtt_manager_set_brokers(const char urls[][BROKER_URL_LEN], int count) {
+    if (!urls || count <= 0 || count > BROKER_MAX) return ESP_ERR_INVALID_ARG;
+    broker_list_t list = { .count = (uint8_t)count };
+    for (int i = 0; i < count; i++) {
+        if (!strstr(urls[i], "://")) return ESP_ERR_INVALID_ARG;
+        strncpy(list.urls[i], urls[i], BROKER_URL_LEN - 1);
+    }
+
+    // 当前接入点仍在新列表中则保持连接，只更新序号
+    bool keep = false;
+    if (s_lock) xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_client) {
+        const char *cur = s_brokers.urls[s_brokers.active];
+        for (int i = 0; i < count; i++) {
+            if (strcmp(list.urls[i], cur) == 0) {
+                list.active = (uint8_t)i;
+                keep = true;
+                break;
+            }
+        }
+    }
+    esp_err_t err = app_storage_save_broker_list(&list);
+    if (err == ESP_OK) {
+        err = net_config_set_primary(list.urls[0]);
+    }
+    if (err == ESP_OK && keep) {
+        s_brokers = list;
+        memset(s_ep_fails, 0, sizeof(s_ep_fails));
+        broker_apply(list.active); // 字符串缓冲区已替换，重新指向
+    }
+    if (s_lock) xSemaphoreGive(s_lock);
+
+    ESP_LOGI(TAG, "Broker list updated: %d endpoints, %s", count, keep ? "keep current" : "reconnect");
+    if (err == ESP_OK && !keep) {
+        app_events_post_mqtt_config_updated(); // 状态机重启 MQTT，使用新列表
+    }
+    return err;
+}
+
+int mqtt_manager_get_keepalive(void) {
+    return s_ka_current;
+}
+
+static void on_net_event(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+    s_net_ready = (event_id == APP_EVENT_NET_READY);
+}
+
 void mqtt_manager_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    s_pub_lock = xSemaphoreCreateMutex();
+    s_metrics_lock = xSemaphoreCreateMutex();
+    s_defer_lock = xSemaphoreCreateMutex();
+    s_cmd_queue = xQueueCreate(CMD_QUEUE_LEN, sizeof(cmd_item_t));
+    s_receipt_queue = xQueueCreate(4, sizeof(cmd_receipt_t));
+    s_sync_queue = xQueueCreate(4, sizeof(mqtt_sync_fn_t));
+    s_session_queue = xQueueCreate(4, sizeof(session_report_t));
+    cmd_trace_init();
+    xTaskCreate(mqtt_manager_task, "mqtt_mgr", 4096, NULL, 4, &s_mgr_task);
+    // 优先级低于 esp-mqtt 任务 (5)，执行指令时不影响收发
+    xTaskCreate(cmd_worker_task, "mqtt_cmd", 4096, NULL, 4, NULL);
+    esp_event_handler_register(APP_EVENTS, APP_EVENT_NET_READY, on_net_event, NULL);
+    esp_event_handler_register(APP_EVENTS, APP_EVENT_NET_LOST, on_net_event, NULL);
     ESP_LOGI(TAG, "MQTT Manager 已初始化 (由状态机触发启动/停止)");
 }
 
@@ -190,31 +1203,84 @@ void mqtt_manager_start(void) {
         mqtt_manager_stop(); // 如果之前有连接，先停止
     }
 
-    net_config_t cfg;
-    if (app_storage_load_net_config(&cfg) != ESP_OK) {
+    if (!s_lock) {
+        ESP_LOGE(TAG, "MQTT Manager not initialized");
+        return;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (app_storage_load_net_config(&s_net_cfg) != ESP_OK) {
         ESP_LOGE(TAG, "No MQTT Config found");
+        xSemaphoreGive(s_lock);
         return;
     }
 
-    esp_mqtt_client_config_t mqtt_cfg = {
-        .broker.address.uri = cfg.full_url, // mqtt://ip:port
-        .broker.verification.crt_bundle_attach = (strncmp(cfg.full_url, "mqtts://", 8) == 0 || strncmp(cfg.full_url, "wss://", 6) == 0) ? esp_crt_bundle_attach : NULL,
-        .credentials.username = cfg.username,
-        .credentials.authentication.password = cfg.password_mqtt,
+    // 从上次记住的可用心跳起步 (按联网方式区分)
+    if (app_storage_load_keepalive(s_net_cfg.mode, &s_ka_rec) != ESP_OK || s_ka_rec.good_sec == 0) {
+        s_ka_rec.good_sec = (uint16_t)ka_default_sec(s_net_cfg.mode);
+        s_ka_rec.ceil_sec = 0;
+    }
+    s_ka_current = s_ka_rec.good_sec;
+    s_ka_probing = false;
+    s_ka_reconnecting = false;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    s_mqtt5_active = false;
+    s_mqtt5_connect_fails = 0;
+#endif
+
+    // Topic 在连接前生成 (遗嘱 Topic 属于连接参数)
+    generate_topics();
+    s_backoff_ms = RECONNECT_BASE_MS + esp_random() % (RECONNECT_FIRST_MAX_MS - RECONNECT_BASE_MS + 1);
+
+    // 接入点列表：未下发列表时只有配网写入的 full_url
+    if (app_storage_load_broker_list(&s_brokers) != ESP_OK || s_brokers.count == 0) {
+        memset(&s_brokers, 0, sizeof(s_brokers));
+        strncpy(s_brokers.urls[0], s_net_cfg.full_url, BROKER_URL_LEN - 1);
+        s_brokers.count = 1;
+    }
+    memset(s_ep_fails, 0, sizeof(s_ep_fails));
+
+    const char *url = s_brokers.urls[s_brokers.active];
+    s_mqtt_cfg = (esp_mqtt_client_config_t){
+        .broker.address.uri = url, // mqtt://ip:port
+        // 已预置私有 CA 时只信任该 CA (可选 SPKI 指纹)，否则回退到完整证书包
+        .broker.verification.crt_bundle_attach = url_is_tls(url) ? trust_store_attach : NULL,
+        .credentials.username = s_net_cfg.username,
+        .credentials.authentication.password = s_net_cfg.password_mqtt,
+        .session.keepalive = s_ka_current,
+        .network.reconnect_timeout_ms = (int)s_backoff_ms,
+        .session.last_will = {
+            .topic = s_topic_online,
+            .msg = LWT_PAYLOAD,
+            .qos = 1,
+            .retain = 1,
+        },
+#ifdef CONFIG_MQTT_PROTOCOL_5
+        .session.protocol_ver = s_mqtt5_unsupported ? MQTT_PROTOCOL_V_3_1_1 : MQTT_PROTOCOL_V_5,
+#endif
         // 如果需要客户端证书，在此处添加
     };
 
-    ESP_LOGI(TAG, "Connecting MQTT: %s, User: %s", cfg.full_url, cfg.username);
+    ESP_LOGI(TAG, "Connecting MQTT: %s (broker %d/%d), User: %s, CA: %s, Keepalive: %ds", url,
+             s_brokers.active + 1, s_brokers.count, s_net_cfg.username,
+             trust_store_has_ca() ? "pinned" : "bundle", s_ka_current);
 
-    s_client = esp_mqtt_client_init(&mqtt_cfg);
+    s_client = esp_mqtt_client_init(&s_mqtt_cfg);
     esp_mqtt_client_register_event(s_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
     esp_mqtt_client_start(s_client);
+    xSemaphoreGive(s_lock);
 }
 
 void mqtt_manager_stop(void) {
+    if (!s_lock) return;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
     if (s_client) {
+        // 主动断开时 Broker 不会发布遗嘱，自行发布离线状态
+        if (s_connected) publish_presence(false);
         esp_mqtt_client_stop(s_client);
         esp_mqtt_client_destroy(s_client);
         s_client = NULL;
+        metrics_on_stopped();
     }
+    s_connected = false;
+    xSemaphoreGive(s_lock);
 }
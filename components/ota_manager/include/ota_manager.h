@@ -0,0 +1,30 @@
+#pragma once
+#include "esp_err.h"
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief 注册断点续传 (连上 MQTT 时继续未完成的下载)，在 app_storage_init 与默认事件循环创建之后调用
+ */
+esp_err_t ota_manager_init(void);
+
+/**
+ * @brief 请求升级：后台限速下载并写入备用分区，下载完成后等到水机空闲 (水满待机、
+ * 无待执行冲洗) 再落盘计量数据并重启；等待超过 24 小时后只要不在制水/冲洗就重启
+ * 已下载完成、等待重启时，新的地址替换暂存的固件 (同一地址视为重复)
+ * @param url 固件地址，必须为 https (证书经 trust_store 校验)
+ * @return 非 https 地址返回 ESP_ERR_INVALID_ARG；正在下载时返回 ESP_ERR_INVALID_STATE
+ */
+esp_err_t ota_manager_request(const char *url);
+
+/**
+ * @brief 是否有升级在进行 (下载中或等待空闲重启)
+ */
+bool ota_manager_is_busy(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,294 @@
+// ota_manager.c 固件升级调度
+// 下载任务优先级低于制水看门狗与 MQTT，分块下载并按平均速率限速 (制水期间再减半)；
+// 下载断点定期落盘，断网或重启后以 Range 请求从断点续传；
+// 镜像写完后不立即重启，等水机连续空闲一段时间再重启，避免切断制水会话
+// 断线、忽略 Range 等场景的台架测试见 tools/README.md (tools/ota_test_server.py)
+#include "ota_manager.h"
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_https_ota.h"
+#include "esp_ota_ops.h"
+#include "esp_event.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "trust_store.h"
+#include "app_storage.h"
+#include "app_events.h"
+#include "app_fsm.h"
+#include "metering.h"
+#include "usage_stats.h"
+#include "tunables.h"
+
+static const char *TAG = "OTA";
+
+#define OTA_TASK_PRIO          2     // 低于 water_dog (5) 与 MQTT 指令任务 (4)
+#define OTA_TASK_STACK         8192
+#define OTA_THROTTLE_MAX_MS    1000  // 单次限速等待上限 (避免服务器端读超时)
+#define OTA_IDLE_STABLE_SEC    60    // 连续空闲该时长才重启
+#define OTA_DEFER_MAX_SEC      (24 * 3600) // 等待空闲的上限，超过后只要不在制水/冲洗就重启
+#define OTA_FORCED_STABLE_SEC  5
+#define OTA_WAIT_LOG_SEC       600
+#define OTA_SECTOR_SIZE        4096
+#define OTA_SAVE_STEP_BYTES    (64 * 1024) // 断点落盘间隔
+#define OTA_RETRY_MAX          5           // 单次请求内的续传次数，仍失败则等下次连上 MQTT 再续传
+#define OTA_RETRY_BASE_SEC     15
+
+static volatile bool s_busy = false;
+static volatile bool s_staged = false; // 新固件已写入并设为启动分区，等待空闲重启
+static ota_progress_t s_prog;     // 只在下载任务中访问
+static SemaphoreHandle_t s_lock = NULL;
+static char s_staged_url[sizeof(s_prog.url)];
+static char *s_replace_url = NULL;     // 等待重启期间收到的新地址 (交给下载任务替换暂存固件)
+
+bool ota_manager_is_busy(void) {
+    return s_busy;
+}
+
+// 按已下载字节数与目标速率计算应耗时，提前时等待；每块至少让出一次 CPU
+static void throttle(int bytes_read, int64_t start_us) {
+    uint32_t kbps = (uint32_t)tunable(TUN_OTA_RATE_KBPS);
+    water_state_t ws = app_fsm_get_water_state();
+    if ((ws == WATER_STATE_MAKING || ws == WATER_STATE_WASHING) && kbps > 1) kbps /= 2;
+
+    int64_t due_us = (int64_t)bytes_read * 1000000 / ((int64_t)kbps * 1024);
+    int64_t ahead_ms = (due_us - (esp_timer_get_time() - start_us)) / 1000;
+    if (ahead_ms > OTA_THROTTLE_MAX_MS) ahead_ms = OTA_THROTTLE_MAX_MS;
+    vTaskDelay(ahead_ms > 0 ? pdMS_TO_TICKS(ahead_ms) + 1 : 1);
+}
+
+// 断点是否可用：同一地址、同一目标分区，且分区内已写入的镜像描述与记录一致
+static bool progress_usable(const char *url, const esp_partition_t *part) {
+    if (app_storage_load_ota_progress(&s_prog) != ESP_OK) return false;
+    if (s_prog.written == 0 || s_prog.part_addr != part->address || strcmp(s_prog.url, url) != 0) return false;
+    esp_app_desc_t desc;
+    if (esp_ota_get_partition_description(part, &desc) != ESP_OK) return false;
+    return memcmp(desc.app_elf_sha256, s_prog.elf_sha256, sizeof(s_prog.elf_sha256)) == 0;
+}
+
+// 记录断点 (按扇区向下取整：写入层可能还缓存着不足一个块的数据)
+static void progress_save(int read) {
+    uint32_t aligned = (uint32_t)read & ~(OTA_SECTOR_SIZE - 1);
+    if (aligned <= s_prog.written) return;
+    s_prog.written = aligned;
+    app_storage_save_ota_progress(&s_prog);
+}
+
+// 单次下载 (resume 时从 s_prog.written 起以 Range 请求续传)
+// *retry 为 true 表示可以稍后续传 (网络中断等)，false 表示需要重新下发
+static esp_err_t download_once(const char *url, const esp_partition_t *part, bool resume, bool *retry) {
+    *retry = false;
+    esp_http_client_config_t config = {
+        .url = url,
+        // 权威证书绑定: 预置私有 CA 后只信任自家 OTA 服务器，否则回退到完整证书包；同时校验主机名
+        .crt_bundle_attach = trust_store_attach,
+        .timeout_ms = 10000,
+        .keep_alive_enable = true,
+    };
+    esp_https_ota_config_t ota_config = {
+        .http_config = &config,
+        .ota_resumption = resume,
+        .ota_image_bytes_written = resume ? s_prog.written : 0,
+    };
+
+    esp_https_ota_handle_t handle = NULL;
+    esp_err_t err = esp_https_ota_begin(&ota_config, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "OTA begin failed: %s", esp_err_to_name(err));
+        *retry = true;
+        return err;
+    }
+
+    if (!resume) {
+        // 全新下载：记录镜像描述，之后的断点都以它确认分区内容
+        esp_app_desc_t desc;
+        err = esp_https_ota_get_img_desc(handle, &desc);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "OTA image header invalid: %s", esp_err_to_name(err));
+            esp_https_ota_abort(handle);
+            *retry = true;
+            return err;
+        }
+        memset(&s_prog, 0, sizeof(s_prog));
+        strncpy(s_prog.url, url, sizeof(s_prog.url) - 1);
+        s_prog.part_addr = part->address;
+        memcpy(s_prog.elf_sha256, desc.app_elf_sha256, sizeof(s_prog.elf_sha256));
+        int size = esp_https_ota_get_image_size(handle);
+        s_prog.image_size = (size > 0) ? (uint32_t)size : 0;
+        ESP_LOGI(TAG, "New image %s, %lu bytes", desc.version, (unsigned long)s_prog.image_size);
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    int start_read = esp_https_ota_get_image_len_read(handle);
+    int total = (int)s_prog.image_size;
+    int last_pct = -1;
+    while (1) {
+        err = esp_https_ota_perform(handle);
+        if (err != ESP_ERR_HTTPS_OTA_IN_PROGRESS) break;
+        int read = esp_https_ota_get_image_len_read(handle);
+        if ((uint32_t)read - s_prog.written >= OTA_SAVE_STEP_BYTES) {
+            progress_save(read);
+        }
+        if (total > 0 && read * 10 / total != last_pct) {
+            last_pct = read * 10 / total;
+            ESP_LOGI(TAG, "Downloaded %d / %d bytes", read, total);
+        }
+        throttle(read - start_read, start_us);
+    }
+
+    if (err == ESP_OK && !esp_https_ota_is_complete_data_received(handle)) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if (err != ESP_OK) {
+        progress_save(esp_https_ota_get_image_len_read(handle));
+        ESP_LOGE(TAG, "OTA download interrupted at %lu bytes: %s", (unsigned long)s_prog.written, esp_err_to_name(err));
+        esp_https_ota_abort(handle);
+        *retry = true;
+        return err;
+    }
+    // 校验镜像并设置启动分区 (此后任何重启都进入新固件)；校验失败说明断点数据不可信，从头下载
+    err = esp_https_ota_finish(handle);
+    app_storage_clear_ota_progress();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "OTA image rejected: %s", esp_err_to_name(err));
+        return err;
+    }
+    ESP_LOGI(TAG, "Image written in %llds", (long long)((esp_timer_get_time() - start_us) / 1000000));
+    return ESP_OK;
+}
+
+static esp_err_t download(const char *url) {
+    const esp_partition_t *part = esp_ota_get_next_update_partition(NULL);
+    if (!part) return ESP_ERR_NOT_FOUND;
+
+    for (int attempt = 1; ; attempt++) {
+        bool resume = progress_usable(url, part);
+        if (resume) {
+            ESP_LOGI(TAG, "Resuming download at %lu / %lu bytes", (unsigned long)s_prog.written,
+                     (unsigned long)s_prog.image_size);
+        } else {
+            app_storage_clear_ota_progress(); // 其他镜像或其他分区的断点作废
+        }
+        bool retry;
+        esp_err_t err = download_once(url, part, resume, &retry);
+        if (err == ESP_OK || !retry || attempt >= OTA_RETRY_MAX) return err;
+        vTaskDelay(pdMS_TO_TICKS(attempt * OTA_RETRY_BASE_SEC * 1000));
+    }
+}
+
+// 取走等待重启期间收到的新地址
+static char *take_replace_url(void) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    char *url = s_replace_url;
+    s_replace_url = NULL;
+    if (url) s_staged = false;
+    xSemaphoreGive(s_lock);
+    return url;
+}
+
+// 等待水机连续空闲后重启，重启前把计量零头与使用统计落盘；
+// 超过 OTA_DEFER_MAX_SEC 仍等不到空闲窗口时，只要不在制水/冲洗就重启。
+// 期间收到新的升级请求时放弃暂存的固件 (启动分区改回当前分区)，返回新地址
+static char *restart_when_idle(void) {
+    uint32_t stable_sec = 0;
+    uint32_t waited_sec = 0;
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        char *next = take_replace_url();
+        if (next) {
+            esp_ota_set_boot_partition(esp_ota_get_running_partition());
+            ESP_LOGW(TAG, "Staged firmware replaced by a new request");
+            return next;
+        }
+        bool forced = ++waited_sec >= OTA_DEFER_MAX_SEC;
+        water_state_t ws = app_fsm_get_water_state();
+        bool ok = forced ? (ws != WATER_STATE_MAKING && ws != WATER_STATE_WASHING) : app_fsm_is_idle();
+        stable_sec = ok ? stable_sec + 1 : 0;
+        if (stable_sec >= (forced ? OTA_FORCED_STABLE_SEC : OTA_IDLE_STABLE_SEC)) break;
+        if (waited_sec % OTA_WAIT_LOG_SEC == 0) {
+            ESP_LOGI(TAG, "New firmware ready, waiting for idle window (%lus)", (unsigned long)waited_sec);
+        }
+    }
+    metering_flush();
+    usage_stats_flush();
+    ESP_LOGI(TAG, "Water system %s, restarting into new firmware", (waited_sec >= OTA_DEFER_MAX_SEC) ? "not producing" : "idle");
+    esp_restart();
+    return NULL;
+}
+
+static void ota_task(void *pvParameter) {
+    char *url = (char *)pvParameter;
+    while (url) {
+        ESP_LOGI(TAG, "开始执行 OTA, 下载地址: %s", url);
+        esp_err_t err = download(url);
+        if (err == ESP_OK) {
+            xSemaphoreTake(s_lock, portMAX_DELAY);
+            strncpy(s_staged_url, url, sizeof(s_staged_url) - 1);
+            s_staged = true;
+            xSemaphoreGive(s_lock);
+        }
+        free(url);
+        url = (err == ESP_OK) ? restart_when_idle() : NULL; // 只在被新请求替换时返回
+    }
+    s_busy = false; // 失败后解锁，等待云端重新下发
+    vTaskDelete(NULL);
+}
+
+// 重启或多次续传失败后留下的断点：连上 MQTT 时自动继续 (事件循环)
+static void on_mqtt_connected(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+    if (s_busy) return;
+    ota_progress_t prog;
+    if (app_storage_load_ota_progress(&prog) != ESP_OK || prog.url[0] == '\0') return;
+    ESP_LOGI(TAG, "Unfinished download found (%lu bytes), resuming", (unsigned long)prog.written);
+    ota_manager_request(prog.url);
+}
+
+esp_err_t ota_manager_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    if (!s_lock) return ESP_ERR_NO_MEM;
+    return esp_event_handler_register(APP_EVENTS, APP_EVENT_MQTT_CONNECTED, on_mqtt_connected, NULL);
+}
+
+esp_err_t ota_manager_request(const char *url) {
+    if (!url || !url[0]) return ESP_ERR_INVALID_ARG;
+    // 固件只允许经 TLS 下载，明文 http 无法做证书绑定
+    if (strncmp(url, "https://", 8) != 0) {
+        ESP_LOGE(TAG, "OTA 地址必须为 https: %s", url);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!s_lock) return ESP_ERR_INVALID_STATE;
+    char *url_copy = strdup(url);
+    if (!url_copy) return ESP_ERR_NO_MEM;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_busy && s_staged) {
+        // 已下载完成、等待重启：新地址替换暂存的固件，同一地址视为重复
+        if (strcmp(url, s_staged_url) == 0) {
+            free(url_copy);
+        } else {
+            free(s_replace_url);
+            s_replace_url = url_copy;
+            ESP_LOGI(TAG, "新的升级请求将替换已暂存的固件: %s", url);
+        }
+        xSemaphoreGive(s_lock);
+        return ESP_OK;
+    }
+    if (s_busy) {
+        xSemaphoreGive(s_lock);
+        free(url_copy);
+        ESP_LOGW(TAG, "OTA 正在下载中，已忽略新的升级请求！");
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_busy = true;
+    xSemaphoreGive(s_lock);
+
+    if (xTaskCreate(ota_task, "ota_task", OTA_TASK_STACK, url_copy, OTA_TASK_PRIO, NULL) != pdPASS) {
+        free(url_copy);
+        s_busy = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
@@ -6,6 +6,8 @@
 
 // 产品 ID (根据文档 topic 结构: product_id/device_id/...)
 #define PRODUCT_ID "purifier" 
+// 固件版本 (Init 包与在线消息上报)
+#define FW_VERSION "1.0.0"
 
 
 // --- 1. 枚举定义 ---
@@ -17,9 +19,25 @@ typedef enum {
     CMD_METHOD_UPDATE_PLAN = 2, // 更新套餐/滤芯
     CMD_METHOD_SET_WASH    = 3, // 冲洗
     CMD_METHOD_OTA         = 4, // OTA 更新
-    CMD_METHOD_QUERY_STATUS= 5  // 查询状态
+    CMD_METHOD_QUERY_STATUS= 5, // 查询状态
+    CMD_METHOD_SET_GROUP   = 6, // 设置设备分组 (订阅 purifier/group/{group}/cmd)
+    CMD_METHOD_LEDGER_ACK  = 7, // 计量账本确认 (param.seq 及之前的记录均已入账)
+    CMD_METHOD_SET_BROKERS = 8, // 下发 Broker 接入点列表 (param.brokers 按优先级排序)
+    CMD_METHOD_QUERY_HISTORY = 9, // 查询使用统计历史 (param.from/to/gran)，结果发布到 usage Topic
+    CMD_METHOD_SET_RULES   = 10, // 下发告警规则 (param.rules 整表替换，param.default=1 恢复默认规则)
+    CMD_METHOD_SET_CONFIG  = 11, // 修改运行参数 (param.config {名称: 值}，值为 null 恢复默认)
+    CMD_METHOD_GET_CONFIG  = 12, // 查询运行参数，结果发布到 config Topic
+    CMD_METHOD_SET_SCHEDULE = 13 // 下发分时制水计划 (param.windows 整表替换，空数组取消计划)
 } cmd_method_t;
 
+#define CMD_BROKER_MAX     4
+#define CMD_URL_LEN        128
+#define CMD_RULE_MAX       16
+#define CMD_CONFIG_MAX     16
+#define CONFIG_KEY_LEN     16   // 参数名 (同时作为 NVS 键，最长 15 字符)
+#define CMD_TOU_MAX        8
+#define CMD_REASON_LEN     64   // 回执中的失败原因
+
 // 报警代码 (AlertCode)
 typedef enum {
     ALERT_LEAKAGE      = 0, // 漏水
@@ -27,9 +45,24 @@ typedef enum {
     ALERT_TIMEOUT      = 2, // 制水超时
     ALERT_TDS_ERR      = 3, // TDS 异常
     ALERT_TEMP_ERR     = 4, // 温度异常
-    ALERT_PUMP_ERR     = 5  // 水泵异常
+    ALERT_PUMP_ERR     = 5, // 水泵异常
+    ALERT_ENERGY_DRIFT = 6  // 单位产水能耗相对基线漂移 (膜老化/结垢预警)
 } alert_code_t;
 
+// 指令回执结果 (result)
+typedef enum {
+    CMD_RESULT_OK       = 0, // 已执行
+    CMD_RESULT_BUSY     = 1, // 设备指令队列已满，未执行，云端可稍后重发
+    CMD_RESULT_FAILED   = 2, // 执行失败或不支持的指令
+    CMD_RESULT_STALE    = 3, // 期望状态版本不高于设备已应用版本，已忽略
+} cmd_result_t;
+
+// Status 上报分段 (sections)：只上报相对上次发生变化的分段，0 表示全部
+#define STATUS_SECTION_SENSOR   0x01 // tdsIn/tdsOut/tdsBackup/totalWater
+#define STATUS_SECTION_PLAN     0x02 // currentStatus
+#define STATUS_SECTION_FILTERS  0x04 // filters
+#define STATUS_SECTION_ALL      0x07
+
 // --- 2. 数据结构体 ---
 typedef struct {
     char fw_version[16];
@@ -40,11 +73,44 @@ typedef struct {
 } init_data_t;
 
 
+// 告警规则 (下发格式: [source, op, threshold, hysteresis, minSec, alertCode, stateMask])
+typedef struct {
+    int source;          // 数据源 (rule_source_t，见 rule_engine.h)
+    int op;              // 比较方式 (rule_op_t)
+    int threshold;       // 阈值 (变化率规则为每分钟变化量)
+    int hysteresis;      // 恢复回差
+    int min_sec;         // 条件持续该时长才触发
+    int alert_code;      // 触发的告警 (alert_code_t)
+    int state_mask;      // 生效的制水状态 (bit = water_state_t)，0 表示全部
+} cmd_rule_t;
+
+// 运行参数修改项
+typedef struct {
+    char key[CONFIG_KEY_LEN];
+    int value;
+    bool reset;          // 值为 null，恢复固件默认
+} cmd_config_t;
+
+// 分时窗口 (下发格式: [type, startMin, endMin, dayMask])
+typedef struct {
+    int type;            // 0 允许, 1 优先 (低谷电价), 2 禁止 (tou_window_t)
+    int start_min;       // 当地时间，当天 0 点起的分钟数
+    int end_min;         // 小于 start_min 表示跨零点，等于 start_min 表示整天
+    int day_mask;        // bit0 = 周日 ... bit6 = 周六，0 表示每天
+} cmd_tou_window_t;
+
 // 服务器下发指令 (Command)
 typedef struct {
     char cmd_id[32];      // 用于回执
     int method;           // 对应 cmd_method_t
     long long timestamp;  // 时间戳
+    bool broadcast;       // 来自全量/分组 Topic (由 MQTT Manager 标记，不在 JSON 中)
+
+    // 期望状态版本 (param.planVer，云端单调递增)，0 表示未带版本的旧指令
+    uint32_t plan_ver;
+    bool has_plan;        // param 中是否带套餐字段 (payMode/days/capacity)，未带时只更新滤芯
+    bool has_group;       // method=6 带合法的 param.group (见 protocol_group_is_valid)
+    char reason[CMD_REASON_LEN]; // 失败原因，随回执上报；解析时已填写的指令 (参数不合法) 不执行
     
     // 参数集合 (解析 param 对象)
     struct {
@@ -59,8 +125,54 @@ typedef struct {
         // method=3
         int wash_duration; // 冲洗时长 (秒)
 
-        // method=4 (OTA 更新)
-        char ota_url[128]; // OTA 下载 URL
+        // 较大的参数按方法互斥存放
+        union {
+            // method=4 (OTA 更新)
+            char ota_url[CMD_URL_LEN]; // OTA 下载 URL
+
+            // method=8 (Broker 接入点列表)
+            struct {
+                int count;
+                char urls[CMD_BROKER_MAX][CMD_URL_LEN];
+            } brokers;
+
+            // method=9 (历史区间，Unix 秒；to 为 0 表示至今)
+            struct {
+                uint32_t from;
+                uint32_t to;
+                int daily;     // gran: 0 按小时, 1 按天
+            } history;
+
+            // method=10 (告警规则)
+            struct {
+                int count;
+                bool use_default; // 恢复默认规则，忽略 items
+                cmd_rule_t items[CMD_RULE_MAX];
+            } rules;
+
+            // method=11 (运行参数，整批校验通过才生效)
+            struct {
+                int count;
+                cmd_config_t items[CMD_CONFIG_MAX];
+            } config;
+
+            // method=13 (分时制水计划，-1 表示使用设备默认值)
+            struct {
+                int count;
+                int reserve_min;    // 水桶未满时最多推迟制水的时长 (分钟)，未下发时为 -1 (使用默认 20 分钟)
+                int early_wash_pct; // 优惠时段内提前冲洗的间隔比例 (%)
+                cmd_tou_window_t items[CMD_TOU_MAX];
+            } schedule;
+        };
+
+        // method=6 (设置分组)，空字符串表示退出分组；只允许 [A-Za-z0-9_-]
+        char group[24];
+
+        // method=7 (账本确认序号)
+        uint32_t ack_seq;
+
+        // 全量/分组指令的执行打散窗口 (秒)，0 使用设备默认值
+        int jitter_sec;
     } param;
     
     // 滤芯更新数组 (最多 9 级)
@@ -80,6 +192,7 @@ typedef struct {
     int tds_out;         // tdsOut
     int tds_backup;      // tdsBackup
     int total_water;     // totalWater (累计用水量)
+    int sample_age;      // sampleAge (TDS 快照距今秒数，<0 表示尚无采样，不上报)
 
     // --- currentStatus 对象字段 ---
     int switch_status;   // currentStatus.switch
@@ -87,6 +200,8 @@ typedef struct {
     int pay_mode;        // currentStatus.payMode
     int days;            // currentStatus.days
     int capacity;        // currentStatus.capacity
+    uint32_t plan_ver;   // planVer (设备已应用的期望状态版本，缓存套餐未经确认时为 0)
+    uint8_t sections;    // 本次包含的分段 (STATUS_SECTION_*)，0 表示全部
     
     // --- filters 数组 ---
     struct {
@@ -100,10 +215,12 @@ typedef struct {
 // 日志上报 (Log) - 主要是制水数据
 typedef struct {
     long long timestamp; // timestamp
-    int production_vol;  // productionVol (本次制水量)
+    int production_vol;  // productionVol (定时日志恒为 0，单次制水量见 session_report_t)
     int tds_in;          // tdsIn
     int tds_out;         // tdsOut
     int tds_backup;      // tdsBackup
+    int sample_age;      // sampleAge (TDS 快照距今秒数，<0 表示尚无采样，不上报)
+    int keepalive;       // keepAlive (当前 MQTT 心跳/秒，0 表示不上报)
 } log_report_t;
 
 // 报警上报 (Alert)
@@ -113,6 +230,186 @@ typedef struct {
     char status[16];     // "triggered" or "cleared"
 } alert_report_t;
 
+// 告警变化批量上报 (告警管理器合并同一时段内的触发/清除)
+#define ALERT_BATCH_MAX    8
+
+typedef struct {
+    int alert_code;
+    char status[16];     // "triggered" or "cleared"
+    uint32_t first_ts;   // firstTs 首次发生 (Unix 秒，未对时为 0)
+    uint32_t last_ts;    // lastTs 最近一次发生
+    uint32_t count;      // 本次触发以来的发生次数
+} alert_item_t;
+
+typedef struct {
+    long long timestamp; // timestamp
+    int count;
+    alert_item_t items[ALERT_BATCH_MAX];
+    int active_count;    // 上报后仍处于触发状态的告警
+    int active_codes[ALERT_BATCH_MAX];
+} alert_batch_t;
+
+// 指令回执 (Receipt)
+typedef struct {
+    long long timestamp; // timestamp
+    char cmd_id[32];     // cmdId，与下发指令对应
+    int method;
+    int result;          // 对应 cmd_result_t
+    bool has_cloud;
+    int32_t cloud_ms;    // 云端时间戳到设备收到的差值 (毫秒，含两端时钟偏差)
+    char reason[CMD_REASON_LEN]; // 失败原因，空字符串不上报
+} cmd_receipt_t;
+
+// 在线状态 (Presence) - 保留消息，Broker 在设备异常掉线时发布遗嘱 {"online":0}
+typedef struct {
+    long long timestamp; // timestamp
+    bool online;
+    char fw_version[16];
+    char net_mode[8];    // "WIFI" or "4G"
+    uint32_t uptime_sec; // 本次上电运行时长
+    uint32_t plan_ver;   // 已应用的期望状态版本 (缓存套餐未经确认时为 0)，云端据此决定是否需要补发套餐
+    int broker;          // 当前使用的 Broker 接入点序号
+} presence_report_t;
+
+// 制水会话 (Session) - 每次离开制水状态时上报一条
+typedef struct {
+    long long timestamp;     // timestamp
+    uint32_t start_ts;       // startTs (Unix 秒，未对时为 0)
+    uint32_t end_ts;         // endTs
+    uint32_t duration_sec;   // duration
+    uint32_t volume_ml;      // volumeMl (流量计脉冲累计)
+    uint32_t flow_ml_min;    // meanFlow (毫升/分钟)
+    int tds_in_avg;          // tdsInAvg (会话内无采样时为 -1，不上报)
+    int tds_out_avg;         // tdsOutAvg
+    int rejection_permille;  // rejection (脱盐率 ‰，无法计算时为 -1，不上报)
+    uint32_t peak_pump_ma;   // peakPumpMa
+    int end_state;           // endState (结束后进入的水机状态: 水满/缺水/故障...)
+
+    // 能耗 (水泵电流 x 标称电压积分)
+    uint32_t energy_mwh;     // energyMwh (本次会话)
+    uint32_t mwh_per_l;      // mwhPerL (本次会话单位产水能耗，水量不足 1 升时为 0，不上报)
+    uint32_t base_mwh_per_l; // baseMwhPerL (长期基线，未建立时为 0，不上报)
+    int drift_pct;           // drift (近期相对基线的漂移百分比)
+    uint32_t day_wh;         // dayWh (当天累计)
+    uint32_t lifetime_wh;    // lifetimeWh (出厂以来累计)
+} session_report_t;
+
+// 计量账本 (Ledger) - 只上报云端未确认的记录，云端按 seq 去重入账
+#define LEDGER_REPORT_MAX 32
+
+typedef struct {
+    long long timestamp; // timestamp
+    uint32_t acked_seq;  // 设备记录的已确认序号，云端可据此发现漏确认
+    int count;
+    struct {
+        uint32_t seq;
+        uint32_t ml;
+        uint32_t ts;
+    } entries[LEDGER_REPORT_MAX];
+} ledger_report_t;
+
+// 使用统计 (Usage) - 每日摘要或历史查询结果
+// buckets 为 [startTs, waterMl, makingSec, washMl, washCount, energyJ, tdsMin, tdsAvg, tdsMax] 数组
+#define USAGE_REPORT_MAX 48
+
+typedef struct {
+    uint32_t start_ts;
+    uint32_t water_ml;
+    uint32_t making_sec;
+    uint32_t wash_ml;
+    uint32_t wash_count;
+    uint32_t energy_j;
+    int tds_min;         // 无采样时均为 -1
+    int tds_avg;
+    int tds_max;
+} usage_item_t;
+
+typedef struct {
+    long long timestamp; // timestamp
+    char kind[8];        // "digest" 每日摘要, "hour"/"day" 历史查询
+    char cmd_id[32];     // 查询对应的指令 ID (摘要为空)
+    int count;
+    usage_item_t items[USAGE_REPORT_MAX];
+} usage_report_t;
+
+// 运行参数 (Config) - GET_CONFIG 的结果
+#define CONFIG_REPORT_MAX     24
+
+typedef struct {
+    const char *key;
+    int32_t value;       // 当前值
+    int32_t def;         // 固件默认值
+    int32_t min;
+    int32_t max;
+} config_item_t;
+
+typedef struct {
+    long long timestamp; // timestamp
+    char cmd_id[32];     // 查询对应的指令 ID
+    int count;
+    config_item_t items[CONFIG_REPORT_MAX];
+} config_report_t;
+
+// MQTT 发布指标 (Metrics) - 用于区分云端慢是设备侧还是 Broker 侧
+#define METRICS_CLASS_MAX     12
+#define METRICS_HIST_BUCKETS  8   // 延迟直方图: <50/<100/<250/<500/<1000/<2500/<5000/>=5000 ms
+
+typedef struct {
+    const char *name;     // 消息类别 (status/log/alert...)
+    uint32_t sent;        // 发布次数 (进入客户端发送队列)
+    uint32_t acked;       // 收到 PUBACK/PUBCOMP 的次数 (仅 QoS>0)
+    uint32_t failed;      // 发布接口直接返回失败的次数
+    uint32_t bytes;       // 发送字节数 (Topic + 负载)
+    uint32_t avg_ms;      // 入队到确认的平均延迟
+    uint32_t max_ms;      // 入队到确认的最大延迟
+    uint32_t hist[METRICS_HIST_BUCKETS];
+} metrics_class_t;
+
+// 指令执行各阶段延迟 (单位微秒，直方图: <0.5/<1/<5/<10/<50/<100/<500/>=500 ms)
+#define METRICS_CMD_STAGES    7
+
+typedef struct {
+    const char *name;     // 阶段 (parse/queue/store/post/dispatch/actuate/e2e)
+    uint32_t n;
+    uint32_t avg_us;
+    uint32_t max_us;
+    uint32_t hist[METRICS_HIST_BUCKETS];
+} metrics_cmd_stage_t;
+
+typedef struct {
+    long long timestamp;  // timestamp
+    uint32_t uptime_sec;
+    int class_count;
+    metrics_class_t classes[METRICS_CLASS_MAX];
+
+    uint32_t rx_msgs;     // 收到的消息数
+    uint32_t rx_bytes;    // 收到的字节数 (Topic + 负载)
+    uint32_t retransmits; // 估算重传数 (重连时仍未确认、将由 outbox 重发的消息)
+    uint32_t expired;     // outbox 超时丢弃的消息数
+    uint32_t untracked;   // 待确认表满未能统计延迟的消息数
+
+    uint32_t disconnects; // 断线次数
+    uint32_t err_tcp;     // 传输层错误 (TCP/TLS)
+    uint32_t err_refused; // Broker 拒绝连接
+    uint32_t err_other;
+    int last_refuse_code; // 最近一次拒绝连接的返回码
+    int last_sock_errno;  // 最近一次传输层 errno
+
+    uint32_t cmd_received;
+    uint32_t cmd_dropped;
+    uint32_t cmd_max_wait_ms;
+    uint32_t cmd_max_exec_ms;
+    int cmd_stage_count;
+    metrics_cmd_stage_t cmd_stages[METRICS_CMD_STAGES];
+
+    // 分时制水 (开机以来)，未配置计划时不上报
+    bool tou_enabled;
+    uint32_t tou_deferrals;   // 禁止时段推迟制水的次数
+    uint32_t tou_forced;      // 推迟达到保底时长后强制制水的次数
+    uint32_t tou_wash_moved;  // 提前/推迟到非禁止时段的冲洗次数
+    uint32_t tou_shifted_mwh; // 移出禁止时段的水泵能耗 (mWh)
+} metrics_report_t;
+
 // --- 3. 函数声明 ---
 
 /**
@@ -131,11 +428,28 @@ void protocol_get_uid(char *out_uid, size_t max_len);
  * 示例: "AA:BB:CC:DD:EE:FF"
  */
 void protocol_get_mac_str(char *out_mac, size_t max_len);
+/**
+ * @brief DeviceID 的 FNV-1a 哈希，用于全网设备错峰 (指令执行、重连、定时上报)
+ */
+uint32_t protocol_device_hash(void);
+/**
+ * @brief 分组名是否合法 (只含 [A-Za-z0-9_-]、不超过 23 字符；空字符串表示退出分组)
+ * 分组名直接拼入订阅 Topic，禁止 '/'、'+'、'#' 等会改变订阅范围的字符
+ */
+bool protocol_group_is_valid(const char *group);
 // 打包函数 (生成 JSON 字符串，调用者需 free)
 char* protocol_pack_init(const init_data_t *data);
 char* protocol_pack_status(const status_report_t *data);
 char* protocol_pack_log(const log_report_t *data);
 char* protocol_pack_alert(const alert_report_t *data);
+char* protocol_pack_alert_batch(const alert_batch_t *data);
+char* protocol_pack_receipt(const cmd_receipt_t *data);
+char* protocol_pack_metrics(const metrics_report_t *data);
+char* protocol_pack_presence(const presence_report_t *data);
+char* protocol_pack_ledger(const ledger_report_t *data);
+char* protocol_pack_session(const session_report_t *data);
+char* protocol_pack_usage(const usage_report_t *data);
+char* protocol_pack_config(const config_report_t *data);
 
 // 解析函数
 esp_err_t protocol_parse_cmd(const char *json_str, int len, server_cmd_t *out_cmd);
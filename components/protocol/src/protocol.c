@@ -3,6 +3,7 @@
 #include "esp_log.h"
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include "esp_mac.h"
 #include <sys/time.h>
 #include "esp_efuse.h"
@@ -48,6 +49,28 @@ void protocol_get_mac_str(char *out_mac, size_t max_len) {
     snprintf(out_mac, max_len, "%02X:%02X:%02X:%02X:%02X:%02X", 
              mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 }
+uint32_t protocol_device_hash(void) {
+    char dev_id[32];
+    protocol_get_device_id(dev_id, sizeof(dev_id));
+    uint32_t hash = 2166136261u;
+    for (const char *p = dev_id; *p; p++) {
+        hash ^= (uint8_t)*p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool protocol_group_is_valid(const char *group) {
+    if (!group) return false;
+    size_t len = 0;
+    for (const char *p = group; *p; p++, len++) {
+        char c = *p;
+        bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+        if (!ok || len + 1 >= sizeof(((server_cmd_t *)0)->param.group)) return false;
+    }
+    return true;
+}
+
 // 1. 打包 Init
 // --- Init 包打包 (UID + MAC + DeviceID) ---
 char* protocol_pack_init(const init_data_t *data) {
@@ -72,6 +95,7 @@ char* protocol_pack_init(const init_data_t *data) {
 // 2. 打包 Status (套餐、滤芯)
 char* protocol_pack_status(const status_report_t *data) {
     cJSON *root = cJSON_CreateObject();
+    uint8_t sections = data->sections ? data->sections : STATUS_SECTION_ALL;
     
     // 参数对象
     // 1. 根节点字段
@@ -80,37 +104,50 @@ char* protocol_pack_status(const status_report_t *data) {
     } else {
         cJSON_AddNumberToObject(root, "timestamp", (double)get_timestamp_ms());
     }
-    cJSON_AddNumberToObject(root, "tdsIn", data->tds_in);
-    cJSON_AddNumberToObject(root, "tdsOut", data->tds_out);
-    cJSON_AddNumberToObject(root, "tdsBackup", data->tds_backup);
-    cJSON_AddNumberToObject(root, "totalWater", data->total_water);
+    cJSON_AddNumberToObject(root, "planVer", data->plan_ver);
+    if (sections != STATUS_SECTION_ALL) {
+        cJSON_AddNumberToObject(root, "sections", sections); // 增量上报，云端按分段合并
+    }
+    if (sections & STATUS_SECTION_SENSOR) {
+        cJSON_AddNumberToObject(root, "tdsIn", data->tds_in);
+        cJSON_AddNumberToObject(root, "tdsOut", data->tds_out);
+        cJSON_AddNumberToObject(root, "tdsBackup", data->tds_backup);
+        cJSON_AddNumberToObject(root, "totalWater", data->total_water);
+        if (data->sample_age >= 0) {
+            cJSON_AddNumberToObject(root, "sampleAge", data->sample_age);
+        }
+    }
 
     // 2. currentStatus 对象
-    cJSON *currentStatus = cJSON_CreateObject();
-    cJSON_AddNumberToObject(currentStatus, "switch", data->switch_status);
-    cJSON_AddNumberToObject(currentStatus, "saleMode", data->sale_mode);
-    cJSON_AddNumberToObject(currentStatus, "payMode", data->pay_mode);
-    cJSON_AddNumberToObject(currentStatus, "days", data->days);
-    cJSON_AddNumberToObject(currentStatus, "capacity", data->capacity);
-    cJSON_AddItemToObject(root, "currentStatus", currentStatus);
+    if (sections & STATUS_SECTION_PLAN) {
+        cJSON *currentStatus = cJSON_CreateObject();
+        cJSON_AddNumberToObject(currentStatus, "switch", data->switch_status);
+        cJSON_AddNumberToObject(currentStatus, "saleMode", data->sale_mode);
+        cJSON_AddNumberToObject(currentStatus, "payMode", data->pay_mode);
+        cJSON_AddNumberToObject(currentStatus, "days", data->days);
+        cJSON_AddNumberToObject(currentStatus, "capacity", data->capacity);
+        cJSON_AddItemToObject(root, "currentStatus", currentStatus);
+    }
 
     // 3. filters 数组打包 (新格式)
-    cJSON *filters_arr = cJSON_CreateArray();
-    for (int i = 0; i < 9; i++) {
-        // 只上传有效（已配置）的滤芯
-        if (data->filters[i].valid) {
-            // 使用 C99 复合字面量快速创建 cJSON 整数数组
-            int filter_data[4] = {
-                i + 1, 
-                data->filters[i].type, 
-                data->filters[i].days, 
-                data->filters[i].capacity
-            };
-            cJSON *item_arr = cJSON_CreateIntArray(filter_data, 4);
-            cJSON_AddItemToArray(filters_arr, item_arr);
+    if (sections & STATUS_SECTION_FILTERS) {
+        cJSON *filters_arr = cJSON_CreateArray();
+        for (int i = 0; i < 9; i++) {
+            // 只上传有效（已配置）的滤芯
+            if (data->filters[i].valid) {
+                // 使用 C99 复合字面量快速创建 cJSON 整数数组
+                int filter_data[4] = {
+                    i + 1, 
+                    data->filters[i].type, 
+                    data->filters[i].days, 
+                    data->filters[i].capacity
+                };
+                cJSON *item_arr = cJSON_CreateIntArray(filter_data, 4);
+                cJSON_AddItemToArray(filters_arr, item_arr);
+            }
         }
+        cJSON_AddItemToObject(root, "filters", filters_arr);
     }
-    cJSON_AddItemToObject(root, "filters", filters_arr);
 
     char *str = cJSON_PrintUnformatted(root);
     cJSON_Delete(root);
@@ -130,6 +167,12 @@ char* protocol_pack_log(const log_report_t *data) {
     cJSON_AddNumberToObject(root, "tdsIn", data->tds_in);
     cJSON_AddNumberToObject(root, "tdsOut", data->tds_out);
     cJSON_AddNumberToObject(root, "tdsBackup", data->tds_backup);
+    if (data->sample_age >= 0) {
+        cJSON_AddNumberToObject(root, "sampleAge", data->sample_age);
+    }
+    if (data->keepalive > 0) {
+        cJSON_AddNumberToObject(root, "keepAlive", data->keepalive);
+    }
 
     char *str = cJSON_PrintUnformatted(root);
     cJSON_Delete(root);
@@ -158,7 +201,294 @@ char* protocol_pack_alert(const alert_report_t *data) {
     return str;
 }
 
-// 5. 解析指令
+// 打包告警批量变化: alerts 为本次变化，active 为当前仍处于触发状态的告警码
+char* protocol_pack_alert_batch(const alert_batch_t *data) {
+    cJSON *root = cJSON_CreateObject();
+    if (data->timestamp > 0) {
+        cJSON_AddNumberToObject(root, "timestamp", (double)data->timestamp);
+    } else {
+        cJSON_AddNumberToObject(root, "timestamp", (double)get_timestamp_ms());
+    }
+
+    cJSON *alerts = cJSON_AddArrayToObject(root, "alerts");
+    for (int i = 0; i < data->count && i < ALERT_BATCH_MAX; i++) {
+        const alert_item_t *a = &data->items[i];
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "alertCode", a->alert_code);
+        cJSON_AddStringToObject(item, "status", a->status);
+        cJSON_AddNumberToObject(item, "firstTs", a->first_ts);
+        cJSON_AddNumberToObject(item, "lastTs", a->last_ts);
+        cJSON_AddNumberToObject(item, "count", a->count);
+        cJSON_AddItemToArray(alerts, item);
+    }
+
+    cJSON *active = cJSON_AddArrayToObject(root, "active");
+    for (int i = 0; i < data->active_count && i < ALERT_BATCH_MAX; i++) {
+        cJSON_AddItemToArray(active, cJSON_CreateNumber(data->active_codes[i]));
+    }
+
+    char *str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return str;
+}
+
+// 5. 打包指令回执
+char* protocol_pack_receipt(const cmd_receipt_t *data) {
+    cJSON *root = cJSON_CreateObject();
+    if (data->timestamp > 0) {
+        cJSON_AddNumberToObject(root, "timestamp", (double)data->timestamp);
+    } else {
+        cJSON_AddNumberToObject(root, "timestamp", (double)get_timestamp_ms());
+    }
+    cJSON_AddStringToObject(root, "cmdId", data->cmd_id);
+    cJSON_AddNumberToObject(root, "method", data->method);
+    cJSON_AddNumberToObject(root, "result", data->result);
+    if (data->has_cloud) {
+        cJSON_AddNumberToObject(root, "cloudMs", data->cloud_ms);
+    }
+    if (data->reason[0]) {
+        cJSON_AddStringToObject(root, "reason", data->reason);
+    }
+
+    char *str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return str;
+}
+
+// 打包发布指标 (字段名保持简短，周期上报控制流量)
+char* protocol_pack_metrics(const metrics_report_t *data) {
+    cJSON *root = cJSON_CreateObject();
+    if (data->timestamp > 0) {
+        cJSON_AddNumberToObject(root, "timestamp", (double)data->timestamp);
+    } else {
+        cJSON_AddNumberToObject(root, "timestamp", (double)get_timestamp_ms());
+    }
+    cJSON_AddNumberToObject(root, "uptime", data->uptime_sec);
+
+    cJSON *pub = cJSON_AddObjectToObject(root, "pub");
+    for (int i = 0; i < data->class_count && i < METRICS_CLASS_MAX; i++) {
+        const metrics_class_t *c = &data->classes[i];
+        if (!c->name || c->sent == 0) continue; // 未发布过的类别不上报
+        cJSON *obj = cJSON_AddObjectToObject(pub, c->name);
+        cJSON_AddNumberToObject(obj, "n", c->sent);
+        cJSON_AddNumberToObject(obj, "ack", c->acked);
+        cJSON_AddNumberToObject(obj, "fail", c->failed);
+        cJSON_AddNumberToObject(obj, "tx", c->bytes);
+        cJSON_AddNumberToObject(obj, "avg", c->avg_ms);
+        cJSON_AddNumberToObject(obj, "max", c->max_ms);
+        cJSON *hist = cJSON_AddArrayToObject(obj, "h");
+        for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            cJSON_AddItemToArray(hist, cJSON_CreateNumber(c->hist[b]));
+        }
+    }
+
+    cJSON_AddNumberToObject(root, "rxMsgs", data->rx_msgs);
+    cJSON_AddNumberToObject(root, "rx", data->rx_bytes);
+    cJSON_AddNumberToObject(root, "retx", data->retransmits);
+    cJSON_AddNumberToObject(root, "expired", data->expired);
+    cJSON_AddNumberToObject(root, "untracked", data->untracked);
+
+    cJSON *disc = cJSON_AddObjectToObject(root, "disc");
+    cJSON_AddNumberToObject(disc, "n", data->disconnects);
+    cJSON_AddNumberToObject(disc, "tcp", data->err_tcp);
+    cJSON_AddNumberToObject(disc, "refused", data->err_refused);
+    cJSON_AddNumberToObject(disc, "other", data->err_other);
+    cJSON_AddNumberToObject(disc, "refuseCode", data->last_refuse_code);
+    cJSON_AddNumberToObject(disc, "errno", data->last_sock_errno);
+
+    cJSON *cmd = cJSON_AddObjectToObject(root, "cmd");
+    cJSON_AddNumberToObject(cmd, "n", data->cmd_received);
+    cJSON_AddNumberToObject(cmd, "drop", data->cmd_dropped);
+    cJSON_AddNumberToObject(cmd, "maxWait", data->cmd_max_wait_ms);
+    cJSON_AddNumberToObject(cmd, "maxExec", data->cmd_max_exec_ms);
+    cJSON *lat = cJSON_AddObjectToObject(cmd, "lat");
+    for (int i = 0; i < data->cmd_stage_count && i < METRICS_CMD_STAGES; i++) {
+        const metrics_cmd_stage_t *st = &data->cmd_stages[i];
+        if (!st->name || st->n == 0) continue;
+        cJSON *obj = cJSON_AddObjectToObject(lat, st->name);
+        cJSON_AddNumberToObject(obj, "n", st->n);
+        cJSON_AddNumberToObject(obj, "avg", st->avg_us);
+        cJSON_AddNumberToObject(obj, "max", st->max_us);
+        cJSON *hist = cJSON_AddArrayToObject(obj, "h");
+        for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            cJSON_AddItemToArray(hist, cJSON_CreateNumber(st->hist[b]));
+        }
+    }
+
+    if (data->tou_enabled) {
+        cJSON *tou = cJSON_AddObjectToObject(root, "tou");
+        cJSON_AddNumberToObject(tou, "deferred", data->tou_deferrals);
+        cJSON_AddNumberToObject(tou, "forced", data->tou_forced);
+        cJSON_AddNumberToObject(tou, "washMoved", data->tou_wash_moved);
+        cJSON_AddNumberToObject(tou, "shiftedMwh", data->tou_shifted_mwh);
+    }
+
+    char *str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return str;
+}
+
+// 打包在线状态 (离线时只带 online 与时间戳)
+char* protocol_pack_presence(const presence_report_t *data) {
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "online", data->online ? 1 : 0);
+    if (data->online) {
+        cJSON_AddStringToObject(root, "fwVersion", data->fw_version);
+        cJSON_AddStringToObject(root, "netMode", data->net_mode);
+        cJSON_AddNumberToObject(root, "uptime", data->uptime_sec);
+        cJSON_AddNumberToObject(root, "planVer", data->plan_ver);
+        cJSON_AddNumberToObject(root, "broker", data->broker);
+    }
+    if (data->timestamp > 0) {
+        cJSON_AddNumberToObject(root, "timestamp", (double)data->timestamp);
+    } else {
+        cJSON_AddNumberToObject(root, "timestamp", (double)get_timestamp_ms());
+    }
+
+    char *str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return str;
+}
+
+// 打包制水会话
+char* protocol_pack_session(const session_report_t *data) {
+    cJSON *root = cJSON_CreateObject();
+    if (data->timestamp > 0) {
+        cJSON_AddNumberToObject(root, "timestamp", (double)data->timestamp);
+    } else {
+        cJSON_AddNumberToObject(root, "timestamp", (double)get_timestamp_ms());
+    }
+    cJSON_AddNumberToObject(root, "startTs", data->start_ts);
+    cJSON_AddNumberToObject(root, "endTs", data->end_ts);
+    cJSON_AddNumberToObject(root, "duration", data->duration_sec);
+    cJSON_AddNumberToObject(root, "volumeMl", data->volume_ml);
+    cJSON_AddNumberToObject(root, "meanFlow", data->flow_ml_min);
+    if (data->tds_in_avg >= 0) {
+        cJSON_AddNumberToObject(root, "tdsInAvg", data->tds_in_avg);
+    }
+    if (data->tds_out_avg >= 0) {
+        cJSON_AddNumberToObject(root, "tdsOutAvg", data->tds_out_avg);
+    }
+    if (data->rejection_permille >= 0) {
+        cJSON_AddNumberToObject(root, "rejection", data->rejection_permille);
+    }
+    cJSON_AddNumberToObject(root, "peakPumpMa", data->peak_pump_ma);
+    cJSON_AddNumberToObject(root, "endState", data->end_state);
+    cJSON_AddNumberToObject(root, "energyMwh", data->energy_mwh);
+    if (data->mwh_per_l > 0) {
+        cJSON_AddNumberToObject(root, "mwhPerL", data->mwh_per_l);
+    }
+    if (data->base_mwh_per_l > 0) {
+        cJSON_AddNumberToObject(root, "baseMwhPerL", data->base_mwh_per_l);
+        cJSON_AddNumberToObject(root, "drift", data->drift_pct);
+    }
+    cJSON_AddNumberToObject(root, "dayWh", data->day_wh);
+    cJSON_AddNumberToObject(root, "lifetimeWh", data->lifetime_wh);
+
+    char *str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return str;
+}
+
+// 打包计量账本: entries 为 [seq, ml, ts] 数组
+char* protocol_pack_ledger(const ledger_report_t *data) {
+    cJSON *root = cJSON_CreateObject();
+    if (data->timestamp > 0) {
+        cJSON_AddNumberToObject(root, "timestamp", (double)data->timestamp);
+    } else {
+        cJSON_AddNumberToObject(root, "timestamp", (double)get_timestamp_ms());
+    }
+    cJSON_AddNumberToObject(root, "acked", data->acked_seq);
+
+    cJSON *entries = cJSON_AddArrayToObject(root, "entries");
+    for (int i = 0; i < data->count && i < LEDGER_REPORT_MAX; i++) {
+        cJSON *e = cJSON_CreateArray();
+        cJSON_AddItemToArray(e, cJSON_CreateNumber(data->entries[i].seq));
+        cJSON_AddItemToArray(e, cJSON_CreateNumber(data->entries[i].ml));
+        cJSON_AddItemToArray(e, cJSON_CreateNumber(data->entries[i].ts));
+        cJSON_AddItemToArray(entries, e);
+    }
+
+    char *str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return str;
+}
+
+// 打包使用统计: buckets 按时间升序，每项为定长数组 (字段顺序见 protocol.h)
+char* protocol_pack_usage(const usage_report_t *data) {
+    cJSON *root = cJSON_CreateObject();
+    if (data->timestamp > 0) {
+        cJSON_AddNumberToObject(root, "timestamp", (double)data->timestamp);
+    } else {
+        cJSON_AddNumberToObject(root, "timestamp", (double)get_timestamp_ms());
+    }
+    cJSON_AddStringToObject(root, "kind", data->kind);
+    if (data->cmd_id[0]) {
+        cJSON_AddStringToObject(root, "cmdId", data->cmd_id);
+    }
+
+    cJSON *buckets = cJSON_AddArrayToObject(root, "buckets");
+    for (int i = 0; i < data->count && i < USAGE_REPORT_MAX; i++) {
+        cJSON *b = cJSON_CreateArray();
+        cJSON_AddItemToArray(b, cJSON_CreateNumber(data->items[i].start_ts));
+        cJSON_AddItemToArray(b, cJSON_CreateNumber(data->items[i].water_ml));
+        cJSON_AddItemToArray(b, cJSON_CreateNumber(data->items[i].making_sec));
+        cJSON_AddItemToArray(b, cJSON_CreateNumber(data->items[i].wash_ml));
+        cJSON_AddItemToArray(b, cJSON_CreateNumber(data->items[i].wash_count));
+        cJSON_AddItemToArray(b, cJSON_CreateNumber(data->items[i].energy_j));
+        cJSON_AddItemToArray(b, cJSON_CreateNumber(data->items[i].tds_min));
+        cJSON_AddItemToArray(b, cJSON_CreateNumber(data->items[i].tds_avg));
+        cJSON_AddItemToArray(b, cJSON_CreateNumber(data->items[i].tds_max));
+        cJSON_AddItemToArray(buckets, b);
+    }
+
+    char *str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return str;
+}
+
+// 打包运行参数: 每项为 [当前值, 默认值, 最小值, 最大值]
+char* protocol_pack_config(const config_report_t *data) {
+    cJSON *root = cJSON_CreateObject();
+    if (data->timestamp > 0) {
+        cJSON_AddNumberToObject(root, "timestamp", (double)data->timestamp);
+    } else {
+        cJSON_AddNumberToObject(root, "timestamp", (double)get_timestamp_ms());
+    }
+    if (data->cmd_id[0]) {
+        cJSON_AddStringToObject(root, "cmdId", data->cmd_id);
+    }
+
+    cJSON *cfg = cJSON_AddObjectToObject(root, "config");
+    for (int i = 0; i < data->count && i < CONFIG_REPORT_MAX; i++) {
+        const config_item_t *c = &data->items[i];
+        cJSON *v = cJSON_CreateArray();
+        cJSON_AddItemToArray(v, cJSON_CreateNumber(c->value));
+        cJSON_AddItemToArray(v, cJSON_CreateNumber(c->def));
+        cJSON_AddItemToArray(v, cJSON_CreateNumber(c->min));
+        cJSON_AddItemToArray(v, cJSON_CreateNumber(c->max));
+        cJSON_AddItemToObject(cfg, c->key, v);
+    }
+
+    char *str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return str;
+}
+
+// 解析整数元组 (告警规则 / 分时窗口)，元素个数不在 [min_len, max_len] 或含非数字时返回 false
+static bool parse_int_tuple(const cJSON *t, int min_len, int max_len, int *out) {
+    if (!cJSON_IsArray(t)) return false;
+    int n = cJSON_GetArraySize(t);
+    if (n < min_len || n > max_len) return false;
+    for (int i = 0; i < n; i++) {
+        const cJSON *e = cJSON_GetArrayItem(t, i);
+        if (!cJSON_IsNumber(e)) return false;
+        out[i] = e->valueint;
+    }
+    return true;
+}
+
+// 6. 解析指令
 esp_err_t protocol_parse_cmd(const char *json_str, int len, server_cmd_t *out_cmd) {
     if (!json_str || len <= 0 || !out_cmd) return ESP_ERR_INVALID_ARG;
 
@@ -194,14 +524,122 @@ esp_err_t protocol_parse_cmd(const char *json_str, int len, server_cmd_t *out_cm
         cJSON *item = NULL;
         if ((item = cJSON_GetObjectItem(param, "switch")) != NULL) out_cmd->param.switch_status = item->valueint;
         if ((item = cJSON_GetObjectItem(param, "saleMode")) != NULL) out_cmd->param.sale_mode = item->valueint;
-        if ((item = cJSON_GetObjectItem(param, "payMode")) != NULL) out_cmd->param.pay_mode = item->valueint;
-        if ((item = cJSON_GetObjectItem(param, "days")) != NULL) out_cmd->param.days = item->valueint;
-        if ((item = cJSON_GetObjectItem(param, "capacity")) != NULL) out_cmd->param.capacity = item->valueint;
+        if ((item = cJSON_GetObjectItem(param, "payMode")) != NULL) { out_cmd->param.pay_mode = item->valueint; out_cmd->has_plan = true; }
+        if ((item = cJSON_GetObjectItem(param, "days")) != NULL) { out_cmd->param.days = item->valueint; out_cmd->has_plan = true; }
+        if ((item = cJSON_GetObjectItem(param, "capacity")) != NULL) { out_cmd->param.capacity = item->valueint; out_cmd->has_plan = true; }
+        if ((item = cJSON_GetObjectItem(param, "planVer")) != NULL && cJSON_IsNumber(item)) out_cmd->plan_ver = (uint32_t)item->valuedouble;
+        if ((item = cJSON_GetObjectItem(param, "jitter")) != NULL && cJSON_IsNumber(item)) out_cmd->param.jitter_sec = item->valueint;
         if (out_cmd->method == CMD_METHOD_OTA) {
             if ((item = cJSON_GetObjectItem(param, "otaUrl")) != NULL && cJSON_IsString(item)) {
                 strncpy(out_cmd->param.ota_url, item->valuestring, sizeof(out_cmd->param.ota_url) - 1);
             }
         }
+        if (out_cmd->method == CMD_METHOD_SET_BROKERS) {
+            cJSON *arr = cJSON_GetObjectItem(param, "brokers");
+            if (arr && cJSON_IsArray(arr)) {
+                int size = cJSON_GetArraySize(arr);
+                for (int i = 0; i < size && out_cmd->param.brokers.count < CMD_BROKER_MAX; i++) {
+                    cJSON *url = cJSON_GetArrayItem(arr, i);
+                    if (url && cJSON_IsString(url) && url->valuestring[0]) {
+                        strncpy(out_cmd->param.brokers.urls[out_cmd->param.brokers.count], url->valuestring, CMD_URL_LEN - 1);
+                        out_cmd->param.brokers.count++;
+                    }
+                }
+            }
+        }
+        if (out_cmd->method == CMD_METHOD_LEDGER_ACK) {
+            if ((item = cJSON_GetObjectItem(param, "seq")) != NULL && cJSON_IsNumber(item)) {
+                out_cmd->param.ack_seq = (uint32_t)item->valuedouble;
+            }
+        }
+        if (out_cmd->method == CMD_METHOD_QUERY_HISTORY) {
+            if ((item = cJSON_GetObjectItem(param, "from")) != NULL && cJSON_IsNumber(item)) {
+                out_cmd->param.history.from = (uint32_t)item->valuedouble;
+            }
+            if ((item = cJSON_GetObjectItem(param, "to")) != NULL && cJSON_IsNumber(item)) {
+                out_cmd->param.history.to = (uint32_t)item->valuedouble;
+            }
+            if ((item = cJSON_GetObjectItem(param, "gran")) != NULL && cJSON_IsNumber(item)) {
+                out_cmd->param.history.daily = (item->valueint == 1);
+            }
+        }
+        if (out_cmd->method == CMD_METHOD_SET_RULES) {
+            if ((item = cJSON_GetObjectItem(param, "default")) != NULL && cJSON_IsNumber(item)) {
+                out_cmd->param.rules.use_default = (item->valueint == 1);
+            }
+            // 规则表整表替换，任一条格式错误或条数超限时整条指令失败，不做部分生效
+            cJSON *arr = cJSON_GetObjectItem(param, "rules");
+            if (arr && !cJSON_IsArray(arr)) {
+                snprintf(out_cmd->reason, sizeof(out_cmd->reason), "rules must be an array");
+            } else if (arr && cJSON_GetArraySize(arr) > CMD_RULE_MAX) {
+                snprintf(out_cmd->reason, sizeof(out_cmd->reason), "too many rules (max %d)", CMD_RULE_MAX);
+            } else if (arr) {
+                int size = cJSON_GetArraySize(arr);
+                for (int i = 0; i < size; i++) {
+                    int v[7] = {0}; // stateMask 可省略
+                    if (!parse_int_tuple(cJSON_GetArrayItem(arr, i), 6, 7, v)) {
+                        snprintf(out_cmd->reason, sizeof(out_cmd->reason), "rule %d: expect 6-7 numbers", i);
+                        out_cmd->param.rules.count = 0;
+                        break;
+                    }
+                    out_cmd->param.rules.items[out_cmd->param.rules.count++] = (cmd_rule_t){
+                        .source = v[0], .op = v[1], .threshold = v[2], .hysteresis = v[3],
+                        .min_sec = v[4], .alert_code = v[5], .state_mask = v[6],
+                    };
+                }
+            }
+        }
+        if (out_cmd->method == CMD_METHOD_SET_CONFIG) {
+            cJSON *cfg = cJSON_GetObjectItem(param, "config");
+            cJSON *kv = NULL;
+            if (cfg && cJSON_IsObject(cfg)) {
+                cJSON_ArrayForEach(kv, cfg) {
+                    if (out_cmd->param.config.count >= CMD_CONFIG_MAX) break;
+                    if (!kv->string || (!cJSON_IsNumber(kv) && !cJSON_IsNull(kv))) continue;
+                    cmd_config_t *c = &out_cmd->param.config.items[out_cmd->param.config.count++];
+                    strncpy(c->key, kv->string, sizeof(c->key) - 1);
+                    c->reset = cJSON_IsNull(kv);
+                    c->value = c->reset ? 0 : kv->valueint;
+                }
+            }
+        }
+        if (out_cmd->method == CMD_METHOD_SET_SCHEDULE) {
+            out_cmd->param.schedule.reserve_min = -1;
+            out_cmd->param.schedule.early_wash_pct = -1;
+            if ((item = cJSON_GetObjectItem(param, "reserveMin")) != NULL && cJSON_IsNumber(item)) {
+                out_cmd->param.schedule.reserve_min = item->valueint;
+            }
+            if ((item = cJSON_GetObjectItem(param, "earlyWashPct")) != NULL && cJSON_IsNumber(item)) {
+                out_cmd->param.schedule.early_wash_pct = item->valueint;
+            }
+            // 计划整表替换，与告警规则相同：任一窗口格式错误或条数超限时整条指令失败
+            cJSON *arr = cJSON_GetObjectItem(param, "windows");
+            if (arr && !cJSON_IsArray(arr)) {
+                snprintf(out_cmd->reason, sizeof(out_cmd->reason), "windows must be an array");
+            } else if (arr && cJSON_GetArraySize(arr) > CMD_TOU_MAX) {
+                snprintf(out_cmd->reason, sizeof(out_cmd->reason), "too many windows (max %d)", CMD_TOU_MAX);
+            } else if (arr) {
+                int size = cJSON_GetArraySize(arr);
+                for (int i = 0; i < size; i++) {
+                    int v[4] = {0}; // dayMask 可省略
+                    if (!parse_int_tuple(cJSON_GetArrayItem(arr, i), 3, 4, v)) {
+                        snprintf(out_cmd->reason, sizeof(out_cmd->reason), "window %d: expect 3-4 numbers", i);
+                        out_cmd->param.schedule.count = 0;
+                        break;
+                    }
+                    out_cmd->param.schedule.items[out_cmd->param.schedule.count++] = (cmd_tou_window_t){
+                        .type = v[0], .start_min = v[1], .end_min = v[2], .day_mask = v[3],
+                    };
+                }
+            }
+        }
+        if (out_cmd->method == CMD_METHOD_SET_GROUP) {
+            if ((item = cJSON_GetObjectItem(param, "group")) != NULL && cJSON_IsString(item) &&
+                protocol_group_is_valid(item->valuestring)) {
+                strncpy(out_cmd->param.group, item->valuestring, sizeof(out_cmd->param.group) - 1);
+                out_cmd->has_group = true;
+            }
+        }
     }
 
 
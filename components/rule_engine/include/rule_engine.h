@@ -0,0 +1,61 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 规则数据源
+typedef enum {
+    RULE_SRC_TDS_IN  = 0, // 原水 TDS (ppm)，仅在有新快照时评估
+    RULE_SRC_TDS_OUT = 1, // 纯水 TDS (ppm)，同上
+    RULE_SRC_TEMP    = 2, // 水温 (0.1 ℃)
+    RULE_SRC_FLOW    = 3, // 流量 (mL/min，最近 60 秒脉冲的滑动平均)
+    RULE_SRC_PUMP    = 4, // 水泵电流 (mA)
+    RULE_SRC_MAX
+} rule_source_t;
+
+// 比较方式 (变化率按最近约 1 分钟的每分钟变化量计算)
+typedef enum {
+    RULE_OP_ABOVE = 0, // 值 > 阈值；回落到 阈值 - 回差 以下恢复
+    RULE_OP_BELOW = 1, // 值 < 阈值；回升到 阈值 + 回差 以上恢复
+    RULE_OP_RISE  = 2, // 每分钟上升 >= 阈值；上升率低于 阈值 - 回差 恢复
+    RULE_OP_FALL  = 3, // 每分钟下降 >= 阈值；下降率低于 阈值 - 回差 恢复
+    RULE_OP_MAX
+} rule_op_t;
+
+// 一次采样 (水机监控任务每秒采集)
+typedef struct {
+    int water_state;     // water_state_t
+    int64_t tds_us;      // TDS 快照时刻，与上次相同时不评估 TDS 规则
+    int tds_in;
+    int tds_out;
+    int temp_c10;
+    int flow_ml_min;
+    int pump_ma;
+} rule_sample_t;
+
+/**
+ * @brief 加载已保存的规则，未保存过时使用默认规则 (在 alert_manager_init 之后调用)
+ */
+esp_err_t rule_engine_init(void);
+
+/**
+ * @brief 按当前规则评估一次采样，条件成立/恢复时触发/清除对应告警
+ * 不分配内存，耗时与规则条数成正比
+ */
+void rule_engine_evaluate(const rule_sample_t *sample);
+
+/**
+ * @brief 整表替换规则并保存 (云端 SET_RULES)
+ * @param use_default true 恢复默认规则，忽略 items
+ * @return 任一规则字段越界时返回 ESP_ERR_INVALID_ARG，原规则保持不变
+ */
+esp_err_t rule_engine_set_rules(const cmd_rule_t *items, int count, bool use_default);
+
+#ifdef __cplusplus
+}
+#endif
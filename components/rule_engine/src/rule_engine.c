@@ -0,0 +1,239 @@
+// rule_engine.c 告警规则引擎
+// 每次采样按规则表逐条比较 (阈值 + 回差 + 最短持续时间，或每分钟变化率)，
+// 条件成立时触发告警、恢复时清除；多条规则指向同一告警时全部恢复才清除。
+// 规则由云端整表下发并紧凑保存，评估期间只访问静态数组
+#include "rule_engine.h"
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "app_storage.h"
+#include "alert_manager.h"
+#include "app_fsm.h"
+
+static const char *TAG = "RULES";
+
+#define RATE_WINDOW_SEC   60   // 变化率参考窗口
+#define ALERT_CODE_SLOTS  16   // 告警码引用计数 (alert_code_t 取值范围)
+
+// 水机状态位 (bit = water_state_t，与云端下发的 stateMask 一致)
+#define STATE_BIT(s)      (1u << (s))
+#define STATE_BIT_MAKING  STATE_BIT(WATER_STATE_MAKING)
+#define STATE_MASK_IDLE   (STATE_BIT(WATER_STATE_INIT) | STATE_BIT(WATER_STATE_FULL) | STATE_BIT(WATER_STATE_SHORTAGE) | \
+                           STATE_BIT(WATER_STATE_FAULT) | STATE_BIT(WATER_STATE_DEFERRED)) // 进水阀关闭的状态
+_Static_assert(WATER_STATE_MAX <= 8, "state_mask is 8 bits");
+
+// 默认规则 (未下发过规则或云端要求恢复默认时使用)
+static const alert_rule_t s_default_rules[] = {
+    // 制水时纯水 TDS 持续 1 分钟高于 100 ppm
+    { .source = RULE_SRC_TDS_OUT, .op = RULE_OP_ABOVE, .alert_code = ALERT_TDS_ERR,
+      .state_mask = STATE_BIT_MAKING, .threshold = 100, .hysteresis = 10, .min_sec = 60 },
+    // 水温高于 45 ℃ 或低于 2 ℃ 持续 30 秒
+    { .source = RULE_SRC_TEMP, .op = RULE_OP_ABOVE, .alert_code = ALERT_TEMP_ERR,
+      .state_mask = 0, .threshold = 450, .hysteresis = 20, .min_sec = 30 },
+    { .source = RULE_SRC_TEMP, .op = RULE_OP_BELOW, .alert_code = ALERT_TEMP_ERR,
+      .state_mask = 0, .threshold = 20, .hysteresis = 20, .min_sec = 30 },
+    // 进水阀关闭时仍有流量 (60 秒平均超过 30 mL/min 持续 30 秒，窗口内无脉冲才恢复)
+    { .source = RULE_SRC_FLOW, .op = RULE_OP_ABOVE, .alert_code = ALERT_LEAKAGE,
+      .state_mask = STATE_MASK_IDLE, .threshold = 30, .hysteresis = 30, .min_sec = 30 },
+};
+
+// 每条规则的运行状态
+typedef struct {
+    bool active;
+    uint32_t since;      // 条件首次成立的开机秒数，0 = 未成立
+} rule_rt_t;
+
+// 每个数据源的变化率参考点
+typedef struct {
+    bool has_ref;
+    int ref_value;
+    uint32_t ref_sec;
+    bool has_rate;
+    int rate;            // 每分钟变化量
+} rule_rate_t;
+
+static SemaphoreHandle_t s_lock = NULL;
+static rule_store_t s_store;
+static rule_rt_t s_rt[ALERT_RULE_MAX];
+static rule_rate_t s_rate[RULE_SRC_MAX];
+static uint8_t s_code_refs[ALERT_CODE_SLOTS]; // 每个告警码处于触发状态的规则数
+static int64_t s_tds_seen_us = 0;
+
+static void load_defaults(rule_store_t *store) {
+    memset(store, 0, sizeof(*store));
+    store->count = sizeof(s_default_rules) / sizeof(s_default_rules[0]);
+    memcpy(store->rules, s_default_rules, sizeof(s_default_rules));
+}
+
+// 替换规则表时释放仍处于触发状态的规则 (持锁调用)
+static void release_active_locked(void) {
+    for (int i = 0; i < s_store.count; i++) {
+        if (s_rt[i].active) {
+            uint8_t code = s_store.rules[i].alert_code;
+            if (s_code_refs[code] > 0 && --s_code_refs[code] == 0) {
+                alert_manager_clear(code);
+            }
+        }
+    }
+    memset(s_rt, 0, sizeof(s_rt));
+}
+
+esp_err_t rule_engine_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    if (!s_lock) return ESP_ERR_NO_MEM;
+
+    if (app_storage_load_rules(&s_store) != ESP_OK) {
+        load_defaults(&s_store);
+    }
+    // 重启前保存的规则在当前版本中越界时整表回退默认
+    for (int i = 0; i < s_store.count; i++) {
+        const alert_rule_t *r = &s_store.rules[i];
+        if (r->source >= RULE_SRC_MAX || r->op >= RULE_OP_MAX || r->alert_code >= ALERT_CODE_SLOTS) {
+            load_defaults(&s_store);
+            break;
+        }
+    }
+    ESP_LOGI(TAG, "%d alert rules loaded", s_store.count);
+    return ESP_OK;
+}
+
+// 更新数据源的变化率 (参考点至少间隔 RATE_WINDOW_SEC 才前移)
+static void update_rate(int src, int value, uint32_t now) {
+    rule_rate_t *r = &s_rate[src];
+    if (!r->has_ref) {
+        r->has_ref = true;
+        r->ref_value = value;
+        r->ref_sec = now;
+        return;
+    }
+    uint32_t dt = now - r->ref_sec;
+    if (dt < RATE_WINDOW_SEC) return;
+    r->rate = (int)((int64_t)(value - r->ref_value) * 60 / dt);
+    r->has_rate = true;
+    r->ref_value = value;
+    r->ref_sec = now;
+}
+
+void rule_engine_evaluate(const rule_sample_t *sample) {
+    if (!s_lock || !sample) return;
+    uint32_t now = (uint32_t)(esp_timer_get_time() / 1000000) + 1; // 从 1 开始，0 留作“未成立”
+
+    int values[RULE_SRC_MAX];
+    bool present[RULE_SRC_MAX];
+    bool new_tds = (sample->tds_us != 0 && sample->tds_us != s_tds_seen_us);
+    if (new_tds) s_tds_seen_us = sample->tds_us;
+    values[RULE_SRC_TDS_IN] = sample->tds_in;
+    values[RULE_SRC_TDS_OUT] = sample->tds_out;
+    values[RULE_SRC_TEMP] = sample->temp_c10;
+    values[RULE_SRC_FLOW] = sample->flow_ml_min;
+    values[RULE_SRC_PUMP] = sample->pump_ma;
+    for (int s = 0; s < RULE_SRC_MAX; s++) {
+        present[s] = (s == RULE_SRC_TDS_IN || s == RULE_SRC_TDS_OUT) ? new_tds : true;
+        if (present[s]) update_rate(s, values[s], now);
+    }
+    uint8_t state_bit = (sample->water_state >= 0 && sample->water_state < WATER_STATE_MAX) ? STATE_BIT(sample->water_state) : 0;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < s_store.count; i++) {
+        const alert_rule_t *r = &s_store.rules[i];
+        rule_rt_t *rt = &s_rt[i];
+        if (!present[r->source]) continue;
+        // 不在生效状态时冻结 (已触发的保持，未触发的重新计时)
+        if (r->state_mask && !(r->state_mask & state_bit)) {
+            rt->since = 0;
+            continue;
+        }
+
+        int v = values[r->source];
+        int th = r->threshold;
+        int back = th - (int)r->hysteresis;
+        bool enter = false, hold = false;
+        switch (r->op) {
+            case RULE_OP_ABOVE:
+                enter = v > th;
+                hold = v > back;
+                break;
+            case RULE_OP_BELOW:
+                enter = v < th;
+                hold = v < th + (int)r->hysteresis;
+                break;
+            case RULE_OP_RISE:
+            case RULE_OP_FALL:
+                if (!s_rate[r->source].has_rate) continue;
+                v = (r->op == RULE_OP_RISE) ? s_rate[r->source].rate : -s_rate[r->source].rate;
+                enter = v >= th;
+                hold = v >= back;
+                break;
+            default:
+                continue;
+        }
+
+        if (!rt->active) {
+            if (!enter) {
+                rt->since = 0;
+                continue;
+            }
+            if (rt->since == 0) rt->since = now;
+            if (now - rt->since >= r->min_sec) {
+                rt->active = true;
+                if (s_code_refs[r->alert_code]++ == 0) {
+                    ESP_LOGW(TAG, "Rule %d hit (source %d = %d), alert %d", i, r->source, v, r->alert_code);
+                    alert_manager_raise(r->alert_code);
+                }
+            }
+        } else if (!hold) {
+            rt->active = false;
+            rt->since = 0;
+            if (s_code_refs[r->alert_code] > 0 && --s_code_refs[r->alert_code] == 0) {
+                alert_manager_clear(r->alert_code);
+            }
+        }
+    }
+    xSemaphoreGive(s_lock);
+}
+
+esp_err_t rule_engine_set_rules(const cmd_rule_t *items, int count, bool use_default) {
+    if (!s_lock) return ESP_ERR_INVALID_STATE;
+    if (!use_default && (count < 0 || count > ALERT_RULE_MAX || (count > 0 && !items))) return ESP_ERR_INVALID_ARG;
+
+    rule_store_t store;
+    if (use_default) {
+        load_defaults(&store);
+    } else {
+        memset(&store, 0, sizeof(store));
+        for (int i = 0; i < count; i++) {
+            const cmd_rule_t *c = &items[i];
+            if (c->source < 0 || c->source >= RULE_SRC_MAX || c->op < 0 || c->op >= RULE_OP_MAX ||
+                c->alert_code < 0 || c->alert_code >= ALERT_CODE_SLOTS ||
+                c->threshold < INT16_MIN || c->threshold > INT16_MAX ||
+                c->hysteresis < 0 || c->hysteresis > UINT16_MAX ||
+                c->min_sec < 0 || c->min_sec > UINT16_MAX ||
+                c->state_mask < 0 || c->state_mask > UINT8_MAX) {
+                ESP_LOGW(TAG, "Rule %d rejected", i);
+                return ESP_ERR_INVALID_ARG;
+            }
+            store.rules[i] = (alert_rule_t){
+                .source = (uint8_t)c->source,
+                .op = (uint8_t)c->op,
+                .alert_code = (uint8_t)c->alert_code,
+                .state_mask = (uint8_t)c->state_mask,
+                .threshold = (int16_t)c->threshold,
+                .hysteresis = (uint16_t)c->hysteresis,
+                .min_sec = (uint16_t)c->min_sec,
+            };
+        }
+        store.count = (uint8_t)count;
+    }
+
+    esp_err_t err = app_storage_save_rules(&store);
+    if (err != ESP_OK) return err;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    release_active_locked();
+    s_store = store;
+    xSemaphoreGive(s_lock);
+    ESP_LOGI(TAG, "%d alert rules applied%s", store.count, use_default ? " (default)" : "");
+    return ESP_OK;
+}
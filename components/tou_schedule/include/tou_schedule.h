@@ -0,0 +1,69 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 时段类型 (多个窗口重叠时 禁止 > 优先 > 允许)
+typedef enum {
+    TOU_ALLOWED   = 0, // 允许制水；只要配置了允许窗口，其余未覆盖的时段视为禁止
+    TOU_PREFERRED = 1, // 优先 (低谷电价)：正常制水，冲洗提前到此时段
+    TOU_FORBIDDEN = 2, // 禁止 (高峰电价)：推迟制水与定期冲洗
+    TOU_MAX
+} tou_window_t;
+
+/**
+ * @brief 加载已保存的计划 (在 app_storage_init 之后调用)
+ * 未配置计划或尚未对时期间始终视为允许时段，行为与未启用分时相同
+ */
+esp_err_t tou_schedule_init(void);
+
+/**
+ * @brief 当前所处时段 (按 time_manager 设置的当地时间)
+ */
+tou_window_t tou_schedule_window(void);
+
+/**
+ * @brief 是否推迟本次制水
+ * @param demand_sec 水桶离开水满状态的时长；达到保底时长 (reserveMin) 后不再推迟，保证不会缺水
+ * @return true 推迟 (处于禁止时段)
+ */
+bool tou_schedule_hold_making(uint32_t demand_sec);
+
+/**
+ * @brief 推迟期间水桶已满或不再需要制水 (不计入移出的能耗)
+ */
+void tou_schedule_cancel_hold(void);
+
+/**
+ * @brief 定期冲洗是否到期 (替代 since_wash_sec >= interval_sec 的判断)
+ * 优先时段内提前到期，禁止时段内最多推迟一个间隔
+ */
+bool tou_schedule_wash_due(uint32_t since_wash_sec, uint32_t interval_sec);
+
+/**
+ * @brief 每秒调用：按水机状态累计被移出禁止时段的水泵能耗
+ * @param making 处于制水状态
+ * @param washing 处于冲洗状态
+ */
+void tou_schedule_tick(bool making, bool washing, uint32_t energy_mj);
+
+/**
+ * @brief 整表替换计划并保存 (云端 SET_SCHEDULE)，count 为 0 取消计划
+ * 窗口的 start_min 等于 end_min 时覆盖整天 (从 start_min 起 24 小时)
+ * @return 任一窗口字段越界时返回 ESP_ERR_INVALID_ARG，原计划保持不变
+ */
+esp_err_t tou_schedule_set(const cmd_tou_window_t *items, int count, int reserve_min, int early_wash_pct);
+
+/**
+ * @brief 填充发布指标中的分时统计字段
+ */
+void tou_schedule_get_metrics(metrics_report_t *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,214 @@
+// tou_schedule.c 分时制水计划
+// 云端下发允许/优先/禁止时段，按当地时间判断：禁止时段推迟制水与定期冲洗，
+// 优先时段提前冲洗。设备只有水满压力开关、没有液位计，“最低水位”以水桶离开水满后
+// 的时长近似：超过保底时长即使仍在禁止时段也恢复制水
+#include "tou_schedule.h"
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "app_storage.h"
+#include "time_manager.h"
+
+static const char *TAG = "TOU";
+
+#define TOU_RESERVE_MIN_DEFAULT     20   // 水桶未满最多推迟 20 分钟 (未下发 reserveMin 时，宁可多用峰电也不让用户等水)
+#define TOU_RESERVE_MIN_MAX         720
+#define TOU_EARLY_WASH_PCT_DEFAULT  75
+#define MINUTES_PER_DAY             1440
+
+static SemaphoreHandle_t s_lock = NULL;
+static tou_store_t s_store;
+
+static bool s_holding = false;       // 正在推迟制水
+static bool s_make_shifted = false;  // 本次制水 (含前置冲洗) 由禁止时段推迟而来
+static bool s_wash_held = false;     // 定期冲洗到期时处于禁止时段
+static bool s_wash_shifted = false;  // 本次冲洗被提前或推迟
+static bool s_prev_making = false;
+static bool s_prev_washing = false;
+
+// 开机以来的统计
+static uint32_t s_deferrals = 0;
+static uint32_t s_forced = 0;
+static uint32_t s_wash_moved = 0;
+static uint64_t s_shifted_mj = 0;
+
+esp_err_t tou_schedule_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    if (!s_lock) return ESP_ERR_NO_MEM;
+
+    if (app_storage_load_tou(&s_store) != ESP_OK) {
+        memset(&s_store, 0, sizeof(s_store));
+    }
+    ESP_LOGI(TAG, "%d schedule windows loaded (reserve %umin)", s_store.count, s_store.reserve_min);
+    return ESP_OK;
+}
+
+// 窗口是否覆盖当地某一分钟 (跨零点的窗口，零点之后的部分按前一天判断星期；
+// start_min == end_min 为从 start_min 起的整 24 小时，start_min 为 0 时即整天)
+static bool window_covers(const tou_window_rec_t *w, int wday, int minute) {
+    int day = wday;
+    if (w->start_min < w->end_min) {
+        if (minute < w->start_min || minute >= w->end_min) return false;
+    } else if (minute >= w->start_min) {
+        // 跨零点窗口的前半段
+    } else if (minute < w->end_min) {
+        day = (wday + 6) % 7;
+    } else {
+        return false;
+    }
+    return w->day_mask == 0 || (w->day_mask & (1 << day));
+}
+
+// 持锁调用
+static tou_window_t window_locked(void) {
+    if (s_store.count == 0 || !time_manager_is_synced()) return TOU_ALLOWED;
+
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    int minute = tm.tm_hour * 60 + tm.tm_min;
+
+    bool has_allowed = false;
+    int best = -1;
+    for (int i = 0; i < s_store.count; i++) {
+        const tou_window_rec_t *w = &s_store.windows[i];
+        if (w->type == TOU_ALLOWED) has_allowed = true;
+        if (window_covers(w, tm.tm_wday, minute) && (int)w->type > best) best = w->type;
+    }
+    if (best >= 0) return (tou_window_t)best;
+    return has_allowed ? TOU_FORBIDDEN : TOU_ALLOWED;
+}
+
+tou_window_t tou_schedule_window(void) {
+    if (!s_lock) return TOU_ALLOWED;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    tou_window_t w = window_locked();
+    xSemaphoreGive(s_lock);
+    return w;
+}
+
+bool tou_schedule_hold_making(uint32_t demand_sec) {
+    if (!s_lock) return false;
+    bool hold = false;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    tou_window_t w = window_locked();
+    if (w != TOU_FORBIDDEN) {
+        if (s_holding) {
+            s_holding = false;
+            s_make_shifted = true;
+            ESP_LOGI(TAG, "Forbidden window over, production released after %lus", (unsigned long)demand_sec);
+        }
+    } else if (demand_sec >= (uint32_t)s_store.reserve_min * 60) {
+        if (s_holding) {
+            s_holding = false;
+            s_forced++;
+            ESP_LOGW(TAG, "Reserve time reached, production forced in forbidden window");
+        }
+    } else {
+        if (!s_holding) {
+            s_holding = true;
+            s_deferrals++;
+            ESP_LOGI(TAG, "Forbidden window, production deferred");
+        }
+        hold = true;
+    }
+    xSemaphoreGive(s_lock);
+    return hold;
+}
+
+void tou_schedule_cancel_hold(void) {
+    if (!s_lock) return;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_holding = false;
+    xSemaphoreGive(s_lock);
+}
+
+bool tou_schedule_wash_due(uint32_t since_wash_sec, uint32_t interval_sec) {
+    if (!s_lock) return since_wash_sec >= interval_sec;
+    bool due;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    tou_window_t w = window_locked();
+    if (w == TOU_FORBIDDEN) {
+        // 禁止时段最多推迟一个间隔，长时间不冲洗同样伤膜
+        due = since_wash_sec >= interval_sec * 2;
+        if (!due && since_wash_sec >= interval_sec) s_wash_held = true;
+    } else if (w == TOU_PREFERRED) {
+        due = since_wash_sec >= (uint32_t)((uint64_t)interval_sec * s_store.early_wash_pct / 100);
+    } else {
+        due = since_wash_sec >= interval_sec;
+    }
+    if (due && !s_wash_shifted && (since_wash_sec < interval_sec || (s_wash_held && w != TOU_FORBIDDEN))) {
+        s_wash_shifted = true;
+        s_wash_moved++;
+    }
+    if (due) s_wash_held = false;
+    xSemaphoreGive(s_lock);
+    return due;
+}
+
+void tou_schedule_tick(bool making, bool washing, uint32_t energy_mj) {
+    if (!s_lock) return;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if ((making || washing) && (s_make_shifted || (s_wash_shifted && washing))) {
+        s_shifted_mj += energy_mj;
+    }
+    if (s_prev_making && !making) s_make_shifted = false;
+    if (s_prev_washing && !washing) s_wash_shifted = false;
+    s_prev_making = making;
+    s_prev_washing = washing;
+    xSemaphoreGive(s_lock);
+}
+
+esp_err_t tou_schedule_set(const cmd_tou_window_t *items, int count, int reserve_min, int early_wash_pct) {
+    if (!s_lock) return ESP_ERR_INVALID_STATE;
+    if (count < 0 || count > TOU_WINDOW_MAX || (count > 0 && !items)) return ESP_ERR_INVALID_ARG;
+    if (reserve_min < 0) reserve_min = TOU_RESERVE_MIN_DEFAULT;
+    if (early_wash_pct < 0) early_wash_pct = TOU_EARLY_WASH_PCT_DEFAULT;
+    if (reserve_min > TOU_RESERVE_MIN_MAX || early_wash_pct < 10 || early_wash_pct > 100) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    tou_store_t store;
+    memset(&store, 0, sizeof(store));
+    for (int i = 0; i < count; i++) {
+        const cmd_tou_window_t *c = &items[i];
+        if (c->type < 0 || c->type >= TOU_MAX ||
+            c->start_min < 0 || c->start_min >= MINUTES_PER_DAY ||
+            c->end_min < 0 || c->end_min >= MINUTES_PER_DAY ||
+            c->day_mask < 0 || c->day_mask > 0x7F) {
+            ESP_LOGW(TAG, "Window %d rejected", i);
+            return ESP_ERR_INVALID_ARG;
+        }
+        store.windows[i] = (tou_window_rec_t){
+            .type = (uint8_t)c->type,
+            .day_mask = (uint8_t)c->day_mask,
+            .start_min = (uint16_t)c->start_min,
+            .end_min = (uint16_t)c->end_min,
+        };
+    }
+    store.count = (uint8_t)count;
+    store.reserve_min = (uint16_t)reserve_min;
+    store.early_wash_pct = (uint8_t)early_wash_pct;
+
+    esp_err_t err = app_storage_save_tou(&store);
+    if (err != ESP_OK) return err;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_store = store;
+    xSemaphoreGive(s_lock);
+    ESP_LOGI(TAG, "%d schedule windows applied (reserve %dmin, early wash %d%%)", count, reserve_min, early_wash_pct);
+    return ESP_OK;
+}
+
+void tou_schedule_get_metrics(metrics_report_t *out) {
+    if (!out || !s_lock) return;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    out->tou_enabled = (s_store.count > 0) || s_shifted_mj > 0;
+    out->tou_deferrals = s_deferrals;
+    out->tou_forced = s_forced;
+    out->tou_wash_moved = s_wash_moved;
+    out->tou_shifted_mwh = (uint32_t)(s_shifted_mj / 3600);
+    xSemaphoreGive(s_lock);
+}
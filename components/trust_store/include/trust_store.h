@@ -0,0 +1,29 @@
+#pragma once
+#include "esp_err.h"
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief 从 NVS 加载预置的 CA 证书链与 SPKI 指纹 (在 app_storage_init 之后调用)
+ * CA 与指纹由出厂 NVS 镜像写入 (见 tools/README.md)；未预置 CA 时保持空，TLS 连接回退到 esp_crt_bundle
+ */
+esp_err_t trust_store_init(void);
+
+/**
+ * @brief 是否已加载预置 CA (true = 使用私有 CA，false = 使用完整证书包)
+ */
+bool trust_store_has_ca(void);
+
+/**
+ * @brief 供 esp-tls 使用的证书挂载回调 (填入 crt_bundle_attach)
+ * 有预置 CA 时只信任该 CA 链，并可选做 SPKI 指纹校验；否则回退到 esp_crt_bundle_attach
+ * @param conf mbedtls_ssl_config 指针
+ */
+esp_err_t trust_store_attach(void *conf);
+
+#ifdef __cplusplus
+}
+#endif
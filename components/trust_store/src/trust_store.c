@@ -0,0 +1,94 @@
+// trust_store.c 私有 CA / SPKI 指纹校验
+// 设备只连接自家 Broker 与 OTA 服务器，预置 CA 后不再遍历整个公共证书包
+#include "trust_store.h"
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_crt_bundle.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/sha256.h"
+#include "app_storage.h"
+
+static const char *TAG = "TRUST";
+
+static mbedtls_x509_crt s_ca_chain;
+static bool s_ca_loaded = false;
+
+static uint8_t s_pins[TLS_PIN_MAX][TLS_PIN_LEN];
+static size_t s_pin_count = 0;
+
+// 计算证书公钥 (SubjectPublicKeyInfo DER) 的 SHA-256，并与指纹表比对
+static bool crt_matches_pin(const mbedtls_x509_crt *crt) {
+    uint8_t hash[TLS_PIN_LEN];
+    if (mbedtls_sha256(crt->pk_raw.p, crt->pk_raw.len, hash, 0) != 0) return false;
+    for (size_t i = 0; i < s_pin_count; i++) {
+        if (memcmp(hash, s_pins[i], TLS_PIN_LEN) == 0) return true;
+    }
+    return false;
+}
+
+// mbedtls 按 根 -> 叶子 的顺序回调，depth=0 为服务器证书，此时检查服务器下发的整条链
+static int pin_verify_cb(void *ctx, mbedtls_x509_crt *crt, int depth, uint32_t *flags) {
+    (void)ctx;
+    if (depth != 0 || s_pin_count == 0) return 0;
+
+    for (const mbedtls_x509_crt *c = crt; c != NULL; c = c->next) {
+        if (crt_matches_pin(c)) return 0;
+    }
+    ESP_LOGE(TAG, "SPKI 指纹不匹配，拒绝连接");
+    *flags |= MBEDTLS_X509_BADCERT_NOT_TRUSTED;
+    return 0;
+}
+
+esp_err_t trust_store_init(void) {
+    if (s_ca_loaded) return ESP_OK;
+
+    size_t len = 0;
+    if (app_storage_get_tls_ca(NULL, &len) != ESP_OK || len == 0) {
+        ESP_LOGI(TAG, "未预置私有 CA，TLS 使用内置证书包");
+        return ESP_OK;
+    }
+
+    char *pem = malloc(len);
+    if (!pem) return ESP_ERR_NO_MEM;
+    esp_err_t err = app_storage_get_tls_ca(pem, &len);
+    if (err != ESP_OK) {
+        free(pem);
+        return err;
+    }
+
+    // mbedtls 解析 PEM 要求长度包含结尾 '\0'
+    mbedtls_x509_crt_init(&s_ca_chain);
+    int ret = mbedtls_x509_crt_parse(&s_ca_chain, (const unsigned char *)pem, len);
+    free(pem);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "私有 CA 解析失败 (-0x%x)，回退到内置证书包", -ret);
+        mbedtls_x509_crt_free(&s_ca_chain);
+        return ESP_FAIL;
+    }
+    s_ca_loaded = true;
+
+    if (app_storage_get_tls_pins(s_pins, TLS_PIN_MAX, &s_pin_count) != ESP_OK) {
+        s_pin_count = 0;
+    }
+    ESP_LOGI(TAG, "已加载私有 CA，SPKI 指纹 %u 个", (unsigned)s_pin_count);
+    return ESP_OK;
+}
+
+bool trust_store_has_ca(void) {
+    return s_ca_loaded;
+}
+
+esp_err_t trust_store_attach(void *conf) {
+    if (!s_ca_loaded) {
+        return esp_crt_bundle_attach(conf);
+    }
+    mbedtls_ssl_config *ssl_conf = (mbedtls_ssl_config *)conf;
+    mbedtls_ssl_conf_authmode(ssl_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_ca_chain(ssl_conf, &s_ca_chain, NULL);
+    if (s_pin_count > 0) {
+        mbedtls_ssl_conf_verify(ssl_conf, pin_verify_cb, NULL);
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include <stddef.h>
+#include "protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 运行参数 (默认值与取值范围见 tunables.c，云端可按名称覆盖)
+typedef enum {
+    TUN_PULSES_PER_L = 0,  // pulsesPerL   流量计每升脉冲数
+    TUN_WASH_SEC,          // washSec      单次冲洗时长 (秒)
+    TUN_IDLE_WASH_SEC,     // idleWashSec  待机/运行自动冲洗间隔 (秒)
+    TUN_MAKING_MAX_SEC,    // makeMaxSec   连续制水超时保护 (秒)
+    TUN_MAINT_WASH_SEC,    // maintWashSec 累计制水维护冲洗 (秒)
+    TUN_FAULT_REST_SEC,    // faultRestSec 故障停机后自动恢复 (秒)
+    TUN_PUMP_SPEC_MA,      // pumpSpecMa   100G/400G 水泵识别分界 (mA)
+    TUN_PUMP_100G_MA,      // pump100gMa   100G 水泵过流阈值 (mA)
+    TUN_PUMP_400G_MA,      // pump400gMa   400G 水泵过流阈值 (mA)
+    TUN_PUMP_DRY_MA,       // pumpDryMa    空转阈值 (mA)
+    TUN_REPORT_SEC,        // reportSec    制水期间日志上报间隔 (秒)
+    TUN_IDLE_HB_SEC,       // idleHbSec    空闲时日志心跳间隔 (秒)
+    TUN_LED_FRAME_MS,      // ledFrameMs   面板动画帧间隔 (毫秒)
+    TUN_OTA_RATE_KBPS,     // otaRateKBps  固件下载限速 (KB/s，制水期间减半)
+    TUN_MAX
+} tunable_id_t;
+
+// 当前值缓存，只由 tunables.c 写入 (32 位对齐读写为原子操作，读取方无需加锁)
+extern volatile int32_t tunables_cache[TUN_MAX];
+
+// 读取运行参数 (热路径上只是一次内存读取)
+static inline int32_t tunable(tunable_id_t id) {
+    return tunables_cache[id];
+}
+
+/**
+ * @brief 加载云端覆盖值 (在 app_storage_init 之后、各业务模块启动之前调用)
+ */
+esp_err_t tunables_init(void);
+
+/**
+ * @brief 批量修改运行参数 (云端 SET_CONFIG)
+ * 任一参数名未知、越界，或合并后的参数集不满足跨参数约束时整批拒绝 (ESP_ERR_NOT_FOUND / ESP_ERR_INVALID_ARG)，
+ * 拒绝原因写入 reason (可为 NULL)
+ */
+esp_err_t tunables_set(const cmd_config_t *items, int count, char *reason, size_t reason_len);
+
+/**
+ * @brief 发布全部运行参数的当前值、默认值与范围 (云端 GET_CONFIG)
+ */
+esp_err_t tunables_report(const char *cmd_id);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,172 @@
+// tunables.c 运行参数注册表
+// 各业务模块的运行常量集中定义默认值与取值范围，云端按名称覆盖后写入 NVS，
+// 重启时加载；读取方通过 tunable() 直接访问缓存数组
+#include "tunables.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include "esp_log.h"
+#include "app_storage.h"
+#include "mqtt_manager.h"
+
+static const char *TAG = "TUNE";
+
+typedef struct {
+    const char *key;     // 云端参数名，同时作为 NVS 键 (最长 15 字符)
+    int32_t def;
+    int32_t min;
+    int32_t max;
+} tunable_def_t;
+
+static const tunable_def_t s_defs[TUN_MAX] = {
+    [TUN_PULSES_PER_L]   = {"pulsesPerL",   450,       100,       5000},
+    [TUN_WASH_SEC]       = {"washSec",      18,        5,         300},
+    [TUN_IDLE_WASH_SEC]  = {"idleWashSec",  6 * 3600,  30 * 60,   24 * 3600},
+    [TUN_MAKING_MAX_SEC] = {"makeMaxSec",   6 * 3600,  30 * 60,   12 * 3600},
+    [TUN_MAINT_WASH_SEC] = {"maintWashSec", 2 * 3600,  30 * 60,   12 * 3600},
+    [TUN_FAULT_REST_SEC] = {"faultRestSec", 30 * 60,   60,        2 * 3600},
+    [TUN_PUMP_SPEC_MA]   = {"pumpSpecMa",   1800,      500,       5000},
+    [TUN_PUMP_100G_MA]   = {"pump100gMa",   2000,      500,       6000},
+    [TUN_PUMP_400G_MA]   = {"pump400gMa",   3000,      500,       6000},
+    [TUN_PUMP_DRY_MA]    = {"pumpDryMa",    500,       0,         3000},
+    [TUN_REPORT_SEC]     = {"reportSec",    60,        10,        3600},
+    [TUN_IDLE_HB_SEC]    = {"idleHbSec",    6 * 3600,  300,       24 * 3600},
+    [TUN_LED_FRAME_MS]   = {"ledFrameMs",   150,       50,        1000},
+    [TUN_OTA_RATE_KBPS]  = {"otaRateKBps",  32,        4,         1024},
+};
+
+// 跨参数约束：合并后的参数集须满足 lo < hi (strict) 或 lo <= hi
+typedef struct {
+    tunable_id_t lo;
+    tunable_id_t hi;
+    bool strict;
+} tunable_rule_t;
+
+static const tunable_rule_t s_rules[] = {
+    {TUN_PUMP_DRY_MA,    TUN_PUMP_SPEC_MA,   true},  // 空转阈值低于识别分界，否则 100G 水泵正常运行也判空转
+    {TUN_PUMP_SPEC_MA,   TUN_PUMP_100G_MA,   false}, // 识别为 100G 的电流不能已超过其过流阈值
+    {TUN_PUMP_100G_MA,   TUN_PUMP_400G_MA,   false},
+    {TUN_WASH_SEC,       TUN_IDLE_WASH_SEC,  true},  // 冲洗时长短于自动冲洗间隔
+    {TUN_MAINT_WASH_SEC, TUN_MAKING_MAX_SEC, true},  // 维护冲洗先于连续制水超时保护
+};
+
+volatile int32_t tunables_cache[TUN_MAX];
+
+static int find_key(const char *key) {
+    for (int i = 0; i < TUN_MAX; i++) {
+        if (strcmp(s_defs[i].key, key) == 0) return i;
+    }
+    return -1;
+}
+
+// 检查参数集的跨参数约束，返回第一条不满足的约束，全部满足时返回 NULL
+static const tunable_rule_t *check_rules(const int32_t *v) {
+    for (size_t i = 0; i < sizeof(s_rules) / sizeof(s_rules[0]); i++) {
+        const tunable_rule_t *r = &s_rules[i];
+        if (r->strict ? (v[r->lo] >= v[r->hi]) : (v[r->lo] > v[r->hi])) return r;
+    }
+    return NULL;
+}
+
+esp_err_t tunables_init(void) {
+    int overridden = 0;
+    for (int i = 0; i < TUN_MAX; i++) {
+        int32_t v = s_defs[i].def;
+        int32_t saved;
+        // 保存值超出当前固件的范围时忽略 (范围随固件收紧的情况)
+        if (app_storage_get_tunable(s_defs[i].key, &saved) == ESP_OK &&
+            saved >= s_defs[i].min && saved <= s_defs[i].max) {
+            v = saved;
+            if (v != s_defs[i].def) overridden++;
+        }
+        tunables_cache[i] = v;
+    }
+    // 保存值的组合不满足当前固件的约束时 (约束随固件新增的情况) 全部使用默认值
+    int32_t v[TUN_MAX];
+    for (int i = 0; i < TUN_MAX; i++) v[i] = tunables_cache[i];
+    const tunable_rule_t *r = check_rules(v);
+    if (r) {
+        ESP_LOGW(TAG, "Saved tunables violate %s %s %s, using defaults", s_defs[r->lo].key,
+                 r->strict ? "<" : "<=", s_defs[r->hi].key);
+        for (int i = 0; i < TUN_MAX; i++) tunables_cache[i] = s_defs[i].def;
+        overridden = 0;
+    }
+    ESP_LOGI(TAG, "%d tunables loaded, %d overridden", TUN_MAX, overridden);
+    return ESP_OK;
+}
+
+esp_err_t tunables_set(const cmd_config_t *items, int count, char *reason, size_t reason_len) {
+    char dummy[1];
+    if (!reason || reason_len == 0) {
+        reason = dummy;
+        reason_len = sizeof(dummy);
+    }
+    reason[0] = '\0';
+    if (!items || count <= 0 || count > CMD_CONFIG_MAX) {
+        snprintf(reason, reason_len, "config must have 1..%d items", CMD_CONFIG_MAX);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // 先整批校验 (单项范围 + 合并后的跨参数约束)，避免只生效一半
+    int ids[CMD_CONFIG_MAX];
+    int32_t merged[TUN_MAX];
+    for (int i = 0; i < TUN_MAX; i++) merged[i] = tunables_cache[i];
+    for (int i = 0; i < count; i++) {
+        ids[i] = find_key(items[i].key);
+        if (ids[i] < 0) {
+            ESP_LOGW(TAG, "Unknown tunable '%s'", items[i].key);
+            snprintf(reason, reason_len, "unknown key %s", items[i].key);
+            return ESP_ERR_NOT_FOUND;
+        }
+        const tunable_def_t *d = &s_defs[ids[i]];
+        if (!items[i].reset && (items[i].value < d->min || items[i].value > d->max)) {
+            ESP_LOGW(TAG, "Tunable %s=%d out of range [%ld, %ld]", d->key, items[i].value,
+                     (long)d->min, (long)d->max);
+            snprintf(reason, reason_len, "%s out of range [%ld, %ld]", d->key, (long)d->min, (long)d->max);
+            return ESP_ERR_INVALID_ARG;
+        }
+        merged[ids[i]] = items[i].reset ? d->def : (int32_t)items[i].value;
+    }
+    const tunable_rule_t *r = check_rules(merged);
+    if (r) {
+        const char *op = r->strict ? "<" : "<=";
+        ESP_LOGW(TAG, "Tunables rejected: %s=%ld %s %s=%ld required", s_defs[r->lo].key, (long)merged[r->lo], op,
+                 s_defs[r->hi].key, (long)merged[r->hi]);
+        snprintf(reason, reason_len, "%s must be %s %s", s_defs[r->lo].key, op, s_defs[r->hi].key);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const tunable_def_t *d = &s_defs[ids[i]];
+        int32_t v = merged[ids[i]];
+        esp_err_t err = app_storage_set_tunable(d->key, items[i].reset ? NULL : &v);
+        if (err != ESP_OK) {
+            snprintf(reason, reason_len, "storage error %d", err);
+            return err;
+        }
+        tunables_cache[ids[i]] = v;
+        ESP_LOGI(TAG, "Tunable %s = %ld%s", d->key, (long)v, items[i].reset ? " (default)" : "");
+    }
+    return ESP_OK;
+}
+
+esp_err_t tunables_report(const char *cmd_id) {
+    config_report_t *report = calloc(1, sizeof(config_report_t));
+    if (!report) return ESP_ERR_NO_MEM;
+    if (cmd_id) strncpy(report->cmd_id, cmd_id, sizeof(report->cmd_id) - 1);
+
+    for (int i = 0; i < TUN_MAX && i < CONFIG_REPORT_MAX; i++) {
+        report->items[i] = (config_item_t){
+            .key = s_defs[i].key,
+            .value = tunables_cache[i],
+            .def = s_defs[i].def,
+            .min = s_defs[i].min,
+            .max = s_defs[i].max,
+        };
+        report->count++;
+    }
+    esp_err_t err = mqtt_manager_publish_config(report);
+    free(report);
+    return err;
+}
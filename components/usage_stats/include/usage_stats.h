@@ -0,0 +1,70 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 每秒的运行数据 (由水机监控任务采集)
+typedef struct {
+    bool making;          // 本秒处于制水状态
+    uint32_t making_ml;   // 本秒制水量 (毫升)
+    uint32_t wash_ml;     // 本秒冲洗用水量 (毫升)
+    uint32_t energy_mj;   // 本秒水泵能耗 (毫焦)，未运行为 0
+} usage_tick_t;
+
+// 一次制水会话的能耗评估
+typedef struct {
+    uint32_t mwh_per_l;      // 本次会话单位产水能耗 (mWh/L)，水量不足 1 升时为 0
+    uint32_t base_mwh_per_l; // 长期基线 (前若干次会话建立)，未建立时为 0
+    int drift_pct;           // 近期均值相对基线的漂移 (%)
+    bool drift_alert;        // 本次会话使漂移首次超过告警阈值
+    bool drift_clear;        // 本次会话使漂移回落到恢复阈值以下
+    uint32_t day_wh;         // 当天累计 (Wh)
+    uint32_t lifetime_wh;    // 出厂以来累计 (Wh)
+} usage_energy_t;
+
+/**
+ * @brief 加载小时/天汇总 (在 app_storage_init 与默认事件循环创建之后调用)
+ * MQTT 连上后自动补发未上传的日摘要
+ */
+esp_err_t usage_stats_init(void);
+
+/**
+ * @brief 累加一秒的运行数据 (每秒调用一次)
+ * 跨天时自动上传前一天的摘要；未对时期间的数据在对时后并入当时的小时桶
+ */
+void usage_stats_tick(const usage_tick_t *tick);
+
+/**
+ * @brief 当前小时未落盘的数据立即保存 (计划重启前调用)
+ */
+void usage_stats_flush(void);
+
+/**
+ * @brief 记录一次冲洗 (进入冲洗状态时调用)
+ */
+void usage_stats_on_wash(void);
+
+/**
+ * @brief 提交一次制水会话的能耗与水量，更新单位产水能耗基线并返回评估结果
+ */
+void usage_stats_on_session(uint32_t energy_mj, uint32_t volume_ml, usage_energy_t *out);
+
+/**
+ * @brief 发布历史区间 (Unix 秒，to 为 0 表示至今)
+ * @param daily true 按天，false 按小时
+ */
+esp_err_t usage_stats_query(const char *cmd_id, uint32_t from, uint32_t to, bool daily);
+
+/**
+ * @brief 上传所有已结束但尚未上传的日摘要 (离线时直接返回)
+ * 在调用者任务中发布 QoS1；事件循环与水机监控任务中经 mqtt_manager_request_sync 转交
+ */
+void usage_stats_sync_digest(void);
+
+#ifdef __cplusplus
+}
+#endif
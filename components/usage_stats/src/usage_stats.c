@@ -0,0 +1,408 @@
+// usage_stats.c 使用统计
+// 每秒数据累加到当前小时桶，小时结束时并入对应的天桶；小时环保存最近 2 天、天环保存最近 1 个月。
+// 每天上传一次日摘要，历史曲线由云端按需查询，不再需要长期保存每条定时日志。
+// 落盘按分片进行：定时保存只改写当前小时所在的分片与头部，小时结束时再写一次对应的天分片
+#include "usage_stats.h"
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_event.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "app_storage.h"
+#include "app_events.h"
+#include "protocol.h"
+#include "mqtt_manager.h"
+#include "bsp_sensor.h"
+#include "alert_manager.h"
+
+static const char *TAG = "USAGE";
+
+#define TIME_VALID_THRESHOLD 1700000000 // 早于该时间说明尚未对时
+#define SAVE_INTERVAL_SEC    (15 * 60)  // 当前小时有新数据时的落盘间隔
+
+// 单位产水能耗漂移 (膜老化/结垢时同样的水量需要更多能耗)
+#define EFF_MIN_VOLUME_ML    1000       // 水量过小的会话不参与统计
+#define EFF_BASE_SESSIONS    8          // 建立基线所需的会话数
+#define EFF_RECENT_SHIFT     3          // 近期均值 EWMA 系数 1/8
+#define EFF_DRIFT_ALERT_PCT  25
+#define EFF_DRIFT_CLEAR_PCT  15
+
+static SemaphoreHandle_t s_lock = NULL;
+static usage_store_t *s_store = NULL;   // 约 2KB，放在堆上
+static usage_bucket_t s_pending;        // 未对时期间的累计，对时后并入当时的小时桶
+static uint32_t s_energy_frac_mj = 0;   // 不足 1 焦耳的能耗余量
+static int64_t s_tds_seen_us = 0;       // 已计入的 TDS 快照
+static uint32_t s_dirty_sec = 0;        // 当前小时未落盘的秒数
+static bool s_dirty = false;
+static uint32_t s_merged_hour = 0;      // 最后并入天桶的小时 (随天分片一起落盘)
+
+static uint32_t wall_now(void) {
+    time_t now = time(NULL);
+    return (now >= TIME_VALID_THRESHOLD) ? (uint32_t)now : 0;
+}
+
+// 本地零点 (time_manager 已设置时区)
+static uint32_t day_start(uint32_t ts) {
+    time_t t = (time_t)ts;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    tm.tm_hour = 0;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    return (uint32_t)mktime(&tm);
+}
+
+static bool bucket_empty(const usage_bucket_t *b) {
+    return b->water_ml == 0 && b->making_sec == 0 && b->wash_ml == 0 && b->wash_count == 0 &&
+           b->energy_j == 0 && b->tds_n == 0;
+}
+
+static void bucket_add_tds(usage_bucket_t *b, int tds) {
+    if (b->tds_n == UINT16_MAX) return;
+    uint16_t v = (tds < 0) ? 0 : (tds > UINT16_MAX) ? UINT16_MAX : (uint16_t)tds;
+    if (b->tds_n == 0 || v < b->tds_min) b->tds_min = v;
+    if (b->tds_n == 0 || v > b->tds_max) b->tds_max = v;
+    b->tds_sum += v;
+    b->tds_n++;
+}
+
+static void bucket_merge(usage_bucket_t *dst, const usage_bucket_t *src) {
+    dst->water_ml += src->water_ml;
+    dst->making_sec += src->making_sec;
+    dst->wash_ml += src->wash_ml;
+    dst->wash_count += src->wash_count;
+    dst->energy_j += src->energy_j;
+    if (src->tds_n > 0) {
+        if (dst->tds_n == 0 || src->tds_min < dst->tds_min) dst->tds_min = src->tds_min;
+        if (dst->tds_n == 0 || src->tds_max > dst->tds_max) dst->tds_max = src->tds_max;
+        if ((uint32_t)dst->tds_n + src->tds_n <= UINT16_MAX) {
+            dst->tds_sum += src->tds_sum;
+            dst->tds_n += src->tds_n;
+        }
+    }
+}
+
+static int hour_index(uint32_t hour_ts) {
+    return (int)((hour_ts / 3600) % USAGE_HOURS);
+}
+
+// 零点按天取整得到日序号 (加半天容忍夏令时造成的 23/25 小时)
+static int day_index(uint32_t day_ts) {
+    return (int)(((day_ts + 12 * 3600) / 86400) % USAGE_DAYS);
+}
+
+static usage_bucket_t *hour_slot(uint32_t hour_ts) {
+    usage_bucket_t *b = &s_store->hours[hour_index(hour_ts)];
+    if (b->start_ts != hour_ts) {
+        memset(b, 0, sizeof(*b));
+        b->start_ts = hour_ts;
+    }
+    return b;
+}
+
+static usage_bucket_t *day_slot(uint32_t day_ts) {
+    usage_bucket_t *b = &s_store->days[day_index(day_ts)];
+    if (b->start_ts != day_ts) {
+        memset(b, 0, sizeof(*b));
+        b->start_ts = day_ts;
+    }
+    return b;
+}
+
+// 保存当前小时所在的分片与头部 (持锁调用)
+static void save_open_hour(void) {
+    uint32_t hour = s_store->open_hour;
+    if (hour != 0) app_storage_save_usage_hours(s_store, hour_index(hour));
+    app_storage_save_usage_head(s_store);
+    s_dirty = false;
+    s_dirty_sec = 0;
+}
+
+// 切换到新的小时：上一小时并入天桶，返回是否跨天 (持锁调用)
+static bool roll_hour(uint32_t hour) {
+    bool day_closed = false;
+    uint32_t prev = s_store->open_hour;
+
+    if (prev != 0) {
+        const usage_bucket_t *h = &s_store->hours[hour_index(prev)];
+        if (h->start_ts == prev) {
+            if (s_dirty) app_storage_save_usage_hours(s_store, hour_index(prev)); // 上一小时的最终数据
+            // 天分片与 merged_hour 一起写入，重启前已并入过的小时不再重复并入
+            if (!bucket_empty(h) && prev != s_merged_hour) {
+                uint32_t day = day_start(prev);
+                bucket_merge(day_slot(day), h);
+                s_merged_hour = prev;
+                app_storage_save_usage_days(s_store, day_index(day), prev);
+            }
+        }
+        day_closed = (day_start(prev) != day_start(hour));
+    }
+
+    usage_bucket_t *b = hour_slot(hour);
+    if (!bucket_empty(&s_pending)) {
+        bucket_merge(b, &s_pending);
+        memset(&s_pending, 0, sizeof(s_pending));
+        s_dirty = true;
+    }
+    s_store->open_hour = hour;
+    // 头部中的 open_hour 只决定当前小时桶的归属，有未落盘数据时才需要立即保存
+    if (s_dirty) save_open_hour();
+    return day_closed;
+}
+
+static void fill_item(usage_report_t *r, const usage_bucket_t *b) {
+    if (r->count >= USAGE_REPORT_MAX) return;
+    r->items[r->count].start_ts = b->start_ts;
+    r->items[r->count].water_ml = b->water_ml;
+    r->items[r->count].making_sec = b->making_sec;
+    r->items[r->count].wash_ml = b->wash_ml;
+    r->items[r->count].wash_count = b->wash_count;
+    r->items[r->count].energy_j = b->energy_j;
+    r->items[r->count].tds_min = b->tds_n ? b->tds_min : -1;
+    r->items[r->count].tds_avg = b->tds_n ? (int)(b->tds_sum / b->tds_n) : -1;
+    r->items[r->count].tds_max = b->tds_n ? b->tds_max : -1;
+    r->count++;
+}
+
+// 环形存放的桶按时间升序输出
+static void sort_items(usage_report_t *r) {
+    for (int i = 1; i < r->count; i++) {
+        for (int j = i; j > 0 && r->items[j - 1].start_ts > r->items[j].start_ts; j--) {
+            usage_item_t tmp = r->items[j];
+            r->items[j] = r->items[j - 1];
+            r->items[j - 1] = tmp;
+        }
+    }
+}
+
+static void on_mqtt_connected(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+    mqtt_manager_request_sync(usage_stats_sync_digest); // 事件循环中不直接发布 QoS1
+}
+
+esp_err_t usage_stats_init(void) {
+    s_store = calloc(1, sizeof(usage_store_t));
+    s_lock = xSemaphoreCreateMutex();
+    if (!s_store || !s_lock) return ESP_ERR_NO_MEM;
+
+    if (app_storage_load_usage(s_store, &s_merged_hour) != ESP_OK) {
+        memset(s_store, 0, sizeof(usage_store_t));
+        s_merged_hour = 0;
+    }
+    ESP_LOGI(TAG, "Usage stats loaded, open hour %lu, merged up to %lu, digest up to %lu",
+             (unsigned long)s_store->open_hour, (unsigned long)s_merged_hour, (unsigned long)s_store->digest_ts);
+    // 漂移告警只在越过阈值时触发，重启后由持久化的状态重新确认，否则会被告警集合按超时清除
+    if (s_store->eff_alerted) alert_manager_raise(ALERT_ENERGY_DRIFT);
+
+    return esp_event_handler_register(APP_EVENTS, APP_EVENT_MQTT_CONNECTED, on_mqtt_connected, NULL);
+}
+
+void usage_stats_tick(const usage_tick_t *tick) {
+    if (!s_lock || !tick) return;
+
+    // 制水期间每出一次新的 TDS 快照计入一次 (纯水侧)
+    bsp_tds_snapshot_t snap = {0};
+    bool new_tds = false;
+    if (tick->making) {
+        bsp_sensor_get_tds_snapshot(&snap);
+        new_tds = (snap.sample_us != 0 && snap.sample_us != s_tds_seen_us);
+        if (new_tds) s_tds_seen_us = snap.sample_us;
+    }
+    bool active = tick->making || tick->making_ml || tick->wash_ml || tick->energy_mj;
+    uint32_t now = wall_now();
+    bool day_closed = false;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    usage_bucket_t *b = &s_pending;
+    if (now != 0) {
+        uint32_t hour = now - now % 3600;
+        if (hour != s_store->open_hour) {
+            day_closed = roll_hour(hour);
+        }
+        b = hour_slot(hour);
+    }
+
+    if (active) {
+        b->water_ml += tick->making_ml;
+        b->wash_ml += tick->wash_ml;
+        if (tick->making) b->making_sec++;
+        uint32_t mj = tick->energy_mj + s_energy_frac_mj;
+        b->energy_j += mj / 1000;
+        s_energy_frac_mj = mj % 1000;
+        s_store->lifetime_mj += tick->energy_mj;
+        if (new_tds) bucket_add_tds(b, snap.tds_out);
+        s_dirty = true;
+    }
+    if (s_dirty && b != &s_pending && ++s_dirty_sec >= SAVE_INTERVAL_SEC) {
+        save_open_hour();
+    }
+    xSemaphoreGive(s_lock);
+
+    if (day_closed) {
+        mqtt_manager_request_sync(usage_stats_sync_digest); // 水机监控任务中不等待发布
+    }
+}
+
+void usage_stats_flush(void) {
+    if (!s_lock) return;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_dirty) save_open_hour();
+    xSemaphoreGive(s_lock);
+}
+
+void usage_stats_on_wash(void) {
+    if (!s_lock) return;
+    uint32_t now = wall_now();
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    usage_bucket_t *b = &s_pending;
+    if (now != 0 && s_store->open_hour == now - now % 3600) {
+        b = hour_slot(s_store->open_hour);
+    }
+    b->wash_count++;
+    s_dirty = true;
+    xSemaphoreGive(s_lock);
+}
+
+void usage_stats_on_session(uint32_t energy_mj, uint32_t volume_ml, usage_energy_t *out) {
+    usage_energy_t res = {0};
+    if (!s_lock) {
+        if (out) *out = res;
+        return;
+    }
+    uint32_t now = wall_now();
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (volume_ml >= EFF_MIN_VOLUME_ML && energy_mj > 0) {
+        // mWh/L = mJ / 3600 / (mL / 1000)，Q4 定点
+        uint32_t x = (uint32_t)((uint64_t)energy_mj * 10 * 16 / (36ULL * volume_ml));
+        res.mwh_per_l = x >> 4;
+
+        if (s_store->eff_sessions < EFF_BASE_SESSIONS) {
+            // 基线取前若干次会话的平均
+            uint32_t n = s_store->eff_sessions;
+            s_store->eff_base_q4 = (uint32_t)(((uint64_t)s_store->eff_base_q4 * n + x) / (n + 1));
+            s_store->eff_recent_q4 = s_store->eff_base_q4;
+            s_store->eff_sessions++;
+        } else {
+            int64_t diff = (int64_t)x - (int64_t)s_store->eff_recent_q4;
+            s_store->eff_recent_q4 = (uint32_t)((int64_t)s_store->eff_recent_q4 + diff / (1 << EFF_RECENT_SHIFT));
+        }
+        s_dirty = true;
+    }
+
+    if (s_store->eff_sessions >= EFF_BASE_SESSIONS && s_store->eff_base_q4 > 0) {
+        res.base_mwh_per_l = s_store->eff_base_q4 >> 4;
+        res.drift_pct = (int)(((int64_t)s_store->eff_recent_q4 - (int64_t)s_store->eff_base_q4) * 100 /
+                              (int64_t)s_store->eff_base_q4);
+        if (!s_store->eff_alerted && res.drift_pct >= EFF_DRIFT_ALERT_PCT) {
+            s_store->eff_alerted = 1;
+            res.drift_alert = true;
+        } else if (s_store->eff_alerted && res.drift_pct < EFF_DRIFT_CLEAR_PCT) {
+            s_store->eff_alerted = 0;
+            res.drift_clear = true;
+        }
+    }
+
+    // 当天累计 = 天桶 + 尚未并入的当前小时
+    uint32_t day_j = 0;
+    if (now != 0 && s_store->open_hour != 0) {
+        uint32_t today = day_start(now);
+        const usage_bucket_t *d = &s_store->days[day_index(today)];
+        const usage_bucket_t *h = &s_store->hours[hour_index(s_store->open_hour)];
+        if (d->start_ts == today) day_j += d->energy_j;
+        if (h->start_ts == s_store->open_hour && day_start(s_store->open_hour) == today) day_j += h->energy_j;
+    }
+    res.day_wh = day_j / 3600;
+    res.lifetime_wh = (uint32_t)(s_store->lifetime_mj / 3600000ULL);
+    xSemaphoreGive(s_lock);
+
+    if (res.drift_alert) {
+        ESP_LOGW(TAG, "Energy per liter drifted %d%% above baseline (%lu mWh/L)", res.drift_pct,
+                 (unsigned long)res.base_mwh_per_l);
+    }
+    if (out) *out = res;
+}
+
+void usage_stats_sync_digest(void) {
+    if (!s_lock) return;
+    uint32_t now = wall_now();
+    if (now == 0) return;
+    uint32_t today = day_start(now);
+
+    usage_report_t *report = calloc(1, sizeof(usage_report_t)); // 结构体较大，不占用调用者的任务栈
+    if (!report) return;
+    strncpy(report->kind, "digest", sizeof(report->kind) - 1);
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < USAGE_DAYS; i++) {
+        const usage_bucket_t *d = &s_store->days[i];
+        if (d->start_ts != 0 && d->start_ts > s_store->digest_ts && d->start_ts < today) {
+            fill_item(report, d);
+        }
+    }
+    xSemaphoreGive(s_lock);
+
+    if (report->count > 0) {
+        sort_items(report);
+        if (mqtt_manager_publish_usage(report) == ESP_OK) {
+            xSemaphoreTake(s_lock, portMAX_DELAY);
+            s_store->digest_ts = report->items[report->count - 1].start_ts;
+            app_storage_save_usage_head(s_store);
+            xSemaphoreGive(s_lock);
+            ESP_LOGI(TAG, "Daily digest uploaded: %d days", report->count);
+        }
+    }
+    free(report);
+}
+
+esp_err_t usage_stats_query(const char *cmd_id, uint32_t from, uint32_t to, bool daily) {
+    if (!s_lock) return ESP_ERR_INVALID_STATE;
+    if (to == 0) to = UINT32_MAX;
+    if (from > to) return ESP_ERR_INVALID_ARG;
+
+    usage_report_t *report = calloc(1, sizeof(usage_report_t));
+    if (!report) return ESP_ERR_NO_MEM;
+    strncpy(report->kind, daily ? "day" : "hour", sizeof(report->kind) - 1);
+    if (cmd_id) strncpy(report->cmd_id, cmd_id, sizeof(report->cmd_id) - 1);
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (!daily) {
+        for (int i = 0; i < USAGE_HOURS; i++) {
+            const usage_bucket_t *h = &s_store->hours[i];
+            // 空闲小时不落盘，槽位里可能还是 2 天前的旧桶
+            if (h->start_ts + USAGE_HOURS * 3600 <= s_store->open_hour) continue;
+            if (h->start_ts != 0 && h->start_ts >= from && h->start_ts <= to) {
+                fill_item(report, h);
+            }
+        }
+    } else {
+        // 当天的天桶还不含当前小时，查询时临时合并
+        uint32_t open_hour = s_store->open_hour;
+        const usage_bucket_t *open = (open_hour != 0) ? &s_store->hours[hour_index(open_hour)] : NULL;
+        uint32_t open_day = (open && open->start_ts == open_hour) ? day_start(open_hour) : 0;
+        bool open_merged = false;
+
+        for (int i = 0; i < USAGE_DAYS; i++) {
+            usage_bucket_t d = s_store->days[i];
+            if (d.start_ts == 0 || d.start_ts < from || d.start_ts > to) continue;
+            if (open_day != 0 && d.start_ts == open_day) {
+                bucket_merge(&d, open);
+                open_merged = true;
+            }
+            fill_item(report, &d);
+        }
+        if (open_day != 0 && !open_merged && open_day >= from && open_day <= to && !bucket_empty(open)) {
+            usage_bucket_t d = *open;
+            d.start_ts = open_day;
+            fill_item(report, &d);
+        }
+    }
+    xSemaphoreGive(s_lock);
+
+    sort_items(report);
+    esp_err_t err = mqtt_manager_publish_usage(report);
+    ESP_LOGI(TAG, "History query (%s) %d buckets: %s", report->kind, report->count, esp_err_to_name(err));
+    free(report);
+    return err;
+}
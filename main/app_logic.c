@@ -1,5 +1,7 @@
 #include <string.h>
+#include <stdlib.h>
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "app_storage.h"
 #include "esp_system.h" 
 #include "protocol.h"
@@ -9,39 +11,176 @@
 #include "app_events.h"      // 引入事件总线，用于将云端指令下发给状态机
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "esp_https_ota.h"
-#include "esp_crt_bundle.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "metering.h"
+#include "usage_stats.h"
+#include "rule_engine.h"
+#include "tunables.h"
+#include "app_fsm.h"
+#include "cmd_trace.h"
+#include "tou_schedule.h"
+#include "ota_manager.h"
 
 static const char *TAG = "LOGIC";
-static bool s_ota_is_running = false;
+
+// --- Status 上报合并 ---
+// 短时间内的多次上报请求合并为一次发布 (读取发布时刻的最新快照)
+#define STATUS_COALESCE_MS      500
+#define STATUS_PUBLISHED_BIT    (1 << 0)
+
+static TaskHandle_t s_status_task = NULL;
+static SemaphoreHandle_t s_status_lock = NULL;
+static EventGroupHandle_t s_status_evt = NULL;
+static uint32_t s_status_req_gen = 0;   // 已请求的代数
+static uint32_t s_status_done_gen = 0;  // 已发布覆盖到的代数
+static esp_err_t s_status_last_err = ESP_OK;
+static bool s_status_full_pending = false; // 本轮是否需要完整上报
+
+// --- 增量上报 (reported 状态) ---
+// 套餐/滤芯分段与上次成功上报的一致时省略，传感器分段始终携带；
+// 首次、查询、OTA 前以及每 STATUS_FULL_EVERY 次强制完整上报
+#define STATUS_FULL_EVERY       10
+
+static status_report_t s_last_reported;
+static bool s_last_reported_valid = false;
+static uint32_t s_delta_count = 0;
 
 // ============================================================================
-// 定时数据上报任务 (使用真实的传感器数据)
+// 日志上报调度 (事件驱动 + TDS 死区 + 分状态心跳)
 // ============================================================================
-static void app_logic_report_task(void *pvParameters) {
-    ESP_LOGI(TAG, "Report Task Started. Interval: 60s");
+// 状态转移与告警立即上报；制水时采样任务按短周期刷新 TDS 快照，超出死区才上报；
+// 其余时间只按心跳上报。空闲状态采样任务回到长周期，心跳使用当前快照
+#define TELE_EV_STATE           (1 << 0)
+#define TELE_EV_ALERT           (1 << 1)
+
+#define TELE_TICK_MS            1000
+#define TELE_MIN_GAP_SEC        10          // 死区触发的最小上报间隔 (状态转移/告警不受限)
+#define TELE_DEADBAND_TDS_OUT   5           // 纯水 TDS 死区 (ppm)
+#define TELE_DEADBAND_TDS_IN    20          // 原水 TDS 死区 (ppm)
+#define TELE_LEDGER_RESYNC_SEC  60          // 账本有未确认记录时的重发间隔
+
+typedef struct {
+    uint32_t sample_sec;    // TDS 采样周期 (秒)，0 表示使用采样任务的空闲周期
+    uint32_t heartbeat_sec; // 无变化时的最长上报间隔 (秒)，0 表示使用运行参数 TUN_IDLE_HB_SEC
+} tele_policy_t;
+
+static const tele_policy_t s_tele_policy[WATER_STATE_MAX] = {
+    [WATER_STATE_INIT]     = {0, 0},
+    [WATER_STATE_WASHING]  = {0, 0},     // 冲洗时 TDS 不代表出水水质，进出冲洗的状态转移已上报
+    [WATER_STATE_MAKING]   = {10, 0},    // 心跳取运行参数 TUN_REPORT_SEC (默认 60 秒分辨率)
+    [WATER_STATE_FULL]     = {0, 0},
+    [WATER_STATE_SHORTAGE] = {0, 1800},
+    [WATER_STATE_FAULT]    = {0, 1800},
+    [WATER_STATE_DEFERRED] = {0, 0},
+};
+
+static TaskHandle_t s_tele_task = NULL;
+
+// 从后台采样快照填充 TDS，返回快照的采样时刻
+static int64_t tele_read_tds(log_report_t *out) {
+    bsp_tds_snapshot_t snap;
+    out->sample_age = bsp_sensor_get_tds_snapshot(&snap);
+    out->tds_in = snap.tds_in;
+    out->tds_out = snap.tds_out;
+    out->tds_backup = snap.tds_backup;
+    return snap.sample_us;
+}
+
+static bool tele_outside_deadband(const log_report_t *now, const log_report_t *ref) {
+    return abs(now->tds_out - ref->tds_out) >= TELE_DEADBAND_TDS_OUT ||
+           abs(now->tds_in - ref->tds_in) >= TELE_DEADBAND_TDS_IN;
+}
+
+static void on_tele_event(void *arg, esp_event_base_t base, int32_t id, void *data) {
+    if (!s_tele_task) return;
+    xTaskNotify(s_tele_task, (id == APP_EVENT_ALERT_RAISED) ? TELE_EV_ALERT : TELE_EV_STATE, eSetBits);
+}
+
+static void telemetry_task(void *pvParameters) {
+    log_report_t reading = {0};   // 最近一次读数
+    log_report_t reported = {0};  // 最近一次成功上报的读数 (死区参考)
+    bool have_reported = false;
+    int64_t seen_sample_us = 0;   // 已处理过的快照采样时刻
+    water_state_t applied_ws = WATER_STATE_MAX;
+
+    const char *pending = NULL;   // 等待补采完成的事件上报
+    int64_t pending_since = 0;
+
+    int64_t now = esp_timer_get_time() / 1000000;
+    int64_t last_sync = now;
+    // 按 DeviceID 哈希错开首次心跳相位，避免同一片区断电恢复后所有设备同步上报
+    uint32_t idle_hb_sec = (uint32_t)tunable(TUN_IDLE_HB_SEC);
+    int64_t last_report = now - (int64_t)(protocol_device_hash() % idle_hb_sec);
+    ESP_LOGI(TAG, "Telemetry scheduler started. Idle heartbeat: %lus", (unsigned long)idle_hb_sec);
 
     while (1) {
-        // 等待 60 秒定时周期
-        vTaskDelay(pdMS_TO_TICKS(60000));
-
-        // 从 NVS 读取最新的计费、滤芯和累计总流量
-        device_status_t status;
-        app_storage_load_status(&status);
-
-        // 1. 打包并发送 Log 数据 (调用真实的传感器 ADC 读取)
-        log_report_t log_data = {
-            .production_vol = 0, // 定时上报时单次水量填0，单次制水量在FSM水满停机时单独结算上报
-            .tds_in = bsp_sensor_get_tds_in(),       // 真实 原水 TDS
-            .tds_out = bsp_sensor_get_tds_out(),     // 真实 纯水 TDS
-            .tds_backup = bsp_sensor_get_tds_backup(),// 真实 备用 TDS
-        };
-
-        ESP_LOGI(TAG, "Uploading Log Data... TDS: %d | %d", log_data.tds_in, log_data.tds_out);
-        if (mqtt_manager_publish_log(&log_data) == ESP_OK) {
-            ESP_LOGI(TAG, "Log Upload Success");
-        } else {
-            ESP_LOGW(TAG, "Log Upload Failed (MQTT not ready?)");
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits, pdMS_TO_TICKS(TELE_TICK_MS));
+        now = esp_timer_get_time() / 1000000;
+
+        water_state_t ws = app_fsm_get_water_state();
+        const tele_policy_t *policy = &s_tele_policy[(ws < WATER_STATE_MAX) ? ws : WATER_STATE_INIT];
+        uint32_t heartbeat_sec = policy->heartbeat_sec ? policy->heartbeat_sec : (uint32_t)tunable(TUN_IDLE_HB_SEC);
+        if (ws == WATER_STATE_MAKING) heartbeat_sec = (uint32_t)tunable(TUN_REPORT_SEC);
+        const char *reason = NULL;
+
+        // 采样周期跟随水机状态 (0 交还给采样任务的空闲周期)
+        if (ws != applied_ws) {
+            applied_ws = ws;
+            bsp_sensor_set_sample_interval(policy->sample_sec * 1000);
+        }
+
+        // 1. 事件触发：请求补采，拿到新快照 (或等待超时) 后立即上报
+        if (bits & (TELE_EV_ALERT | TELE_EV_STATE)) {
+            if (!pending || (bits & TELE_EV_ALERT)) {
+                pending = (bits & TELE_EV_ALERT) ? "alert" : "state";
+            }
+            pending_since = esp_timer_get_time();
+            bsp_sensor_request_sample();
+        }
+        int64_t sample_us = tele_read_tds(&reading);
+        if (pending && (sample_us > pending_since || now - pending_since / 1000000 >= 2)) {
+            reason = pending;
+            pending = NULL;
+        }
+
+        // 2. 活跃状态每出一次新快照检查死区，超出才上报
+        if (!reason && !pending && policy->sample_sec > 0 && sample_us != seen_sample_us) {
+            if (have_reported && tele_outside_deadband(&reading, &reported) &&
+                now - last_report >= TELE_MIN_GAP_SEC) {
+                reason = "deadband";
+            }
+        }
+        seen_sample_us = sample_us;
+
+        // 3. 兜底心跳，直接使用当前快照
+        if (!reason && !pending && now - last_report >= heartbeat_sec) {
+            reason = "heartbeat";
+        }
+
+        if (reason) {
+            reading.production_vol = 0; // 单次制水量由制水会话记录 (session Topic) 上报
+            reading.keepalive = mqtt_manager_get_keepalive(); // 当前自适应心跳，便于云端统计
+
+            // 离线时同样推进计时，不在断网期间逐秒重试
+            last_report = now;
+            if (mqtt_manager_publish_log(&reading) == ESP_OK) {
+                ESP_LOGI(TAG, "Log uploaded (%s). TDS: %d | %d, age %ds", reason,
+                         reading.tds_in, reading.tds_out, reading.sample_age);
+                reported = reading;
+                have_reported = true;
+            } else {
+                ESP_LOGW(TAG, "Log upload failed (%s), MQTT not ready?", reason);
+            }
+        }
+
+        // 仍有未确认的账本记录时定期重发 (只发未确认部分)
+        if (now - last_sync >= TELE_LEDGER_RESYNC_SEC) {
+            last_sync = now;
+            if (metering_get_unacked() > 0) {
+                metering_sync();
+            }
         }
     }
 }
@@ -49,14 +188,20 @@ static void app_logic_report_task(void *pvParameters) {
 // ============================================================================
 // 主动上报 Status 数据
 // ============================================================================
-void app_logic_report_status(void) {
+static esp_err_t status_publish_snapshot(bool full) {
     device_status_t status;
     app_storage_load_status(&status);
 
+    // TDS 取后台采样快照，查询不再在调用方任务里给探头上电
+    bsp_tds_snapshot_t snap;
+    int sample_age = bsp_sensor_get_tds_snapshot(&snap);
+
     status_report_t status_data = {
-        .tds_in = bsp_sensor_get_tds_in(),
-        .tds_out = bsp_sensor_get_tds_out(),
-        .tds_backup = bsp_sensor_get_tds_backup(),
+        .sections = 0, // 默认完整上报
+        .tds_in = snap.tds_in,
+        .tds_out = snap.tds_out,
+        .tds_backup = snap.tds_backup,
+        .sample_age = sample_age,
         .total_water = status.total_flow / 1000, // 毫升转为升(L)
         
         .switch_status = status.switch_state,
@@ -72,70 +217,136 @@ void app_logic_report_status(void) {
         status_data.filters[i].days = status.filter_days[i];
         status_data.filters[i].capacity = status.filter_capacity[i];
     }
-    mqtt_manager_publish_status(&status_data);
-    ESP_LOGI(TAG, "Status Reported");
+    status_data.plan_ver = app_storage_plan_is_valid() ? status.plan_ver : 0; // 未确认的缓存套餐请云端补发
+
+    if (!full && s_last_reported_valid && s_delta_count < STATUS_FULL_EVERY) {
+        uint8_t sections = STATUS_SECTION_SENSOR;
+        if (status_data.switch_status != s_last_reported.switch_status ||
+            status_data.sale_mode != s_last_reported.sale_mode ||
+            status_data.pay_mode != s_last_reported.pay_mode ||
+            status_data.days != s_last_reported.days ||
+            status_data.capacity != s_last_reported.capacity ||
+            status_data.plan_ver != s_last_reported.plan_ver) {
+            sections |= STATUS_SECTION_PLAN;
+        }
+        if (memcmp(status_data.filters, s_last_reported.filters, sizeof(status_data.filters)) != 0) {
+            sections |= STATUS_SECTION_FILTERS;
+        }
+        status_data.sections = sections;
+    }
+
+    esp_err_t err = mqtt_manager_publish_status(&status_data);
+    if (err == ESP_OK) {
+        bool is_full = (status_data.sections == 0 || status_data.sections == STATUS_SECTION_ALL);
+        s_delta_count = is_full ? 0 : s_delta_count + 1;
+        s_last_reported = status_data;
+        s_last_reported_valid = true;
+    }
+    return err;
 }
 
-// ============================================================================
-// OTA 更新任务
-// ============================================================================
-static void ota_task(void *pvParameter) {
-    char *url = (char *)pvParameter;
-    ESP_LOGI(TAG, "开始执行 OTA, 下载地址: %s", url);
-
-    esp_http_client_config_t config = {
-        .url = url,
-        // 权威证书绑定
-        // .crt_bundle_attach = esp_crt_bundle_attach,        //测试期间注释掉
-        .timeout_ms = 10000,
-        .keep_alive_enable = true,
-        //强制跳过证书合法性校验
-        .skip_cert_common_name_check = true,                  //测试期间使用
-        .cert_pem = NULL,                                     //测试期间使用
-    };
+// Status 合并发布任务：收到第一个请求后等待一个合并窗口，窗口内的请求共用一次发布
+static void status_report_task(void *pvParameters) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vTaskDelay(pdMS_TO_TICKS(STATUS_COALESCE_MS));
+        ulTaskNotifyTake(pdTRUE, 0); // 窗口内的重复通知已被本次覆盖
 
-    esp_https_ota_config_t ota_config = {
-        .http_config = &config,
-    };
+        xSemaphoreTake(s_status_lock, portMAX_DELAY);
+        uint32_t gen = s_status_req_gen;
+        bool full = s_status_full_pending;
+        s_status_full_pending = false;
+        xEventGroupClearBits(s_status_evt, STATUS_PUBLISHED_BIT);
+        xSemaphoreGive(s_status_lock);
 
-    ESP_LOGI(TAG, "正在下载固件并烧录...");
-    esp_err_t ret = esp_https_ota(&ota_config);
-    if (ret == ESP_OK) {
-        ESP_LOGI(TAG, "OTA 成功！准备重启...");
-        vTaskDelay(pdMS_TO_TICKS(1000));
-        esp_restart();
-    } else {
-        ESP_LOGE(TAG, "OTA 失败: %s", esp_err_to_name(ret));
+        esp_err_t err = status_publish_snapshot(full);
+
+        xSemaphoreTake(s_status_lock, portMAX_DELAY);
+        s_status_done_gen = gen;
+        s_status_last_err = err;
+        xEventGroupSetBits(s_status_evt, STATUS_PUBLISHED_BIT);
+        xSemaphoreGive(s_status_lock);
+        ESP_LOGI(TAG, "Status Reported (gen %lu, %s)", (unsigned long)gen, esp_err_to_name(err));
     }
+}
+
+static uint32_t status_request(bool full) {
+    xSemaphoreTake(s_status_lock, portMAX_DELAY);
+    uint32_t gen = ++s_status_req_gen;
+    if (full) s_status_full_pending = true;
+    xSemaphoreGive(s_status_lock);
+    xTaskNotifyGive(s_status_task);
+    return gen;
+}
+
+// 请求上报一次 Status (异步，合并窗口内的多次请求只发布一次)
+void app_logic_report_status(void) {
+    if (!s_status_task) return;
+    status_request(false);
+}
+
+// 请求一次完整上报 (不做增量裁剪)
+static void app_logic_report_status_full(void) {
+    if (!s_status_task) return;
+    status_request(true);
+}
+
+// 请求上报并等待覆盖本次请求的发布完成，返回发布结果
+esp_err_t app_logic_report_status_wait(uint32_t timeout_ms) {
+    if (!s_status_task) return ESP_ERR_INVALID_STATE;
+    uint32_t gen = status_request(true);
+    TickType_t start = xTaskGetTickCount();
+    TickType_t limit = pdMS_TO_TICKS(timeout_ms);
+
+    while (1) {
+        xSemaphoreTake(s_status_lock, portMAX_DELAY);
+        bool done = (int32_t)(s_status_done_gen - gen) >= 0;
+        esp_err_t err = s_status_last_err;
+        xSemaphoreGive(s_status_lock);
+        if (done) return err;
 
-    free(url);
-    s_ota_is_running = false; // 解锁 (无论是成功还是失败，退出前解锁)
-    vTaskDelete(NULL);
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= limit) return ESP_ERR_TIMEOUT;
+        EventBits_t bits = xEventGroupWaitBits(s_status_evt, STATUS_PUBLISHED_BIT, pdFALSE, pdTRUE, limit - elapsed);
+        if (bits & STATUS_PUBLISHED_BIT) {
+            // 标志位可能来自上一轮发布，等待后台任务进入下一轮
+            vTaskDelay(pdMS_TO_TICKS(20));
+        }
+    }
 }
 
-void app_logic_trigger_ota(const char *url) {
- if (s_ota_is_running) {
-        ESP_LOGW(TAG, "OTA 正在进行中，已忽略重复的升级请求！");
-        return;
+// ============================================================================
+// 期望状态版本校验 (新版本优先，乱序/重复的旧指令不回滚套餐)
+// 返回 ESP_OK 表示可以应用，并已把版本写入 status (随状态一起落盘)
+// 缓存套餐的有效性戳不符 (掉电残缺/被篡改) 时本地版本不可信，以云端下发为准
+// ============================================================================
+static esp_err_t plan_version_check(const server_cmd_t *cmd, device_status_t *status) {
+    if (cmd->plan_ver == 0) return ESP_OK; // 未带版本的旧格式指令，按原逻辑执行
+    if (!app_storage_plan_is_valid()) {
+        status->plan_ver = cmd->plan_ver;
+        return ESP_OK;
     }
-    
-    char *url_copy = strdup(url); 
-    if (url_copy == NULL) {
-        ESP_LOGE(TAG, "内存不足，无法启动 OTA");
-        return;
+    if (status->plan_ver != 0 && cmd->plan_ver < status->plan_ver) {
+        ESP_LOGW(TAG, "Stale desired state ver %lu < applied %lu, ignored",
+                 (unsigned long)cmd->plan_ver, (unsigned long)status->plan_ver);
+        return ESP_ERR_INVALID_VERSION;
     }
-    
-    s_ota_is_running = true; // 加锁
-    xTaskCreate(&ota_task, "ota_task", 8192, url_copy, 5, NULL);
+    if (cmd->plan_ver == status->plan_ver) {
+        ESP_LOGI(TAG, "Desired state ver %lu already applied", (unsigned long)cmd->plan_ver);
+        return ESP_ERR_INVALID_STATE; // 重复下发，幂等处理
+    }
+    status->plan_ver = cmd->plan_ver;
+    return ESP_OK;
 }
 
 // ============================================================================
 // MQTT 云端指令分发枢纽
 // ============================================================================
-void app_logic_handle_cmd(server_cmd_t *cmd) {
+esp_err_t app_logic_handle_cmd(server_cmd_t *cmd) {
     ESP_LOGI(TAG, "Received Cloud Command Method: %d", cmd->method);
 
     device_status_t status; // 用于暂存从 NVS 读取的当前状态
+    esp_err_t ver_err;
 
     switch (cmd->method) {
         case CMD_METHOD_POWER:
@@ -143,12 +354,19 @@ void app_logic_handle_cmd(server_cmd_t *cmd) {
             // 这里不需要自己写关机代码，直接触发状态机评估，状态机会自动拦截并关断所有阀门
             // 1. 读取当前状态
             app_storage_load_status(&status);
+            ver_err = plan_version_check(cmd, &status);
+            if (ver_err == ESP_ERR_INVALID_STATE) break;
+            if (ver_err != ESP_OK) {
+                app_logic_report_status_full(); // 让云端看到设备当前版本
+                return ver_err;
+            }
             // 2. 修改开关机状态
             status.switch_state = cmd->param.switch_status;
             // 3. 真正保存到 Flash
             app_storage_save_status(&status);
             
             // 4. 刺激状态机更新
+            cmd_trace_mark(CMD_STAGE_STORED);
             esp_event_post(APP_EVENTS, APP_EVENT_CMD_EVALUATE, NULL, 0, 0); 
             break;
             
@@ -163,11 +381,22 @@ void app_logic_handle_cmd(server_cmd_t *cmd) {
             
             // 1. 读取当前状态 (保留原有的 total_flow 制水量不被覆盖)
             app_storage_load_status(&status);
+            ver_err = plan_version_check(cmd, &status);
+            if (ver_err == ESP_ERR_INVALID_STATE) {
+                app_storage_mark_plan_valid(); // 云端重发同一版本，视为对账确认
+                break;
+            }
+            if (ver_err != ESP_OK) {
+                app_logic_report_status_full();
+                return ver_err;
+            }
             
-            // 2. 覆盖下发的套餐和滤芯参数
-            status.pay_mode = cmd->param.pay_mode;
-            status.days     = cmd->param.days;
-            status.capacity = cmd->param.capacity;
+            // 2. 覆盖下发的套餐和滤芯参数 (未带套餐字段时只更新滤芯)
+            if (cmd->has_plan) {
+                status.pay_mode = cmd->param.pay_mode;
+                status.days     = cmd->param.days;
+                status.capacity = cmd->param.capacity;
+            }
             for (int i = 0; i < 9; i++) {
                 if (cmd->filters[i].valid) {
                     status.filter_valid[i] = true;                 // 激活该级滤芯
@@ -179,9 +408,11 @@ void app_logic_handle_cmd(server_cmd_t *cmd) {
             
             // 3. 真正保存到 Flash
             app_storage_save_status(&status);
+            app_storage_mark_plan_valid(); // 重启后可直接使用缓存套餐投入运行
             ESP_LOGI(TAG, "新套餐参数已成功写入 NVS Flash！");
             
             // 4. 通知状态机重新鉴权是否需要恢复制水
+            cmd_trace_mark(CMD_STAGE_STORED);
             esp_event_post(APP_EVENTS, APP_EVENT_CMD_EVALUATE, NULL, 0, 0); 
             break;
             
@@ -193,24 +424,87 @@ void app_logic_handle_cmd(server_cmd_t *cmd) {
         
         case CMD_METHOD_OTA:
             ESP_LOGI(TAG, "Action: OTA Update");
-            app_logic_report_status(); // OTA前也可上报一次
-            app_logic_trigger_ota(cmd->param.ota_url);
-            break;
+            // OTA 前确认上报一次 (升级后重启，这里需要等待发布完成)
+            if (app_logic_report_status_wait(3000) != ESP_OK) {
+                ESP_LOGW(TAG, "OTA 前状态上报未确认，继续升级");
+            }
+            // 后台限速下载，写完后等水机空闲再重启
+            return ota_manager_request(cmd->param.ota_url);
             
         case CMD_METHOD_QUERY_STATUS:
             ESP_LOGI(TAG, "Action: Query Status");
-            app_logic_report_status();
+            app_logic_report_status_full();
+            break;
+
+        case CMD_METHOD_LEDGER_ACK:
+            ESP_LOGI(TAG, "Action: Ledger Ack -> seq %lu", (unsigned long)cmd->param.ack_seq);
+            // 账本确认只针对本机，只接受单播 Topic (广播确认会让全网丢弃未入账记录)
+            if (cmd->broadcast) {
+                ESP_LOGW(TAG, "Ledger Ack from broadcast topic rejected");
+                return ESP_ERR_INVALID_ARG;
+            }
+            return metering_ack(cmd->param.ack_seq); // 确认不需要再上报状态
+
+        case CMD_METHOD_SET_BROKERS:
+            ESP_LOGI(TAG, "Action: Set Brokers (%d)", cmd->param.brokers.count);
+            return mqtt_manager_set_brokers(cmd->param.brokers.urls, cmd->param.brokers.count);
+
+        case CMD_METHOD_QUERY_HISTORY:
+            ESP_LOGI(TAG, "Action: Query History (%lu ~ %lu, %s)", (unsigned long)cmd->param.history.from,
+                     (unsigned long)cmd->param.history.to, cmd->param.history.daily ? "day" : "hour");
+            // 结果发布到 usage Topic，不需要再上报状态
+            return usage_stats_query(cmd->cmd_id, cmd->param.history.from, cmd->param.history.to,
+                                     cmd->param.history.daily);
+
+        case CMD_METHOD_SET_RULES:
+            ESP_LOGI(TAG, "Action: Set Rules (%d%s)", cmd->param.rules.count,
+                     cmd->param.rules.use_default ? ", default" : "");
+            return rule_engine_set_rules(cmd->param.rules.items, cmd->param.rules.count,
+                                         cmd->param.rules.use_default);
+
+        case CMD_METHOD_SET_SCHEDULE: {
+            ESP_LOGI(TAG, "Action: Set Schedule (%d windows)", cmd->param.schedule.count);
+            esp_err_t err = tou_schedule_set(cmd->param.schedule.items, cmd->param.schedule.count,
+                                             cmd->param.schedule.reserve_min, cmd->param.schedule.early_wash_pct);
+            if (err == ESP_OK) {
+                // 新计划可能解除当前的推迟
+                esp_event_post(APP_EVENTS, APP_EVENT_CMD_EVALUATE, NULL, 0, 0);
+            }
+            return err;
+        }
+
+        case CMD_METHOD_SET_CONFIG:
+            ESP_LOGI(TAG, "Action: Set Config (%d)", cmd->param.config.count);
+            return tunables_set(cmd->param.config.items, cmd->param.config.count, cmd->reason, sizeof(cmd->reason));
+
+        case CMD_METHOD_GET_CONFIG:
+            ESP_LOGI(TAG, "Action: Get Config");
+            // 结果发布到 config Topic，不需要再上报状态
+            return tunables_report(cmd->cmd_id);
+
+        case CMD_METHOD_SET_GROUP:
+            if (!cmd->has_group) {
+                ESP_LOGW(TAG, "Set Group rejected: missing or invalid group name");
+                return ESP_ERR_INVALID_ARG;
+            }
+            ESP_LOGI(TAG, "Action: Set Group -> '%s'", cmd->param.group);
+            if (app_storage_set_group(cmd->param.group) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            mqtt_manager_set_group(cmd->param.group);
             break;
 
         default:
             ESP_LOGW(TAG, "Unknown Method: %d", cmd->method);
-            break;
+            return ESP_ERR_NOT_SUPPORTED;
     }
     
     // 除重置和OTA以外，收到指令处理完成后主动上报一次最新状态
-    if (cmd->method != CMD_METHOD_RESET && cmd->method != CMD_METHOD_OTA && cmd->method != CMD_METHOD_QUERY_STATUS) {
+    if (cmd->method != CMD_METHOD_RESET && cmd->method != CMD_METHOD_OTA && cmd->method != CMD_METHOD_QUERY_STATUS &&
+        cmd->method != CMD_METHOD_SET_GROUP) {
         app_logic_report_status();
     }
+    return ESP_OK;
 }
 
 // ============================================================================
@@ -219,6 +513,12 @@ void app_logic_handle_cmd(server_cmd_t *cmd) {
 void app_logic_init(void) {
     ESP_LOGI(TAG, "App Logic Initialized");
 
-    // 启动定时上报任务
-    xTaskCreate(app_logic_report_task, "report_task", 4096, NULL, 5, NULL);
+    s_status_lock = xSemaphoreCreateMutex();
+    s_status_evt = xEventGroupCreate();
+    xTaskCreate(status_report_task, "status_rpt", 4096, NULL, 5, &s_status_task);
+
+    // 启动日志上报调度
+    xTaskCreate(telemetry_task, "report_task", 4096, NULL, 5, &s_tele_task);
+    esp_event_handler_register(APP_EVENTS, APP_EVENT_WATER_STATE_CHANGED, &on_tele_event, NULL);
+    esp_event_handler_register(APP_EVENTS, APP_EVENT_ALERT_RAISED, &on_tele_event, NULL);
 }
\ No newline at end of file
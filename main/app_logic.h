@@ -4,5 +4,12 @@
 // 初始化业务逻辑
 void app_logic_init(void);
 
-// 处理来自服务器的指令 (MQTT Manager 会调用此函数)
-void app_logic_handle_cmd(server_cmd_t *cmd);
\ No newline at end of file
+// 处理来自服务器的指令 (MQTT Manager 的指令任务会调用此函数)
+// 返回 ESP_OK 表示已执行，其他值会以失败回执给云端
+esp_err_t app_logic_handle_cmd(server_cmd_t *cmd);
+
+// 请求上报一次 Status (异步，短时间内的多次请求合并为一次发布)
+void app_logic_report_status(void);
+
+// 请求上报并等待发布完成 (需要确认时使用)，超时返回 ESP_ERR_TIMEOUT
+esp_err_t app_logic_report_status_wait(uint32_t timeout_ms);
@@ -10,6 +10,7 @@
 #include "esp_wifi.h"
 #include "esp_log.h"
 #include "app_storage.h"  
+#include "trust_store.h"
 #include "blufi_custom.h"
 #include "protocol.h"
 #include "time_manager.h"
@@ -17,6 +18,13 @@
 #include "app_logic.h"
 #include "mqtt_manager.h"
 #include "app_fsm.h"
+#include "metering.h"
+#include "usage_stats.h"
+#include "alert_manager.h"
+#include "rule_engine.h"
+#include "tou_schedule.h"
+#include "ota_manager.h"
+#include "tunables.h"
 #include "bsp_pump_valve.h"
 #include "bsp_sensor.h"
 #include "bsp_led.h"
@@ -143,8 +151,12 @@ void app_main(void)
    
     // 存储与系统初始化
     ESP_ERROR_CHECK(app_storage_init());
+    // 运行参数 (云端覆盖值)，需在各业务模块启动之前加载
+    tunables_init();
     debug_apply_sn();
     debug_apply_net_config();
+    // 加载产线预置的私有 CA / SPKI 指纹 (无则使用内置证书包)
+    trust_store_init();
 
     // 注意：不要在每次启动时清空网络配置。
     // 网络/出厂重置应由按键或云端命令触发。
@@ -158,6 +170,19 @@ void app_main(void)
     bsp_pump_valve_init(); 
     bsp_sensor_init();
 
+    // 计量账本 (需在状态机开始计量之前加载未结账零头)
+    metering_init();
+    // 告警集合 (恢复重启前未清除的告警，需在各告警来源之前初始化)
+    alert_manager_init();
+    // 小时/天使用统计 (重新确认重启前的能耗漂移告警)
+    usage_stats_init();
+    // 告警规则 (TDS/温度/漏水阈值，云端可下发替换)
+    rule_engine_init();
+    // 分时制水计划 (禁止时段推迟制水与冲洗)
+    tou_schedule_init();
+    // 固件升级 (连上 MQTT 后续传未完成的下载)
+    ota_manager_init();
+
     // 启动连接状态机（统一编排网络 / MQTT 生命周期）
     app_fsm_init();
 
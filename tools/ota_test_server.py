@@ -0,0 +1,316 @@
+#!/usr/bin/env python3
+"""OTA 断点续传测试服务器 (仅用于台架测试，不要部署到生产环境)
+
+固件只接受 https 地址，并通过 trust_store 校验服务器证书，所以测试服务器
+必须使用由设备已预置 CA 签发的证书。本脚本提供两个子命令:
+
+  certs  生成测试 CA 与服务器证书，并输出写入设备 NVS (命名空间 tls) 用的 CSV
+  serve  以 HTTPS 提供固件镜像，可按需在传输中途断开连接、忽略 Range 请求
+
+完整的手工测试步骤见 tools/README.md。
+
+用法:
+    python3 tools/ota_test_server.py certs --host 192.168.1.10 --extra-ca broker_ca.pem
+    python3 tools/ota_test_server.py serve --image build/purifier.bin \\
+        --cert ota_test/server.pem --key ota_test/server.key --drop-after 300000 --drop-times 2
+"""
+
+import argparse
+import hashlib
+import http.server
+import ipaddress
+import os
+import re
+import socket
+import ssl
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+TLS_CA_MAX_LEN = 4096   # 与 app_storage.h 一致 (含结尾 '\0')
+CHUNK = 4096
+
+
+# ---------------------------------------------------------------- certs
+
+def openssl(*args, data=None):
+    return subprocess.run(["openssl", *args], input=data, check=True, stdout=subprocess.PIPE).stdout
+
+
+def nvs_partition_size():
+    """从 partitions.csv 读取 nvs 分区大小，生成 NVS 镜像时需要"""
+    try:
+        with open(os.path.join(ROOT, "partitions.csv"), encoding="utf-8") as f:
+            for line in f:
+                cols = [c.strip() for c in line.split(",")]
+                if len(cols) >= 5 and cols[0] == "nvs":
+                    size = cols[4]
+                    if size.upper().endswith("K"):
+                        return int(size[:-1], 0) * 1024
+                    return int(size, 0)
+    except (OSError, ValueError):
+        pass
+    return None
+
+
+def cmd_certs(args):
+    out = os.path.abspath(args.out)
+    os.makedirs(out, exist_ok=True)
+    p = lambda name: os.path.join(out, name)
+
+    try:
+        ip = ipaddress.ip_address(args.host)
+        san = "IP:%s" % ip
+    except ValueError:
+        san = "DNS:%s" % args.host
+
+    # 测试 CA
+    openssl("req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1", "-nodes",
+            "-keyout", p("ca.key"), "-out", p("ca.pem"), "-days", str(args.days),
+            "-subj", "/CN=Purifier OTA Test CA",
+            "-addext", "basicConstraints=critical,CA:TRUE",
+            "-addext", "keyUsage=critical,keyCertSign,cRLSign")
+    # 服务器证书 (设备校验主机名，SAN 必须与 OTA 地址中的主机一致)
+    openssl("req", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1", "-nodes",
+            "-keyout", p("server.key"), "-out", p("server.csr"), "-subj", "/CN=%s" % args.host)
+    with open(p("server.ext"), "w", encoding="utf-8") as f:
+        f.write("basicConstraints=CA:FALSE\nkeyUsage=digitalSignature\n"
+                "extendedKeyUsage=serverAuth\nsubjectAltName=%s\n" % san)
+    openssl("x509", "-req", "-in", p("server.csr"), "-CA", p("ca.pem"), "-CAkey", p("ca.key"),
+            "-CAcreateserial", "-out", p("server.pem"), "-days", str(args.days), "-extfile", p("server.ext"))
+
+    # 设备只信任 NVS 中的这一份 CA 链，Broker 的 CA 需要一起写入，否则设备连不上 MQTT
+    pem = b""
+    for extra in args.extra_ca or []:
+        with open(extra, "rb") as f:
+            pem += f.read().strip() + b"\n"
+    with open(p("ca.pem"), "rb") as f:
+        pem += f.read().strip() + b"\n"
+    blob = pem + b"\0"  # mbedtls 解析 PEM 要求包含结尾 '\0'
+    if len(blob) > TLS_CA_MAX_LEN:
+        sys.exit("CA chain is %d bytes, exceeds TLS_CA_MAX_LEN (%d)" % (len(blob), TLS_CA_MAX_LEN))
+    with open(p("ca.bin"), "wb") as f:
+        f.write(blob)
+
+    rows = ["key,type,encoding,value", "tls,namespace,,", "ca,file,binary,%s" % p("ca.bin")]
+    spki_hex = []
+    if args.pin:
+        # SPKI 指纹: 服务器证书公钥 DER 的 SHA-256；Broker 证书链的指纹用 --pin-cert 追加
+        pins = b""
+        for cert in [p("server.pem")] + (args.pin_cert or []):
+            pub = openssl("x509", "-in", cert, "-pubkey", "-noout")
+            der = openssl("pkey", "-pubin", "-outform", "der", data=pub)
+            digest = hashlib.sha256(der).digest()
+            pins += digest
+            spki_hex.append("%s  %s" % (digest.hex(), cert))
+        if len(pins) // 32 > 4:
+            sys.exit("at most 4 SPKI pins (TLS_PIN_MAX)")
+        with open(p("spki.bin"), "wb") as f:
+            f.write(pins)
+        rows.append("spki,file,binary,%s" % p("spki.bin"))
+    with open(p("tls_nvs.csv"), "w", encoding="utf-8") as f:
+        f.write("\n".join(rows) + "\n")
+
+    print("CA / server certificate written to %s (server SAN %s)" % (out, san))
+    print("CA chain blob: %d / %d bytes" % (len(blob), TLS_CA_MAX_LEN))
+    for line in spki_hex:
+        print("SPKI pin: %s" % line)
+    size = nvs_partition_size()
+    print("\nNVS image (namespace tls) for the bench device:")
+    print("  python $IDF_PATH/components/nvs_flash/nvs_partition_generator/nvs_partition_gen.py \\")
+    print("      generate %s %s 0x%x" % (p("tls_nvs.csv"), p("tls_nvs.bin"), size or 0x6000))
+    print("  esptool.py write_flash 0x9000 %s   # replaces the whole nvs partition" % p("tls_nvs.bin"))
+
+
+# ---------------------------------------------------------------- serve
+
+class DropBudget:
+    """跨连接共享的断开次数 (0 表示每次都断开)"""
+
+    def __init__(self, times):
+        self.left = times
+        self.unlimited = times == 0
+        self.lock = threading.Lock()
+
+    def take(self):
+        with self.lock:
+            if self.unlimited:
+                return True
+            if self.left > 0:
+                self.left -= 1
+                return True
+            return False
+
+
+class OtaHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"  # 设备开启 keep-alive
+    server_version = "ota-test"
+
+    def log_message(self, fmt, *args):
+        sys.stderr.write("%s %s %s\n" % (time.strftime("%H:%M:%S"), self.client_address[0], fmt % args))
+
+    def finish(self):
+        try:
+            super().finish()
+        except (OSError, ValueError):
+            pass  # 主动断开后刷写缓冲区会失败
+
+    def parse_range(self, total):
+        """返回 (start, end) 或 None (无 Range / 被忽略)；范围无效时返回 False"""
+        hdr = self.headers.get("Range")
+        if not hdr:
+            return None
+        if self.server.opts.ignore_range:
+            self.log_message("ignoring %s", hdr)
+            return None
+        m = re.fullmatch(r"bytes=(\d*)-(\d*)", hdr.strip())
+        if not m or (not m.group(1) and not m.group(2)):
+            return False
+        if m.group(1):
+            start = int(m.group(1))
+            end = int(m.group(2)) if m.group(2) else total - 1
+        else:  # bytes=-N 取最后 N 字节
+            start = max(0, total - int(m.group(2)))
+            end = total - 1
+        end = min(end, total - 1)
+        if start > end:
+            return False
+        return start, end
+
+    def send_head(self):
+        data = self.server.image
+        total = len(data)
+        rng = self.parse_range(total)
+        if rng is False:
+            self.send_response(416)
+            self.send_header("Content-Range", "bytes */%d" % total)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return None
+        if rng is None:
+            start, end = 0, total - 1
+            self.send_response(200)
+        else:
+            start, end = rng
+            self.send_response(206)
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, total))
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(end - start + 1))
+        self.send_header("Accept-Ranges", "none" if self.server.opts.ignore_range else "bytes")
+        self.end_headers()
+        return start, end
+
+    def do_HEAD(self):
+        self.send_head()
+
+    def do_GET(self):
+        span = self.send_head()
+        if span is None:
+            return
+        opts = self.server.opts
+        start, end = span
+        pos, sent = start, 0
+        t0 = time.monotonic()
+        drop = 0 < opts.drop_after < end + 1 - start and self.server.drops.take()
+        while pos <= end:
+            n = min(CHUNK, end + 1 - pos)
+            if drop and sent + n >= opts.drop_after:
+                n = max(0, opts.drop_after - sent)
+            self.wfile.write(self.server.image[pos:pos + n])
+            pos += n
+            sent += n
+            if drop and sent >= opts.drop_after:
+                self.wfile.flush()
+                self.log_message("dropping connection after %d bytes (offset %d%s)", sent, pos,
+                                 ", RST" if opts.rst else "")
+                self.abort()
+                return
+            if opts.rate > 0:
+                ahead = sent / (opts.rate * 1024) - (time.monotonic() - t0)
+                if ahead > 0:
+                    time.sleep(ahead)
+        self.log_message("sent bytes %d-%d (%d bytes)", start, end, sent)
+
+    def abort(self):
+        sock = self.connection
+        if self.server.opts.rst:
+            # SO_LINGER=0: close 时直接发 RST，模拟网络异常而不是正常关闭
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+        else:
+            try:
+                sock.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+        sock.close()
+        self.close_connection = True
+
+
+def cmd_serve(args):
+    with open(args.image, "rb") as f:
+        image = f.read()
+
+    httpd = http.server.ThreadingHTTPServer((args.bind, args.port), OtaHandler)
+    httpd.daemon_threads = True
+    httpd.image = image
+    httpd.opts = args
+    httpd.drops = DropBudget(args.drop_times)
+
+    scheme = "http"
+    if args.cert:
+        ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        ctx.load_cert_chain(args.cert, args.key)
+        httpd.socket = ctx.wrap_socket(httpd.socket, server_side=True)
+        scheme = "https"
+    elif not args.plain:
+        sys.exit("--cert/--key required (the firmware only accepts https); use --plain for curl checks")
+
+    print("serving %s (%d bytes, sha256 %s)" % (args.image, len(image), hashlib.sha256(image).hexdigest()[:16]))
+    print("url: %s://<host>:%d/%s" % (scheme, args.port, os.path.basename(args.image)))
+    print("drop after %s bytes x %s, range %s, rate %s" % (
+        args.drop_after or "-", args.drop_times if args.drop_times else "always",
+        "ignored" if args.ignore_range else "honoured",
+        "%d KB/s" % args.rate if args.rate else "unlimited"))
+    try:
+        httpd.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = ap.add_subparsers(dest="cmd", required=True)
+
+    c = sub.add_parser("certs", help="生成测试 CA / 服务器证书与 NVS CSV")
+    c.add_argument("--host", required=True, help="OTA 地址中的主机名或 IP (写入证书 SAN)")
+    c.add_argument("--out", default="ota_test", help="输出目录")
+    c.add_argument("--days", type=int, default=365)
+    c.add_argument("--extra-ca", action="append", help="一并写入 NVS 的其他 CA (Broker 的 CA 必须包含)")
+    c.add_argument("--pin", action="store_true", help="同时写入 SPKI 指纹 (服务器证书公钥)")
+    c.add_argument("--pin-cert", action="append", help="追加指纹的证书 (启用 --pin 时 Broker 证书也要加入)")
+    c.set_defaults(func=cmd_certs)
+
+    s = sub.add_parser("serve", help="提供固件镜像")
+    s.add_argument("--image", required=True, help="固件镜像 (build/<project>.bin)")
+    s.add_argument("--bind", default="0.0.0.0")
+    s.add_argument("--port", type=int, default=8443)
+    s.add_argument("--cert", help="服务器证书 (certs 生成的 server.pem)")
+    s.add_argument("--key", help="服务器私钥")
+    s.add_argument("--plain", action="store_true", help="不启用 TLS (只用于 curl 自测)")
+    s.add_argument("--drop-after", type=int, default=0, help="每个响应发送该字节数后断开 (0 = 不断开)")
+    s.add_argument("--drop-times", type=int, default=1, help="断开次数，0 = 每个响应都断开")
+    s.add_argument("--rst", action="store_true", help="以 RST 断开 (默认 FIN)")
+    s.add_argument("--ignore-range", action="store_true", help="忽略 Range，始终返回 200 与完整镜像")
+    s.add_argument("--rate", type=int, default=0, help="限速 KB/s (0 = 不限速)")
+    s.set_defaults(func=cmd_serve)
+
+    args = ap.parse_args()
+    if args.cmd == "serve" and bool(args.cert) != bool(args.key):
+        ap.error("--cert and --key go together")
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()
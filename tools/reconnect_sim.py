@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+"""MQTT 重连退避与上报相位的主机侧仿真 (不依赖硬件与 Broker)
+
+模拟 Broker 重启后全网设备同时断线的场景，按 mqtt_manager.c 中的退避算法
+(第一次重连 [BASE, FIRST_MAX] 均匀分散，之后 [BASE, 上次*3] 封顶 CAP) 推演重连过程：
+Broker 每秒最多接受 --capacity 个 CONNECT，超出的连接失败并继续退避。
+同时按 DeviceID 哈希 (FNV-1a) 统计 60 秒定时上报与 5 分钟指标上报的相位分布。
+
+参数默认直接从 components/mqtt_manager/src/mqtt_manager.c 的 #define 读取，
+修改固件中的退避参数后重新运行即可评估。
+
+用法:
+    python3 tools/reconnect_sim.py --devices 20000 --capacity 500
+    python3 tools/reconnect_sim.py --devices 5000 --capacity 200 --runs 5 --seed 1
+    python3 tools/reconnect_sim.py --first-max 10000 --seed 1   # 覆盖固件参数，评估修改前后的差异
+"""
+
+import argparse
+import os
+import random
+import re
+import sys
+
+SRC = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..",
+                   "components", "mqtt_manager", "src", "mqtt_manager.c")
+
+DEFAULTS = {
+    "RECONNECT_BASE_MS": 2000,
+    "RECONNECT_FIRST_MAX_MS": 30000,
+    "RECONNECT_CAP_MS": 300000,
+    "METRICS_REPORT_INTERVAL_S": 300,
+}
+
+
+def parse_product(expr):
+    """解析宏的取值：只接受以 * 连接的十进制整数 (如 10 * 60 * 1000)，其余形式返回 None"""
+    factors = expr.split("*")
+    value = 1
+    for f in factors:
+        f = f.strip()
+        if not f.isdigit():
+            return None
+        value *= int(f)
+    return value
+
+
+def load_constants(path):
+    consts = dict(DEFAULTS)
+    try:
+        with open(path, encoding="utf-8") as f:
+            text = f.read()
+    except OSError:
+        print(f"warning: {path} not found, using built-in defaults", file=sys.stderr)
+        return consts
+    for name in consts:
+        m = re.search(r"^#define\s+%s\s+\(?([0-9 *]+)\)?" % name, text, re.M)
+        if not m:
+            continue
+        value = parse_product(m.group(1))
+        if value is None:
+            print("warning: cannot parse %s = %r, using %d" % (name, m.group(1), consts[name]), file=sys.stderr)
+        else:
+            consts[name] = value
+    return consts
+
+
+def fnv1a(s):
+    h = 2166136261
+    for b in s.encode():
+        h ^= b
+        h = (h * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def draw(rng, base, hi, cap):
+    hi = min(hi, cap)
+    return base + rng.randint(0, hi - base)
+
+
+def simulate(n, capacity, c, rng, horizon_s):
+    """返回 (每秒 CONNECT 尝试数, 每秒成功数, 各设备连上的时刻 ms, 仿真结束仍离线的设备数)"""
+    base, first, cap = c["RECONNECT_BASE_MS"], c["RECONNECT_FIRST_MAX_MS"], c["RECONNECT_CAP_MS"]
+    # (下次尝试时刻 ms, 当前等待 ms)
+    pending = []
+    for _ in range(n):
+        wait = draw(rng, base, first, cap)
+        pending.append((wait, wait))
+    attempts = [0] * horizon_s
+    accepted = [0] * horizon_s
+    done_at = []
+    for sec in range(horizon_s):
+        lo, hi = sec * 1000, (sec + 1) * 1000
+        due = [p for p in pending if lo <= p[0] < hi]
+        if not due:
+            if not pending:
+                break
+            continue
+        pending = [p for p in pending if not (lo <= p[0] < hi)]
+        rng.shuffle(due)
+        attempts[sec] = len(due)
+        for i, (t, wait) in enumerate(due):
+            if i < capacity:
+                accepted[sec] += 1
+                done_at.append(t)
+            else:
+                nxt = draw(rng, base, wait * 3, cap)
+                pending.append((t + nxt, nxt))
+    return attempts, accepted, done_at, len(pending)
+
+
+def percentile(sorted_vals, pct):
+    if not sorted_vals:
+        return float("nan")
+    k = min(len(sorted_vals) - 1, int(len(sorted_vals) * pct / 100))
+    return sorted_vals[k]
+
+
+def phase_histogram(n, period):
+    buckets = [0] * period
+    for i in range(n):
+        # 未写入 SN 时 DeviceID 为小写 MAC 十六进制 (protocol_get_device_id)
+        buckets[fnv1a("%012x" % (0x24a160000000 + i)) % period] += 1
+    return buckets
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--devices", type=int, default=10000, help="同时断线的设备数")
+    ap.add_argument("--capacity", type=int, default=300, help="Broker 每秒可接受的 CONNECT 数")
+    ap.add_argument("--runs", type=int, default=3, help="重复次数 (不同随机种子)")
+    ap.add_argument("--seed", type=int, default=None)
+    ap.add_argument("--horizon", type=int, default=3600, help="仿真时长 (秒)")
+    ap.add_argument("--src", default=SRC, help="读取退避参数的源文件")
+    ap.add_argument("--base", type=int, default=None, help="覆盖 RECONNECT_BASE_MS")
+    ap.add_argument("--first-max", type=int, default=None, help="覆盖 RECONNECT_FIRST_MAX_MS")
+    ap.add_argument("--cap", type=int, default=None, help="覆盖 RECONNECT_CAP_MS")
+    args = ap.parse_args()
+
+    c = load_constants(args.src)
+    for name, value in (("RECONNECT_BASE_MS", args.base), ("RECONNECT_FIRST_MAX_MS", args.first_max),
+                        ("RECONNECT_CAP_MS", args.cap)):
+        if value is not None:
+            c[name] = value
+    if not 0 < c["RECONNECT_BASE_MS"] <= c["RECONNECT_FIRST_MAX_MS"] <= c["RECONNECT_CAP_MS"]:
+        ap.error("need 0 < base <= first-max <= cap")
+    print("backoff: base %d ms, first reconnect <= %d ms, cap %d ms" %
+          (c["RECONNECT_BASE_MS"], c["RECONNECT_FIRST_MAX_MS"], c["RECONNECT_CAP_MS"]))
+    print("fleet: %d devices, broker accepts %d CONNECT/s" % (args.devices, args.capacity))
+
+    rng = random.Random(args.seed)
+    ok = True
+    for run in range(args.runs):
+        attempts, accepted, done_at, left = simulate(args.devices, args.capacity, c, rng, args.horizon)
+        done_at.sort()
+        peak = max(attempts)
+        rejected = sum(attempts) - sum(accepted)
+        print("run %d: peak %d CONNECT/s (%.1fx capacity), %d rejected, "
+              "50%% online %.1fs, 95%% %.1fs, 100%% %.1fs%s" %
+              (run + 1, peak, peak / args.capacity, rejected,
+               percentile(done_at, 50) / 1000, percentile(done_at, 95) / 1000,
+               done_at[-1] / 1000 if done_at and not left else float("inf"),
+               ", %d still offline" % left if left else ""))
+        ok = ok and left == 0
+
+    for period, label in ((60, "60s report"), (c["METRICS_REPORT_INTERVAL_S"], "metrics report")):
+        h = phase_histogram(args.devices, period)
+        mean = args.devices / period
+        print("%s phase: max %d / mean %.1f per second (%.2fx)" % (label, max(h), mean, max(h) / mean))
+
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())